@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compare thread placements on one pair of inputs: the default shared pool, left to the
+# scheduler, against --affinity. Each is run REPEATS times; wall-clock seconds are printed.
+#
+#   bench/bench_affinity.sh input1.bam input2.bam [threads] [repeats]
+
+set -e
+
+BAMCMP=${BAMCMP:-build/bamcmp}
+IN1=$1
+IN2=$2
+THREADS=${3:-16}
+REPEATS=${4:-3}
+
+if [ -z "$IN1" ] || [ -z "$IN2" ]; then
+    echo "Usage: $0 input1.bam input2.bam [threads] [repeats]" >&2
+    exit 1
+fi
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+run()
+{
+    label=$1
+    shift
+    i=1
+    while [ $i -le $REPEATS ]; do
+        start=$(date +%s.%N)
+        "$BAMCMP" -n -1 "$IN1" -2 "$IN2" -t "$THREADS" -A "$OUT/A.bam" -B "$OUT/B.bam" "$@" > /dev/null 2>&1
+        end=$(date +%s.%N)
+        echo "$label run $i: $(echo "$end - $start" | bc) s"
+        i=$((i + 1))
+    done
+}
+
+run "shared pool"
+run "--affinity" --affinity
@@ -0,0 +1,146 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Throughput of the join / score / route loop alone: synthetic paired records are fed
+// from memory and counted on the way out, so no decompression or I/O is timed. Runs
+// every scoring method under both name orderings. Build it against two revisions to
+// compare them:
+//
+//   make bench && build/bench_join [pairs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <htslib/sam.h>
+
+#include "BamCmpEngine.h"
+#include "RecordSink.h"
+#include "RecordSource.h"
+
+class VectorSource : public RecordSource
+{
+    public:
+        VectorSource(const std::vector<bam1_t*>& _recs) : recs(_recs), pos(0) {}
+        bool is_eof() const { return pos == recs.size(); }
+        void next() { ++pos; }
+        bam1_t* getRec() { return recs[pos]; }
+    private:
+        const std::vector<bam1_t*>& recs;
+        size_t pos;
+};
+
+static void countRecord(int headerNum, bam1_t* rec, void* data)
+{
+    ++*(uint64_t*)data;
+}
+
+// A 100-base read aligned as 100M with the given NM and MAPQ.
+static bam1_t* makeRecord(const char* qname, uint16_t flag, int32_t nm, uint8_t mapq)
+{
+    const int len = 100;
+    bam1_t* rec = bam_init1();
+    int l_qname = strlen(qname) + 1;
+    rec->core.tid = 0;
+    rec->core.pos = 1000;
+    rec->core.qual = mapq;
+    rec->core.flag = flag;
+    rec->core.l_qname = l_qname;
+    rec->core.l_extranul = 0;
+    rec->core.n_cigar = 1;
+    rec->core.l_qseq = len;
+    rec->core.mtid = 0;
+    rec->core.mpos = 1200;
+    rec->core.isize = 300;
+    rec->l_data = l_qname + 4 + (len + 1) / 2 + len;
+    rec->m_data = rec->l_data;
+    rec->data = (uint8_t*)calloc(rec->m_data, 1);
+    memcpy(rec->data, qname, l_qname);
+    uint32_t cigar = bam_cigar_gen(len, BAM_CMATCH);
+    memcpy(rec->data + l_qname, &cigar, 4);
+    memset(bam_get_qual(rec), 30, len);
+    bam_aux_append(rec, "NM", 'i', sizeof(nm), (uint8_t*)&nm);
+    int32_t as = len - 2 * nm;
+    bam_aux_append(rec, "AS", 'i', sizeof(as), (uint8_t*)&as);
+    return rec;
+}
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    size_t pairs = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+
+    // Every pair is in both inputs, with pseudo-random edit distances so either side can win.
+    std::vector<bam1_t*> recs1, recs2;
+    char qname[32];
+    unsigned int seed = 1;
+    for(size_t i = 0; i < pairs; ++i)
+    {
+        snprintf(qname, sizeof(qname), "read%010lu", (unsigned long)i);
+        for(int mate = 0; mate < 2; ++mate)
+        {
+            uint16_t flag = BAM_FPAIRED | (mate ? BAM_FREAD2 : BAM_FREAD1);
+            recs1.push_back(makeRecord(qname, flag, rand_r(&seed) % 5, 60));
+            recs2.push_back(makeRecord(qname, flag, rand_r(&seed) % 5, rand_r(&seed) % 61));
+        }
+    }
+
+    const char* methodNames[] = { "match", "as", "mapq", "balwayswins" };
+    const scoringmethods methods[] = { scoringmethod_nmatches, scoringmethod_astag, scoringmethod_mapq, scoringmethod_balwayswins };
+    printf("%-12s %-8s %10s %12s\n", "scoring", "order", "seconds", "Mrecords/s");
+    for(int m = 0; m < 4; ++m)
+    {
+        for(int mixed = 1; mixed >= 0; --mixed)
+        {
+            uint64_t written = 0;
+            CallbackSink sink(countRecord, &written);
+            BamCmpEngine engine(methods[m], mixed);
+            engine.setSink(BamCmpEngine::first_better, &sink);
+            engine.setSink(BamCmpEngine::second_better, &sink);
+            engine.setSink(BamCmpEngine::first_worse, &sink);
+            engine.setSink(BamCmpEngine::second_worse, &sink);
+            VectorSource in1(recs1), in2(recs2);
+
+            double start = seconds();
+            engine.run(in1, in2);
+            double elapsed = seconds() - start;
+            printf("%-12s %-8s %10.3f %12.2f\n", methodNames[m], mixed ? "-n" : "-N", elapsed, (recs1.size() + recs2.size()) / elapsed / 1e6);
+            if(written != recs1.size() + recs2.size())
+            {
+                fprintf(stderr, "Expected %lu records out, got %lu\n", (unsigned long)(recs1.size() + recs2.size()), (unsigned long)written);
+                return 1;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < recs1.size(); ++i)
+    {
+        bam_destroy1(recs1[i]);
+        bam_destroy1(recs2[i]);
+    }
+    return 0;
+}
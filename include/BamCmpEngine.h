@@ -0,0 +1,81 @@
+#ifndef BAMCMPENGINE_H
+#define BAMCMPENGINE_H
+
+#include <string>
+#include <vector>
+#include <htslib/sam.h>
+
+#include "Checkpoint.h"
+#include "Estimator.h"
+#include "FastaMap.h"
+#include "GenomeSplitter.h"
+#include "GroupBuffer.h"
+#include "RecordSink.h"
+#include "RecordSource.h"
+#include "util.h"
+
+enum scoringmethods
+{
+    scoringmethod_nmatches,
+    scoringmethod_astag,
+    scoringmethod_mapq,
+    scoringmethod_balwayswins
+};
+
+// The join / score / route core of bamcmp. Takes two qname-sorted record sources and
+// delivers every record to the sink for its category; categories without a sink are
+// dropped. The bamcmp command line is a thin wrapper around this, and it can equally
+// be fed from and deliver to in-process code.
+class BamCmpEngine
+{
+    public:
+        enum category
+        {
+            first_only,
+            second_only,
+            first_better,
+            second_better,
+            first_worse,
+            second_worse,
+            n_categories
+        };
+        static int categoryOfKey(const std::string& key);
+        BamCmpEngine(scoringmethods _scoringmethod, bool _mixed_ordering);
+        virtual ~BamCmpEngine();
+        void setSink(category cat, RecordSink* sink);
+        void setCheckpoint(Checkpoint* _checkpoint);
+        void setMaxGroupMemory(uint64_t bytes);
+        int requiredFields(int input) const;
+        void setAllScores(bool _allScores);
+        void setEstimator(Estimator* _estimator);
+        void setReference(int input, const FastaMap* fasta, const bam_hdr_t* header);
+        void run(RecordSource& in1, RecordSource& in2);
+        void runSplit(GenomeSplitter& splitter);
+        uint32_t score(bam1_t* rec, bool is_input_a);
+    protected:
+    private:
+        scoringmethods scoringmethod;
+        bool mixed_ordering;
+        bool warned_nm_anomaly;
+        bool warned_nm_md_tags;
+        bool warned_group_spill;
+        bool allScores;
+        RecordSink* sinks[n_categories];
+        Checkpoint* checkpoint;
+        Estimator* estimator;
+        ReferenceLookup* refs[2];
+        GroupBuffer group1, group2;
+        std::string qname;
+        template<scoringmethods method> uint32_t scoreWith(bam1_t* rec, bool is_input_a);
+        uint32_t matchesScore(bam1_t* rec, const AuxTags& tags, int input);
+        void addAllScores(bam1_t* rec, int input);
+        template<scoringmethods method> uint32_t bestScore(GroupBuffer& group, int mate, bool is_input_a);
+        template<scoringmethods method, bool mixed> void runWith(RecordSource& in1, RecordSource& in2);
+        template<scoringmethods method> void processGroup(RecordSource& in1, RecordSource& in2);
+        void skipGroup(RecordSource& in1, RecordSource& in2);
+        void writeOneSided(RecordSource& in, int input, RecordSink* out);
+        void countOneSided(const bam1_t* rec, Estimator::outcome o);
+        void route(GroupBuffer& group, int input, RecordSink** mateSinks, const bool* matched, const uint32_t* score1, const uint32_t* score2);
+};
+
+#endif // BAMCMPENGINE_H
@@ -13,11 +13,13 @@ class BamRecVector
         void copy_add(bam1_t* src);
         void clear();
         void sort();
-        unsigned int size();
+        unsigned int size() const;
         bam1_t* get (int index);
     protected:
     private:
         std::vector<bam1_t*> recs;
+        std::vector<bam1_t*> spare;
+        uint64_t spareBytes;
 };
 
 #endif // BAMRECVECTOR_H
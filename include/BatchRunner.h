@@ -0,0 +1,58 @@
+#ifndef BATCHRUNNER_H
+#define BATCHRUNNER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <htslib/hts.h>
+
+#include "BamCmpEngine.h"
+#include "OutputFormat.h"
+#include "RefCache.h"
+
+// Runs many input pairs, listed in a manifest, inside one process. A fixed set of
+// join threads each take the largest sample not yet started, so one long sample
+// overlaps the many short ones rather than finishing alone at the end, and all
+// samples share one htslib pool for (de)compression.
+class BatchRunner
+{
+    public:
+        BatchRunner(const char* manifest, scoringmethods _scoringmethod, bool _mixed_ordering, const OutputFormat* _formats,
+                    const char* defaultRef1, const char* defaultRef2, const std::string& _refCachePattern);
+        virtual ~BatchRunner();
+        size_t size() const;
+        void setMaxGroupMemory(uint64_t bytes);
+        void setAllScores(bool _allScores);
+        void run(int jobs, htsThreadPool* _pool);
+    protected:
+    private:
+        struct Sample
+        {
+            int line;
+            std::string in1;
+            std::string in2;
+            std::string outputs[BamCmpEngine::n_categories];
+            RefCache* ref1;
+            RefCache* ref2;
+            uint64_t bytes;
+        };
+        std::vector<Sample> samples;
+        std::map<std::string, RefCache*> refs;
+        scoringmethods scoringmethod;
+        bool mixed_ordering;
+        OutputFormat formats[BamCmpEngine::n_categories];
+        std::string refCachePattern;
+        uint64_t maxGroupMemory;
+        bool allScores;
+        htsThreadPool* pool;
+        pthread_mutex_t lock;
+        size_t nextSample;
+        size_t nDone;
+        RefCache* getRef(const std::string& fasta);
+        void checkOutputNames() const;
+        void runSample(const Sample& s);
+        static void* worker(void* arg);
+};
+
+#endif // BATCHRUNNER_H
@@ -0,0 +1,34 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+#include "SamReader.h"
+
+// Periodic record of how far a run has got, so that a preempted run can carry on
+// with --resume and produce exactly the output an uninterrupted run would have.
+class Checkpoint
+{
+    public:
+        Checkpoint(const char* _fname, uint64_t _interval, SamReader* _in1, SamReader* _in2, bool _mixed_ordering);
+        virtual ~Checkpoint();
+        void atBoundary();
+        bool due() const;
+        void save();
+        void resume();
+        void remove();
+    protected:
+    private:
+        std::string fname;
+        SamReader* in1;
+        SamReader* in2;
+        bool mixed_ordering;
+        uint64_t interval;
+        uint64_t next_at;
+        std::map<std::string, int64_t> outputOffsets;
+        void load(int64_t offsets[2], uint64_t counts[2], std::string inputNames[2], std::string& last_qname);
+};
+
+#endif // CHECKPOINT_H
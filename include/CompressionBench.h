@@ -0,0 +1,34 @@
+#ifndef COMPRESSIONBENCH_H
+#define COMPRESSIONBENCH_H
+
+#include <string>
+#include <vector>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+#include "OutputFormat.h"
+
+// "bamcmp bench-compress": load a sample of the user's own records, write them once
+// per output format setting to a temporary file, and report throughput (MB/s of BAM
+// record data) and compression ratio for each, to choose -O settings by.
+class CompressionBench
+{
+    public:
+        CompressionBench(const char* _input, uint64_t maxRecords, const char* _ref, htsThreadPool* _pool);
+        virtual ~CompressionBench();
+        void addSetting(const OutputFormat& format);
+        void addDefaultSettings();
+        void run();
+    protected:
+    private:
+        std::string input;
+        const char* ref;
+        htsThreadPool* pool;
+        bam_hdr_t* header;
+        std::vector<bam1_t*> records;
+        uint64_t rawBytes;
+        std::vector<OutputFormat> settings;
+        void runOne(const OutputFormat& format);
+};
+
+#endif // COMPRESSIONBENCH_H
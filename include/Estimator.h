@@ -0,0 +1,56 @@
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+
+// --estimate: classify only the reads whose qname hashes below a threshold, and report
+// the fraction of reads in each category with a 95% Wilson score interval. The hash
+// depends only on the qname, so both inputs sample the same reads and the sample is
+// classified exactly as a full run would classify it. Optionally stops as soon as
+// every interval's half-width is within a tolerance.
+class Estimator
+{
+    public:
+        enum outcome
+        {
+            first_only,
+            second_only,
+            first_better,
+            second_better,
+            n_outcomes
+        };
+        Estimator(double _fraction, double _tolerance);
+        virtual ~Estimator();
+        // Called for every group and one-sided record, so inline.
+        bool sampled(const char* qname) const
+        {
+            return qname_hash(qname) <= threshold;
+        }
+        void count(outcome o)
+        {
+            ++counts[o];
+            ++total;
+        }
+        bool done();
+        bool stopped() const
+        {
+            return stoppedEarly;
+        }
+        void report() const;
+    protected:
+    private:
+        double fraction;
+        double tolerance;
+        uint64_t threshold;
+        uint64_t counts[n_outcomes];
+        uint64_t total;
+        uint64_t nextCheck;
+        bool stoppedEarly;
+        double halfWidth(uint64_t k) const;
+        void interval(uint64_t k, double& lo, double& hi) const;
+};
+
+#endif // ESTIMATOR_H
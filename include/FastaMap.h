@@ -0,0 +1,52 @@
+#ifndef FASTAMAP_H
+#define FASTAMAP_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <htslib/sam.h>
+
+// An uncompressed FASTA memory-mapped and addressed through its .fai index, for
+// counting where a read's M bases differ from the reference when the input has
+// neither =/X operators nor NM or MD tags. Read-only once built, so any number of
+// threads can share one.
+class FastaMap
+{
+    public:
+        struct Entry
+        {
+            int64_t length;
+            int64_t offset;
+            int64_t lineBases;
+            int64_t lineWidth;
+        };
+        FastaMap(const char* _fasta);
+        virtual ~FastaMap();
+        bool usable() const;
+        const Entry* find(const char* name) const;
+        uint32_t countMismatches(const Entry* e, int64_t pos, const uint8_t* seq, int32_t qpos, int32_t len) const;
+    protected:
+    private:
+        std::string fasta;
+        const char* base;
+        size_t size;
+        std::map<std::string, Entry> entries;
+        void loadIndex();
+};
+
+// One input's reference sequences in its header's tid order.
+class ReferenceLookup
+{
+    public:
+        ReferenceLookup(const FastaMap* _fasta, const bam_hdr_t* header);
+        virtual ~ReferenceLookup();
+        bool canCount(const bam1_t* rec) const;
+        uint32_t countMismatches(const bam1_t* rec) const;
+    protected:
+    private:
+        const FastaMap* fasta;
+        std::vector<const FastaMap::Entry*> byTid;
+};
+
+#endif // FASTAMAP_H
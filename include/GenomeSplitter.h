@@ -0,0 +1,47 @@
+#ifndef GENOMESPLITTER_H
+#define GENOMESPLITTER_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <htslib/sam.h>
+
+#include "RecordSource.h"
+
+// Presents one name-sorted input, aligned against a concatenated host + graft reference,
+// as two record sources: one per genome, as if each had been aligned separately.
+// Unmapped records belong to both genomes, just as an aligner would report them in both.
+// The input is split one qname group at a time: after nextGroup(), each side holds just
+// that group's records for its genome, possibly none, and reaches EOF at the group's end.
+// A genome with no alignments in a group is therefore never read ahead for.
+class GenomeSplitter
+{
+    public:
+        GenomeSplitter(RecordSource* _reader, const std::vector<int>& _genomeOfTid);
+        virtual ~GenomeSplitter();
+        static std::vector<int> assignGenomes(const bam_hdr_t* header, const std::vector<std::string>& prefixes1, const std::vector<std::string>& prefixes2,
+                                              const char* contigs1, const char* contigs2);
+        RecordSource* getSide(int genome);
+        bool nextGroup();
+    protected:
+    private:
+        class Side : public RecordSource
+        {
+            public:
+                Side();
+                virtual ~Side();
+                bool is_eof() const;
+                void next();
+                bam1_t* getRec();
+                void push(const bam1_t* rec);
+                void clear();
+                std::deque<bam1_t*> queue;
+        };
+        RecordSource* reader;
+        std::vector<int> genomeOfTid;
+        Side side1;
+        Side side2;
+        std::string qname;
+};
+
+#endif // GENOMESPLITTER_H
@@ -0,0 +1,43 @@
+#ifndef GROUPBUFFER_H
+#define GROUPBUFFER_H
+
+#include <stdio.h>
+#include <vector>
+#include <htslib/sam.h>
+
+#include "BamRecVector.h"
+
+// One input's records for a qname group, bucketed by mate (see flag2mate) and kept in
+// input order within each mate. Once the records held exceed the memory limit, the
+// rest of the group goes to a temporary file instead, so a runaway qname costs disk
+// rather than memory.
+class GroupBuffer
+{
+    public:
+        static const int n_mates = 3;
+        GroupBuffer();
+        virtual ~GroupBuffer();
+        void setLimit(uint64_t _limit);
+        void clear();
+        void add(bam1_t* rec);
+        unsigned int count(int mate) const;
+        bool spilled() const;
+        bam1_t* front(int mate);
+        void rewind(int mate);
+        bam1_t* next(int mate);
+    protected:
+    private:
+        uint64_t limit;
+        uint64_t used;
+        BamRecVector inMemory[n_mates];
+        std::vector<long> spillOffsets[n_mates];
+        FILE* spill;
+        long spillEnd;
+        bam1_t* spillRec;
+        unsigned int memPos[n_mates];
+        unsigned int spillPos[n_mates];
+        void spillOne(const bam1_t* rec, int mate);
+        void readSpilled(long offset);
+};
+
+#endif // GROUPBUFFER_H
@@ -1,37 +1,65 @@
 #ifndef HTSFILEWRAPPER_H
 #define HTSFILEWRAPPER_H
 
+#include <map>
 #include <string>
 #include <vector>
 #include <htslib/hts.h>
 #include <htslib/sam.h>
 
-class HTSFileWrapper
+#include "OutputFormat.h"
+#include "OutputStats.h"
+#include "RecordSink.h"
+#include "RefCache.h"
+
+class HTSFileWrapper : public RecordSink
 {
     public:
-        static HTSFileWrapper* begin_or_die(const char* fname, const char* mode, bam_hdr_t* header, int inputNumber, int nthreads);
+        static HTSFileWrapper* begin_or_die(const char* fname, const OutputFormat& format, bam_hdr_t* header, int inputNumber, htsThreadPool* pool, RefCache* ref);
         static void close(HTSFileWrapper* f);
-        HTSFileWrapper(const std::string& _fname, const char* _mode, int _nthreads);
+        static const std::vector<std::pair<std::string, HTSFileWrapper*> >& getOpenOutputs();
+        HTSFileWrapper(const std::string& _fname, const OutputFormat& _format, htsThreadPool* _pool);
         virtual ~HTSFileWrapper();
         void checkStarted();
         void setHeader1(bam_hdr_t* h1);
         void setHeader2(bam_hdr_t* h2);
+        void setReference1(RefCache* r1);
+        void setReference2(RefCache* r2);
         void write1(int headerNum, bam1_t* rec);
         void ref();
         uint32_t unref();
+        bool canCheckpoint() const;
+        int64_t flush();
+        void resumeAt(int64_t offset);
     protected:
     private:
         static std::vector<std::pair<std::string, HTSFileWrapper*> > openOutputs;
+        static std::map<std::pair<std::string, std::string>, bam_hdr_t*> mergedHeaders;
         std::string fname;
-        const char* mode;
+        OutputFormat format;
         htsFile* hts;
         uint32_t refCount;
-        int nthreads;
+        htsThreadPool* pool;
         int header2_offset;
         bam_hdr_t* header1;
         bam_hdr_t* header2;
         bam_hdr_t* headerOut;
+        bool ownsHeaderOut; // A copy only this output uses, rather than an input's or a shared combined header.
+        RefCache* ref1;
+        RefCache* ref2;
+        bool resuming;
+        uint64_t bufferBytes;
+        bool passthrough;
+        std::vector<uint8_t> pending;
+        bam1_t* slimRec;
+        OutputStats* stats;
+        bam1_t* slimCopy(const bam1_t* rec);
+        bool appendRaw(int headerNum, const bam1_t* rec);
+        void drainPending();
         void checkHeaderNotWritten();
+        void addM5Tags();
+        bam_hdr_t* findMergedHeader();
+        void storeMergedHeader();
 };
 
 #endif // HTSFILEWRAPPER_H
@@ -0,0 +1,45 @@
+#ifndef INPUTPREFETCHER_H
+#define INPUTPREFETCHER_H
+
+#include <string>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Keeps the page cache ahead of an input's reader, so htslib's synchronous reads (and
+// the decompression threads waiting on them) don't stall on network filesystems or
+// cold disks. A background thread keeps up to depth reads of chunk bytes in flight
+// through io_uring where that is available (built with USE_LIBURING=1), or else
+// issues posix_fadvise(WILLNEED) and reads each chunk itself.
+class InputPrefetcher
+{
+    public:
+        InputPrefetcher(const char* _fname, int _depth, size_t _chunk);
+        virtual ~InputPrefetcher();
+        void consumed(int64_t offset);
+        const char* backendName() const;
+    protected:
+    private:
+        std::string fname;
+        int fd;
+        int depth;
+        size_t chunk;
+        off_t filesize;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        bool stop;
+        void* ring;
+        off_t reader_pos;
+        off_t next_notify;
+        off_t issued; // Only touched by the read-ahead thread.
+        uint64_t bufferBytes;
+        static void* run(void* arg);
+        void loop();
+        void catchUp();
+        bool waitForRoom();
+        void loopUring();
+        void loopFadvise();
+};
+
+#endif // INPUTPREFETCHER_H
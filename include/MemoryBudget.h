@@ -0,0 +1,42 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <stdint.h>
+
+// --max-memory support: one process-wide account of the memory bamcmp's own buffers
+// hold, split by component. Components that can get by with less (qname groups spill
+// to disk, read-ahead shrinks its window) ask with tryReserve and back off when the
+// budget is spent; the rest reserve unconditionally, so their share is still counted
+// and squeezes the others. Peak use per component is reported at the end of the run.
+class MemoryBudget
+{
+    public:
+        enum component
+        {
+            component_groups,
+            component_splitter,
+            component_headers,
+            component_readahead,
+            component_inputs,
+            component_outputs,
+            n_components
+        };
+        static void setLimit(uint64_t _limit);
+        static uint64_t getLimit();
+        static bool tryReserve(component c, uint64_t bytes);
+        static void reserve(component c, uint64_t bytes);
+        static void release(component c, uint64_t bytes);
+        static void report();
+        static uint64_t getPeak(component c);
+    protected:
+    private:
+        static uint64_t limit;
+        static uint64_t total;
+        static uint64_t totalPeak;
+        static uint64_t used[n_components];
+        static uint64_t peak[n_components];
+        static uint64_t refused[n_components];
+        static void notePeak(uint64_t* p, uint64_t now);
+};
+
+#endif // MEMORYBUDGET_H
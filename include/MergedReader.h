@@ -0,0 +1,51 @@
+#ifndef MERGEDREADER_H
+#define MERGEDREADER_H
+
+#include <string>
+#include <vector>
+#include <htslib/sam.h>
+
+#include "InputPrefetcher.h"
+#include "RecordSource.h"
+#include "RefCache.h"
+#include "SamReader.h"
+
+// Several name-sorted files for one input, typically one per sequencing lane, read as a
+// single name-sorted stream by a k-way heap merge on qname. The lanes must have been
+// aligned against the same reference sequences; their read groups are combined into
+// one header. Each lane's decompression runs on the shared thread pool, so lanes are
+// decoded in parallel.
+class MergedReader : public RecordSource
+{
+    public:
+        MergedReader(const std::vector<std::string>& fnames, htsThreadPool* pool, RefCache* ref, bool _mixed_ordering);
+        virtual ~MergedReader();
+        bam_hdr_t* getHeader();
+        bool is_eof() const;
+        void next();
+        bam1_t* getRec();
+        void load();
+        void setRequiredFields(int fields);
+        void setPrefetch(int depth, size_t chunk);
+    protected:
+    private:
+        // Heap ordering: the lane whose record comes first is on top, ties going to the
+        // earlier lane.
+        struct LaneAfter
+        {
+            const MergedReader* owner;
+            bool operator()(int a, int b) const;
+        };
+        std::vector<std::string> filenames;
+        std::vector<htsFile*> files;
+        std::vector<bam_hdr_t*> headers;
+        std::vector<SamReader*> lanes;
+        std::vector<InputPrefetcher*> prefetchers;
+        std::vector<int> heap;
+        bam_hdr_t* header;
+        bool mixed_ordering;
+        uint64_t headerBytes;
+        void mergeHeaders();
+};
+
+#endif // MERGEDREADER_H
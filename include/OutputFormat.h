@@ -0,0 +1,41 @@
+#ifndef OUTPUTFORMAT_H
+#define OUTPUTFORMAT_H
+
+#include <string>
+#include <htslib/hts.h>
+
+// How an output file is written, from a -O style specification: a format (bam, cram or
+// sam) followed by comma-separated options:
+//   level=N            compression level 0-9 (BAM defaults to 1: fast, but still compressed)
+//   block_size=SIZE    size of the file's I/O buffer (K, M or G suffixes allowed)
+//   seqs_per_slice=N   CRAM records per slice
+//   slim               write only the core fields, qname, CIGAR and bamcmp's own score
+//                      tags; sequence and qualities become *
+//   stats              also write OUTPUT.stats.json: flagstat, idxstats and checksum
+//                      figures gathered while writing
+// Compression itself runs on the output thread pool.
+class OutputFormat
+{
+    public:
+        OutputFormat();
+        virtual ~OutputFormat();
+        bool parse(const std::string& spec);
+        const char* mode() const;
+        bool isCram() const;
+        bool isSlim() const;
+        bool isStats() const;
+        void setStats(bool _stats);
+        void apply(htsFile* hf) const;
+        std::string describe() const;
+    protected:
+    private:
+        std::string format;
+        std::string modeString;
+        int level;
+        uint64_t blockSize;
+        int seqsPerSlice;
+        bool slim;
+        bool stats;
+};
+
+#endif // OUTPUTFORMAT_H
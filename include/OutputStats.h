@@ -0,0 +1,61 @@
+#ifndef OUTPUTSTATS_H
+#define OUTPUTSTATS_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <htslib/sam.h>
+
+// What samtools flagstat, idxstats and checksum (with its default options) would report
+// for an output, gathered from the records as they are written rather than by reading
+// the file again, and written as JSON beside it.
+// Reference counts follow the output's own header, so an output taking both inputs
+// counts the combined A_ / B_ sequences.
+class OutputStats
+{
+    public:
+        OutputStats();
+        virtual ~OutputStats();
+        void add(const bam1_t* rec, int tid, int mtid);
+        void write(const std::string& fname, const bam_hdr_t* header) const;
+    protected:
+    private:
+        enum counter
+        {
+            total,
+            primary,
+            secondary,
+            supplementary,
+            duplicates,
+            primary_duplicates,
+            mapped,
+            primary_mapped,
+            paired,
+            read1,
+            read2,
+            properly_paired,
+            both_mapped,
+            singletons,
+            mate_other_chr,
+            mate_other_chr_mapq5,
+            n_counters
+        };
+        static const char* const counterNames[n_counters];
+        // [0] QC-passed, [1] QC-failed, as flagstat splits them.
+        uint64_t counts[2][n_counters];
+        std::vector<uint64_t> mappedOn;
+        std::vector<uint64_t> unmappedOn;
+        uint64_t unplaced;
+        uint64_t checksummed;
+        uint64_t flagProduct;
+        uint64_t nameProduct;
+        uint64_t seqProduct;
+        uint64_t qualProduct;
+        uint64_t auxProduct;
+        uint64_t recordProduct;
+        std::string seq;
+        std::string qual;
+        static uint64_t combine(uint64_t product, uint32_t crc);
+};
+
+#endif // OUTPUTSTATS_H
@@ -0,0 +1,60 @@
+#ifndef PREFLIGHT_H
+#define PREFLIGHT_H
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+// Checks the inputs before anything is written: the header's sort order, and for BAM
+// inputs samples of records from BGZF blocks spread across the file, decoded in
+// parallel. Within and between samples the qnames must be in one of the two orders
+// the join knows (samtools -n or Picard / htsjdk), which lets a run choose -n / -N for
+// itself or fail straight away, and the samples show whether the tags a scoring
+// method needs are there.
+class Preflight
+{
+    public:
+        Preflight(int _nthreads);
+        virtual ~Preflight();
+        void addFile(int input, const char* fname);
+        void run();
+        bool chooseOrdering(bool given, bool mixed_ordering);
+        void checkTags(int input, bool needAS, bool needMatches);
+    protected:
+    private:
+        struct Sample
+        {
+            int64_t coffset;
+            int64_t firstBlock;
+            int64_t lastBlock;
+            std::string first;
+            std::string last;
+            uint64_t nrecs;
+            uint64_t nmapped;
+            uint64_t withNM;
+            uint64_t withMD;
+            uint64_t withAS;
+            std::string badMixed;
+            std::string badLexical;
+        };
+        struct File
+        {
+            int input;
+            std::string fname;
+            std::string so;
+            std::string ss;
+            bool sampled;
+            std::vector<Sample> samples;
+        };
+        int nthreads;
+        std::vector<File> files;
+        std::vector<std::pair<size_t, size_t> > jobs;
+        size_t nextJob;
+        pthread_mutex_t lock;
+        static void* worker(void* arg);
+        void sample(File& f, size_t j);
+        bool fileFits(const File& f, bool mixed, std::string& why) const;
+};
+
+#endif // PREFLIGHT_H
@@ -0,0 +1,76 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <string>
+
+// --profile support: per-thread wall time and hardware counters (cycles, instructions,
+// LLC misses, branch misses) for each hot stage, a summary table, and a Chrome / Perfetto
+// trace of every stage instance on every thread. Stages are marked with PROFILE_SCOPE,
+// which costs one well-predicted branch while profiling is off, and nothing at all when
+// built with -DBAMCMP_NO_PROFILE.
+class Profiler
+{
+    public:
+        enum stage
+        {
+            stage_read1,
+            stage_read2,
+            stage_group,
+            stage_score,
+            stage_annotate,
+            stage_write,
+            n_stages
+        };
+        enum counter
+        {
+            counter_cycles,
+            counter_instructions,
+            counter_llc_misses,
+            counter_branch_misses,
+            n_counters
+        };
+        struct ThreadState;
+        static bool enabled;
+        static void start(const char* _traceFile);
+        static void finish();
+        static ThreadState* begin(uint64_t& startNs, uint64_t* startCounters);
+        static void end(ThreadState* ts, stage s, uint64_t startNs, const uint64_t* startCounters);
+    protected:
+    private:
+        static std::string traceFile;
+        static ThreadState* newThreadState();
+        static void readCounters(ThreadState* ts, uint64_t* out);
+};
+
+class ProfileScope
+{
+    public:
+        ProfileScope(Profiler::stage _s) : ts(0), s(_s)
+        {
+            if(Profiler::enabled)
+            {
+                ts = Profiler::begin(startNs, startCounters);
+            }
+        }
+        ~ProfileScope()
+        {
+            if(ts)
+            {
+                Profiler::end(ts, s, startNs, startCounters);
+            }
+        }
+    private:
+        Profiler::ThreadState* ts;
+        Profiler::stage s;
+        uint64_t startNs;
+        uint64_t startCounters[Profiler::n_counters];
+};
+
+#ifdef BAMCMP_NO_PROFILE
+#define PROFILE_SCOPE(s)
+#else
+#define PROFILE_SCOPE(s) ProfileScope profileScope(s)
+#endif
+
+#endif // PROFILER_H
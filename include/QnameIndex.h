@@ -0,0 +1,33 @@
+#ifndef QNAMEINDEX_H
+#define QNAMEINDEX_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <htslib/hts.h>
+
+// A sparse map from qname to position in a name-sorted BAM file: the virtual offset and
+// record count of every so many records, kept in a text sidecar file named after the
+// BAM with .qni appended. It lets a reader seek past long runs of records it would
+// only throw away, rather than decompressing them.
+class QnameIndex
+{
+    public:
+        static void build(const char* fname, bool mixed_ordering, uint64_t every, htsThreadPool* pool);
+        static QnameIndex* load(const char* fname, bool mixed_ordering);
+        virtual ~QnameIndex();
+        bool findBefore(const char* qname, int64_t& offset, uint64_t& count);
+        size_t size() const;
+    protected:
+    private:
+        QnameIndex(bool _mixed_ordering);
+        bool mixed_ordering;
+        std::vector<int64_t> offsets;
+        std::vector<uint64_t> counts;
+        std::vector<size_t> nameAt;
+        std::string names;
+        size_t cursor;
+        bool before(size_t entry, const char* qname) const;
+};
+
+#endif // QNAMEINDEX_H
@@ -0,0 +1,52 @@
+#ifndef READGROUPSPLITTER_H
+#define READGROUPSPLITTER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+#include "HTSFileWrapper.h"
+#include "OutputFormat.h"
+#include "RecordSink.h"
+#include "RefCache.h"
+
+// --split-rg: an output whose records are divided by their RG tag into one file per
+// read group, named by inserting the read group ID before the output's extension
+// (out.bam becomes out.<ID>.bam). Each file's header keeps only its own @RG line.
+// Files are opened when their first record arrives, and all share the output thread
+// pool. Records without an RG tag go to the output's own name, with no @RG lines.
+// Like HTSFileWrapper, outputs given the same name share one splitter.
+class ReadGroupSplitter : public RecordSink
+{
+    public:
+        static ReadGroupSplitter* begin_or_die(const char* fname, const OutputFormat& format, bam_hdr_t* header, int inputNumber, htsThreadPool* pool, RefCache* ref);
+        static void close(ReadGroupSplitter* s);
+        ReadGroupSplitter(const std::string& _fname, const OutputFormat& _format, htsThreadPool* _pool);
+        virtual ~ReadGroupSplitter();
+        void setInput(int inputNumber, bam_hdr_t* header, RefCache* ref);
+        void write1(int headerNum, bam1_t* rec);
+    protected:
+    private:
+        struct Output
+        {
+            HTSFileWrapper* file;
+            bam_hdr_t* headers[2];
+        };
+        static std::vector<std::pair<std::string, ReadGroupSplitter*> > openSplitters;
+        std::string fname;
+        OutputFormat format;
+        htsThreadPool* pool;
+        uint32_t refCount;
+        bam_hdr_t* headers[2];
+        RefCache* refs[2];
+        std::map<std::string, Output> outputs;
+        std::map<std::string, std::string> idOfFile;
+        std::string rg;
+        Output& open(const std::string& id);
+        std::string fileName(const std::string& id) const;
+        static bam_hdr_t* filterHeader(const bam_hdr_t* header, const std::string& id);
+};
+
+#endif // READGROUPSPLITTER_H
@@ -0,0 +1,30 @@
+#ifndef RECORDSINK_H
+#define RECORDSINK_H
+
+#include <htslib/sam.h>
+
+// Somewhere the join can deliver classified records. headerNum says which input's
+// header (1 or 2) the record's tid / mtid refer to.
+class RecordSink
+{
+    public:
+        virtual ~RecordSink() {}
+        virtual void write1(int headerNum, bam1_t* rec) = 0;
+};
+
+typedef void (*record_callback)(int headerNum, bam1_t* rec, void* data);
+
+// Hands each record to a function, for callers consuming records in-process.
+// The record is only valid for the duration of the call.
+class CallbackSink : public RecordSink
+{
+    public:
+        CallbackSink(record_callback _callback, void* _data) : callback(_callback), data(_data) {}
+        virtual ~CallbackSink() {}
+        void write1(int headerNum, bam1_t* rec) { callback(headerNum, rec, data); }
+    private:
+        record_callback callback;
+        void* data;
+};
+
+#endif // RECORDSINK_H
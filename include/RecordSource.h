@@ -0,0 +1,24 @@
+#ifndef RECORDSOURCE_H
+#define RECORDSOURCE_H
+
+#include <htslib/sam.h>
+
+// A stream of records in qname order, as consumed by the join.
+class RecordSource
+{
+    public:
+        virtual ~RecordSource() {}
+        virtual bool is_eof() const = 0;
+        virtual void next() = 0;
+        virtual bam1_t* getRec() = 0;
+        // Move forward, possibly past many records, to a record no later than the first
+        // whose qname doesn't sort before qname. For sources that can do this faster than
+        // calling next() repeatedly; false if nothing was skipped.
+        virtual bool skipTo(const char* qname) { return false; }
+        // Sources may at first present just the current record's core fields and qname.
+        // Call before looking at anything else (CIGAR, sequence, qualities, tags), or
+        // before keeping or writing the record; records never loaded are never decoded.
+        virtual void load() {}
+};
+
+#endif // RECORDSOURCE_H
@@ -0,0 +1,42 @@
+#ifndef REFCACHE_H
+#define REFCACHE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <pthread.h>
+#include <htslib/sam.h>
+
+#include "FastaMap.h"
+
+// A FASTA reference plus its entries in an htslib-style MD5-keyed reference cache
+// (REF_CACHE). htslib memory-maps sequences it finds in that cache, so every CRAM
+// input and output in the process shares one copy of each reference sequence.
+class RefCache
+{
+    public:
+        RefCache(const char* _fasta, const std::string& _cachePattern);
+        virtual ~RefCache();
+        static std::string defaultCachePattern();
+        static htsFile* openInput(const char* fname, htsThreadPool* pool, RefCache* ref, bam_hdr_t** header);
+        const char* fastaName() const;
+        void populate();
+        const char* md5(const std::string& seqname);
+        const FastaMap* sequences();
+        bool coversHeader(const bam_hdr_t* header);
+    protected:
+    private:
+        std::string fasta;
+        std::string cachePattern;
+        bool populated;
+        FastaMap* fastaMap;
+        bool fastaMapTried;
+        pthread_mutex_t lock;
+        std::map<std::string, std::string> md5s;
+        std::set<std::string> cachedMd5s;
+        void doPopulate();
+        std::string cachePath(const std::string& md5) const;
+        void store(const std::string& md5, const char* seq, int len) const;
+};
+
+#endif // REFCACHE_H
@@ -3,23 +3,59 @@
 
 #include <string>
 #include <htslib/sam.h>
+#include <htslib/bgzf.h>
 
-class SamReader
+#include "InputPrefetcher.h"
+#include "QnameIndex.h"
+#include "RecordSource.h"
+#include "SamTextParser.h"
+
+class SamReader : public RecordSource
 {
     public:
-        SamReader(htsFile* _hf, bam_hdr_t* _header, const char* fname);
+        SamReader(htsFile* _hf, bam_hdr_t* _header, const char* fname, bool _mixed_ordering, htsThreadPool* pool);
         virtual ~SamReader();
         bool is_eof() const;
         void next();
         bam1_t* getRec();
+        const std::string& getPrevQname() const;
+        bool is_seekable() const;
+        int64_t tell() const;
+        uint64_t count() const;
+        void seek(int64_t offset, uint64_t _count);
+        const std::string& getFilename() const;
+        void setPrefetcher(InputPrefetcher* _prefetcher);
+        void setRequiredFields(int fields);
+        void setIndex(QnameIndex* _index);
+        bool skipTo(const char* qname);
+        void load();
     protected:
     private:
         htsFile* hf;
         bam_hdr_t* header;
-        bam1_t *prev_rec;
+        std::string prev_qname;
         bam1_t *rec;
+        bam1_t *ownRec;
+        SamTextParser* textParser;
         bool eof;
+        bool seekable;
         std::string filename;
+        int64_t rec_offset;
+        uint64_t nconsumed;
+        BGZF* bgzf;
+        InputPrefetcher* prefetcher;
+        QnameIndex* index;
+        bool mixed_ordering;
+        bool coreOnly;
+        int32_t pendingBytes;
+        uint32_t pendingNCigar;
+        int32_t pendingLQseq;
+        uint64_t bufferBytes;
+        uint8_t skipbuf[4096];
+        void read();
+        int readCore();
+        void skipPending();
+        void expandLongCigar();
 };
 
 #endif // SAMREADER_H
@@ -0,0 +1,56 @@
+#ifndef SAMTEXTPARSER_H
+#define SAMTEXTPARSER_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+
+// Parses a SAM text input on the thread pool. The text after the header is read in
+// line-aligned chunks, each chunk is parsed into a batch of records by a pool job, and
+// batches come back in input order. Batches and their records are recycled once the
+// reader has moved past them, so steady-state parsing allocates nothing. With no pool
+// the chunks are parsed in the calling thread.
+class SamTextParser
+{
+    public:
+        SamTextParser(htsFile* _hf, bam_hdr_t* _header, const char* fname, htsThreadPool* pool);
+        virtual ~SamTextParser();
+        bam1_t* next();
+    protected:
+    private:
+        struct Batch
+        {
+            bam_hdr_t* header;
+            std::vector<char> text;
+            size_t len;
+            std::vector<bam1_t*> recs;
+            size_t n;
+            size_t used;
+            int64_t firstLine;
+            int64_t badLine;
+        };
+        htsFile* hf;
+        bam_hdr_t* header;
+        std::string filename;
+        hts_tpool* tpool;
+        hts_tpool_process* queue;
+        int maxInFlight;
+        int inFlight;
+        std::deque<Batch*> parsed; // Only used without a pool.
+        std::vector<Batch*> freeBatches;
+        Batch* current;
+        std::string carry;
+        bool inputDone;
+        int64_t lineno;
+        uint64_t bufferBytes;
+        static void* parseBatch(void* arg);
+        bool readChunk(Batch* b);
+        ssize_t readRaw(char* buf, size_t n);
+        void dispatch();
+        Batch* collect();
+        static void destroyBatch(Batch* b);
+};
+
+#endif // SAMTEXTPARSER_H
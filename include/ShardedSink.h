@@ -0,0 +1,34 @@
+#ifndef SHARDEDSINK_H
+#define SHARDEDSINK_H
+
+#include <string>
+#include <vector>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+#include "HTSFileWrapper.h"
+#include "OutputFormat.h"
+#include "RecordSink.h"
+#include "RefCache.h"
+
+// --shards N: an output written as N files, named by inserting the shard number before
+// the output's extension (out.bam becomes out.0.bam ... out.<N-1>.bam). Records go to
+// the shard picked by their qname's hash, so every alignment of a read and its mate
+// lands in the same shard. Each shard is an ordinary output file, compressed on the
+// output thread pool like any other, and outputs given the same name share their
+// shard files just as they would share an unsharded file.
+class ShardedSink : public RecordSink
+{
+    public:
+        static ShardedSink* begin_or_die(const char* fname, int nshards, const OutputFormat& format, bam_hdr_t* header, int inputNumber, htsThreadPool* pool, RefCache* ref);
+        static void close(ShardedSink* s);
+        static std::string shardName(const std::string& fname, int shard, int nshards);
+        virtual ~ShardedSink();
+        void write1(int headerNum, bam1_t* rec);
+    protected:
+    private:
+        ShardedSink();
+        std::vector<HTSFileWrapper*> shards;
+};
+
+#endif // SHARDEDSINK_H
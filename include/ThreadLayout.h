@@ -0,0 +1,37 @@
+#ifndef THREADLAYOUT_H
+#define THREADLAYOUT_H
+
+#include <string>
+#include <vector>
+#include <htslib/hts.h>
+#include <htslib/thread_pool.h>
+
+// --affinity: splits the -t budget into an input pool and an output pool and pins them.
+// The join thread and the input decompression threads share one NUMA node (and so its
+// last-level cache and memory); output compression runs on the remaining CPUs, on other
+// nodes where there are any. Threads prefer memory on the node they run on, so buffers
+// are allocated node-locally.
+class ThreadLayout
+{
+    public:
+        ThreadLayout(int _nthreads);
+        virtual ~ThreadLayout();
+        void createPools(htsThreadPool* inputPool, htsThreadPool* outputPool);
+        void report() const;
+    protected:
+    private:
+        int nthreads;
+        std::vector<std::vector<int> > nodes;
+        std::vector<int> inputCpus;
+        std::vector<int> outputCpus;
+        int inputNode;
+        int outputNode;
+        int inputThreads;
+        int outputThreads;
+        void readTopology();
+        static std::vector<int> parseCpuList(const std::string& list);
+        static std::string formatCpuList(const std::vector<int>& cpus);
+        static void placeCallingThread(const std::vector<int>& cpus, int node);
+};
+
+#endif // THREADLAYOUT_H
@@ -1,13 +1,55 @@
 #ifndef UTIL_H_INCLUDED
 #define UTIL_H_INCLUDED
 
+#include <string>
 #include <htslib/sam.h>
 
-htsFile* hts_begin_or_die(const char* filename, const char* mode, bam_hdr_t* header, int nthreads);
+htsFile* hts_begin_or_die(const char* filename, const char* mode, bam_hdr_t* header, htsThreadPool* pool, const char* fai);
+uint64_t parse_size(const char* str);
+uint64_t hts_buffer_bytes(htsFile* hf, htsThreadPool* pool);
+uint64_t header_bytes(const bam_hdr_t* header);
 int strnum_cmp(const char *_a, const char *_b);
-int qname_cmp(const char* qa, const char* qb);
-int flag2mate(const bam1_t* rec);
+int qname_cmp(const char* qa, const char* qb, bool mixed_ordering);
 bool bamrec_eq(const bam1_t* a, const bam1_t* b);
 bool bamrec_lt(const bam1_t* a, const bam1_t* b);
 
+// The aux fields scoring looks at, each pointing at its type byte as bam_aux_get would
+// return, or NULL if the record doesn't have it.
+struct AuxTags
+{
+    const uint8_t* nm;
+    const uint8_t* md;
+    const uint8_t* as;
+};
+
+void scan_aux(const bam1_t* rec, AuxTags& tags);
+const uint8_t* aux_next(const uint8_t* p, const uint8_t* end);
+std::string insert_before_extension(const std::string& fname, const std::string& infix);
+
+// FNV-1a: cheap, and spreads similar Illumina qnames evenly. The low bits are poorly
+// mixed, so take buckets from the high bits.
+static inline uint64_t qname_hash(const char* qname)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for(const unsigned char* p = (const unsigned char*)qname; *p; ++p)
+    {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Which mate a record is: 1 or 2 for paired reads, 0 otherwise. Called per record, so inline.
+static inline int flag2mate(const bam1_t* rec)
+{
+    if(rec->core.flag & BAM_FREAD1)
+    {
+        return 1;
+    }
+    else if(rec->core.flag & BAM_FREAD2)
+    {
+        return 2;
+    }
+    return 0;
+}
+
 #endif // UTIL_H_INCLUDED
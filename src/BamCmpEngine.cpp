@@ -0,0 +1,744 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "BamCmpEngine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+#include "Profiler.h"
+#include "util.h"
+
+// The category for an output option letter (a, b, A, B, C or D), or -1 for any other key.
+int BamCmpEngine::categoryOfKey(const std::string& key)
+{
+    if(key == "a") return first_only;
+    if(key == "b") return second_only;
+    if(key == "A") return first_better;
+    if(key == "B") return second_better;
+    if(key == "C") return first_worse;
+    if(key == "D") return second_worse;
+    return -1;
+}
+
+BamCmpEngine::BamCmpEngine(scoringmethods _scoringmethod, bool _mixed_ordering) :
+    scoringmethod(_scoringmethod), mixed_ordering(_mixed_ordering), warned_nm_anomaly(false), warned_nm_md_tags(false), warned_group_spill(false), allScores(false), checkpoint(0),
+    estimator(0)
+{
+    for(int i = 0; i < n_categories; ++i)
+    {
+        sinks[i] = 0;
+    }
+    refs[0] = refs[1] = 0;
+}
+
+BamCmpEngine::~BamCmpEngine()
+{
+    delete refs[0];
+    delete refs[1];
+}
+
+void BamCmpEngine::setSink(category cat, RecordSink* sink)
+{
+    sinks[cat] = sink;
+}
+
+// The SAM_* fields of input 1 or 2's records that run() will look at: what the join and
+// scoring method need, plus everything if any of that input's records can be written.
+int BamCmpEngine::requiredFields(int input) const
+{
+    int fields = SAM_QNAME | SAM_FLAG | SAM_RNAME;
+    switch(scoringmethod)
+    {
+    case scoringmethod_nmatches:
+        // CRAM needs the sequence and position to regenerate MD and NM.
+        fields |= SAM_POS | SAM_CIGAR | SAM_SEQ | SAM_AUX;
+        break;
+    case scoringmethod_astag:
+        fields |= SAM_AUX;
+        break;
+    case scoringmethod_mapq:
+        fields |= SAM_MAPQ;
+        break;
+    case scoringmethod_balwayswins:
+        break;
+    }
+    // first_only, first_better and first_worse carry input 1's records; the odd categories input 2's.
+    for(int cat = (input == 1 ? 0 : 1); cat < n_categories; cat += 2)
+    {
+        if(sinks[cat])
+        {
+            fields |= SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT | SAM_TLEN |
+                      SAM_SEQ | SAM_QUAL | SAM_AUX | SAM_RGAUX;
+        }
+    }
+    return fields;
+}
+
+// Tag every record written with its own score under each method, for reporting:
+// sm (matching bases), sa (the AS tag, if it has one) and sq (MAPQ).
+void BamCmpEngine::setAllScores(bool _allScores)
+{
+    allScores = _allScores;
+}
+
+void BamCmpEngine::addAllScores(bam1_t* rec, int input)
+{
+    // One walk over the aux block finds everything; work it all out before appending
+    // since that may move the block.
+    AuxTags tags;
+    scan_aux(rec, tags);
+    uint32_t matches = matchesScore(rec, tags, input);
+    bool has_as = tags.as != NULL;
+    uint32_t as = has_as ? bam_aux2i(tags.as) : 0;
+    uint32_t mapq = rec->core.qual;
+
+    bam_aux_append(rec, "sm", 'i', sizeof(uint32_t), (uint8_t*)&matches);
+    if(has_as)
+    {
+        bam_aux_append(rec, "sa", 'i', sizeof(uint32_t), (uint8_t*)&as);
+    }
+    bam_aux_append(rec, "sq", 'i', sizeof(uint32_t), (uint8_t*)&mapq);
+}
+
+// Bytes of records each qname group may hold in memory, 0 for no limit. Half goes to each input.
+void BamCmpEngine::setMaxGroupMemory(uint64_t bytes)
+{
+    group1.setLimit(bytes / 2);
+    group2.setLimit(bytes / 2);
+}
+
+// Offered a chance to checkpoint between units of work: before each matched qname group
+// is read, and between single records of a run found in only one input.
+void BamCmpEngine::setCheckpoint(Checkpoint* _checkpoint)
+{
+    checkpoint = _checkpoint;
+}
+
+// Classify only the reads the estimator samples, counting rather than writing them, and
+// stop once it has a precise enough answer. Meant to be used without any sinks.
+void BamCmpEngine::setEstimator(Estimator* _estimator)
+{
+    estimator = _estimator;
+}
+
+// The reference input (1 or 2) was aligned against, with the header its tids refer to.
+// -s match then counts mismatches against it for records with neither =/X nor NM or MD.
+void BamCmpEngine::setReference(int input, const FastaMap* fasta, const bam_hdr_t* header)
+{
+    delete refs[input - 1];
+    refs[input - 1] = new ReferenceLookup(fasta, header);
+}
+
+static bool aux_is_int(const uint8_t* rec)
+{
+    switch(*rec)
+    {
+    case 'c':
+    case 'C':
+    case 's':
+    case 'S':
+    case 'i':
+    case 'I':
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Each scoring method is a specialisation of scoreWith, so the join loop instantiated for
+// a method calls its scorer directly and the compiler can inline it.
+template<> uint32_t BamCmpEngine::scoreWith<scoringmethod_nmatches>(bam1_t* rec, bool is_input_a)
+{
+    AuxTags tags;
+    scan_aux(rec, tags);
+    return matchesScore(rec, tags, is_input_a ? 1 : 2);
+}
+
+// Matching bases according to the CIGAR string, corrected by NM or MD, or else by the
+// reference, when the CIGAR doesn't distinguish matches from mismatches. tags must have
+// been found by scan_aux.
+uint32_t BamCmpEngine::matchesScore(bam1_t* rec, const AuxTags& tags, int input)
+{
+    bool seen_equal_or_diff = false;
+    int32_t cigar_total = 0;
+    const uint32_t* cigar = bam_get_cigar(rec);
+    int32_t indel_edit_distance = 0;
+
+    for(int i = 0; i < rec->core.n_cigar; ++i)
+    {
+        // CIGAR scoring: score points for matching bases, and negatives for deletions
+        // since otherwise 10M10D10M would score the same as 20M. Insertions, clipping etc
+        // don't need to score a penalty since they skip bases in the query.
+        // CREF_SKIP (N / intron-skip operator) is acceptable: 10M1000N10M is as good as 20M.
+        // Insertions are counted to correct the NM tag below only.
+
+        int32_t n = bam_cigar_oplen(cigar[i]);
+        switch(bam_cigar_op(cigar[i]))
+        {
+        case BAM_CEQUAL:
+            seen_equal_or_diff = true;
+        // fall through
+        case BAM_CMATCH:
+            cigar_total += n;
+            break;
+
+        case BAM_CDEL:
+            indel_edit_distance += n;
+            cigar_total -= n;
+            break;
+
+        case BAM_CDIFF:
+            seen_equal_or_diff = true;
+            break;
+
+        case BAM_CINS:
+            indel_edit_distance += n;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // The BAM_CMATCH operator (unlike BAM_CEQUAL or BAM_CDIFF) could mean a match or a mismatch
+    // with same length (e.g. a SNP). If the file doesn't seem to use the advanced operators try to
+    // spot mismatches from metadata tags.
+    if(!seen_equal_or_diff)
+    {
+        const uint8_t* nm_rec = tags.nm;
+        if(nm_rec && aux_is_int(nm_rec))
+        {
+            int32_t nm = bam_aux2i(nm_rec);
+            if(nm < indel_edit_distance)
+            {
+                if(!warned_nm_anomaly)
+                {
+                    fprintf(stderr, "Warning: anomaly in record %s: NM is %d but there are at least %d indel bases in the CIGAR string\n", bam_get_qname(rec), nm, indel_edit_distance);
+                    fprintf(stderr, "There may be more records with this problem, but the warning will not be repeated\n");
+                    warned_nm_anomaly = true;
+                }
+            }
+            else
+            {
+                cigar_total -= (bam_aux2i(nm_rec) - indel_edit_distance);
+                seen_equal_or_diff = true;
+            }
+        }
+    }
+
+    if(!seen_equal_or_diff)
+    {
+        const uint8_t* md_rec = tags.md;
+        if(md_rec)
+        {
+            char* mdstr = bam_aux2Z(md_rec);
+            if(mdstr)
+            {
+                seen_equal_or_diff = true;
+                bool in_deletion = false;
+                for(; *mdstr; ++mdstr)
+                {
+                    // Skip deletions, which are already penalised.
+                    // Syntax seems to be: numbers mean base strings that match the reference; ^ followed by letters means
+                    // a deletion; letters without the preceding ^ indicate a mismatch.
+                    char c = *mdstr;
+                    if(c == '^')
+                    {
+                        in_deletion = true;
+                    }
+                    else if(isdigit(c))
+                    {
+                        in_deletion = false;
+                    }
+                    else if(!in_deletion)
+                    {
+                        // Mismatch
+                        cigar_total--;
+                    }
+                }
+            }
+        }
+    }
+
+    // Failing all of those, compare the M bases with the reference, if we have it.
+    if(!seen_equal_or_diff && refs[input - 1] && refs[input - 1]->canCount(rec))
+    {
+        cigar_total -= refs[input - 1]->countMismatches(rec);
+        seen_equal_or_diff = true;
+    }
+
+    if((!seen_equal_or_diff) && !warned_nm_md_tags)
+    {
+        fprintf(stderr, "Warning: input file does not use the =/X CIGAR operators, or include NM or MD tags, so I have no way to spot length-preserving reference mismatches.\n");
+        fprintf(stderr, "At least record %s exhibited this problem; there may be others but the warning will not be repeated. I will assume M CIGAR operators indicate a match.\n", bam_get_qname(rec));
+        fprintf(stderr, "Give the (uncompressed) reference FASTAs with --ref1 and --ref2 to count mismatches against them instead.\n");
+        warned_nm_md_tags = true;
+    }
+    return std::max(cigar_total, 0);
+}
+// End the CIGAR string scoring method. Thankfully the others are much simpler to implement:
+
+template<> uint32_t BamCmpEngine::scoreWith<scoringmethod_astag>(bam1_t* rec, bool is_input_a)
+{
+    uint8_t* score_rec = bam_aux_get(rec, "AS");
+    if(!score_rec)
+    {
+        fprintf(stderr, "Fatal: At least record %s doesn't have an AS tag as required.\n", bam_get_qname(rec));
+        exit(1);
+    }
+    return bam_aux2i(score_rec);
+}
+
+template<> uint32_t BamCmpEngine::scoreWith<scoringmethod_mapq>(bam1_t* rec, bool is_input_a)
+{
+    return rec->core.qual;
+}
+
+template<> uint32_t BamCmpEngine::scoreWith<scoringmethod_balwayswins>(bam1_t* rec, bool is_input_a)
+{
+    // Mapped B records beat any A record, beats an unmapped B record.
+    if(is_input_a)
+    {
+        return 1;
+    }
+    else if(!(rec->core.flag & BAM_FUNMAP))
+    {
+        return 2;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+uint32_t BamCmpEngine::score(bam1_t* rec, bool is_input_a)
+{
+    switch(scoringmethod)
+    {
+    case scoringmethod_nmatches:
+        return scoreWith<scoringmethod_nmatches>(rec, is_input_a);
+    case scoringmethod_astag:
+        return scoreWith<scoringmethod_astag>(rec, is_input_a);
+    case scoringmethod_mapq:
+        return scoreWith<scoringmethod_mapq>(rec, is_input_a);
+    case scoringmethod_balwayswins:
+        return scoreWith<scoringmethod_balwayswins>(rec, is_input_a);
+    }
+    return -1;
+}
+
+// Name ordering policies for the join loop.
+template<bool mixed> static inline int qnameCmp(const char* qa, const char* qb);
+
+template<> inline int qnameCmp<true>(const char* qa, const char* qb)
+{
+    return strnum_cmp(qa, qb);
+}
+
+template<> inline int qnameCmp<false>(const char* qa, const char* qb)
+{
+    return strcmp(qa, qb);
+}
+
+static void clearMateInfo(bam1_t* rec)
+{
+    PROFILE_SCOPE(Profiler::stage_annotate);
+    uint32_t maten = (uint32_t)flag2mate(rec);
+    bam_aux_append(rec, "om", 'i', sizeof(uint32_t), (uint8_t*)&maten);
+
+    rec->core.flag &= ~(BAM_FPROPER_PAIR | BAM_FMREVERSE | BAM_FPAIRED | BAM_FMUNMAP | BAM_FREAD1 | BAM_FREAD2);
+    rec->core.mtid = -1;
+    rec->core.mpos = -1;
+}
+
+template<scoringmethods method, bool mixed> void BamCmpEngine::runWith(RecordSource& in1, RecordSource& in2)
+{
+    RecordSink* first_out = sinks[first_only];
+    RecordSink* second_out = sinks[second_only];
+
+    while((!in1.is_eof()) && (!in2.is_eof()))
+    {
+        // No matched group is half-read here. One input may be partway through a qname
+        // group whose records are only in that input, but those are handled one record at
+        // a time, so resuming from this point writes exactly what would have followed.
+        if(checkpoint)
+        {
+            checkpoint->atBoundary();
+        }
+
+        if(estimator && estimator->done())
+        {
+            return;
+        }
+
+        const char* qname1 = bam_get_qname(in1.getRec());
+        const char* qname2 = bam_get_qname(in2.getRec());
+
+        if(strcmp(qname1, qname2) == 0)
+        {
+            if(estimator && !estimator->sampled(qname1))
+            {
+                skipGroup(in1, in2);
+            }
+            else
+            {
+                processGroup<method>(in1, in2);
+            }
+        }
+        else if(qnameCmp<mixed>(qname1, qname2) < 0)
+        {
+            if(first_out)
+            {
+                writeOneSided(in1, 1, first_out);
+            }
+            if(estimator)
+            {
+                countOneSided(in1.getRec(), Estimator::first_only);
+            }
+            else if(!first_out)
+            {
+                // Nothing wants input 1's unmatched records, so gallop to input 2's qname if we can.
+                PROFILE_SCOPE(Profiler::stage_read1);
+                if(in1.skipTo(qname2))
+                {
+                    continue;
+                }
+            }
+            PROFILE_SCOPE(Profiler::stage_read1);
+            in1.next();
+        }
+        else
+        {
+            if(second_out)
+            {
+                writeOneSided(in2, 2, second_out);
+            }
+            if(estimator)
+            {
+                countOneSided(in2.getRec(), Estimator::second_only);
+            }
+            else if(!second_out)
+            {
+                PROFILE_SCOPE(Profiler::stage_read2);
+                if(in2.skipTo(qname1))
+                {
+                    continue;
+                }
+            }
+            PROFILE_SCOPE(Profiler::stage_read2);
+            in2.next();
+        }
+    }
+
+    // One or other file has reached EOF. Write the remainder as first- or second-only records.
+    if(first_out || estimator)
+    {
+        while(!in1.is_eof())
+        {
+            if(checkpoint)
+            {
+                checkpoint->atBoundary();
+            }
+            if(first_out)
+            {
+                writeOneSided(in1, 1, first_out);
+            }
+            if(estimator)
+            {
+                if(estimator->done())
+                {
+                    return;
+                }
+                countOneSided(in1.getRec(), Estimator::first_only);
+            }
+            PROFILE_SCOPE(Profiler::stage_read1);
+            in1.next();
+        }
+    }
+
+    if(second_out || estimator)
+    {
+        while(!in2.is_eof())
+        {
+            if(checkpoint)
+            {
+                checkpoint->atBoundary();
+            }
+            if(second_out)
+            {
+                writeOneSided(in2, 2, second_out);
+            }
+            if(estimator)
+            {
+                if(estimator->done())
+                {
+                    return;
+                }
+                countOneSided(in2.getRec(), Estimator::second_only);
+            }
+            PROFILE_SCOPE(Profiler::stage_read2);
+            in2.next();
+        }
+    }
+}
+
+// Write the current record of an input whose qname the other input doesn't have.
+void BamCmpEngine::writeOneSided(RecordSource& in, int input, RecordSink* out)
+{
+    in.load();
+    bam1_t* rec = in.getRec();
+    if(allScores)
+    {
+        PROFILE_SCOPE(Profiler::stage_annotate);
+        addAllScores(rec, input);
+    }
+    out->write1(input, rec);
+}
+
+// Pass over a qname group the estimator didn't sample. Its records are never loaded, so
+// lazily read BAM records are skipped without their CIGAR, sequence or tags decoded.
+void BamCmpEngine::skipGroup(RecordSource& in1, RecordSource& in2)
+{
+    qname.assign(bam_get_qname(in1.getRec()));
+    while((!in1.is_eof()) && strcmp(bam_get_qname(in1.getRec()), qname.c_str()) == 0)
+    {
+        PROFILE_SCOPE(Profiler::stage_read1);
+        in1.next();
+    }
+    while((!in2.is_eof()) && strcmp(bam_get_qname(in2.getRec()), qname.c_str()) == 0)
+    {
+        PROFILE_SCOPE(Profiler::stage_read2);
+        in2.next();
+    }
+}
+
+// A read found in only one input counts once, at its primary alignment.
+void BamCmpEngine::countOneSided(const bam1_t* rec, Estimator::outcome o)
+{
+    if(!(rec->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) && estimator->sampled(bam_get_qname(rec)))
+    {
+        estimator->count(o);
+    }
+}
+
+// Gather both inputs' records for qname, then score each mate and route its records.
+// Only per-mate counts and best scores are kept alongside the records themselves, and
+// GroupBuffer bounds how many of those are held in memory, so a group of any size is
+// handled in a bounded footprint: scoring and routing each stream through the group once.
+template<scoringmethods method> void BamCmpEngine::processGroup(RecordSource& in1, RecordSource& in2)
+{
+    group1.clear();
+    group2.clear();
+    // Copied, since the record it comes from is about to be replaced. The string's buffer is reused.
+    qname.assign(bam_get_qname(in1.getRec()));
+
+    {
+        PROFILE_SCOPE(Profiler::stage_group);
+        while((!in1.is_eof()) && strcmp(bam_get_qname(in1.getRec()), qname.c_str()) == 0)
+        {
+            in1.load();
+            group1.add(in1.getRec());
+            PROFILE_SCOPE(Profiler::stage_read1);
+            in1.next();
+        }
+
+        while((!in2.is_eof()) && strcmp(bam_get_qname(in2.getRec()), qname.c_str()) == 0)
+        {
+            in2.load();
+            group2.add(in2.getRec());
+            PROFILE_SCOPE(Profiler::stage_read2);
+            in2.next();
+        }
+    }
+
+    if((group1.spilled() || group2.spilled()) && !warned_group_spill)
+    {
+        fprintf(stderr, "Warning: qname group %s exceeded the group memory limit and was held in a temporary file.\n", qname.c_str());
+        fprintf(stderr, "There may be more groups like this, but the warning will not be repeated\n");
+        warned_group_spill = true;
+    }
+
+    RecordSink* sinks1[GroupBuffer::n_mates];
+    RecordSink* sinks2[GroupBuffer::n_mates];
+    uint32_t score1[GroupBuffer::n_mates], score2[GroupBuffer::n_mates];
+    bool matched[GroupBuffer::n_mates];
+
+    // A mate present in both inputs is scored by the best of its candidate alignments on each side,
+    // and then all of its records go to firstbetter / secondworse or firstworse / secondbetter.
+    for(int m = 0; m < GroupBuffer::n_mates; ++m)
+    {
+        matched[m] = group1.count(m) && group2.count(m);
+        score1[m] = 0;
+        score2[m] = 0;
+        if(!matched[m])
+        {
+            sinks1[m] = sinks[first_only];
+            sinks2[m] = sinks[second_only];
+            continue;
+        }
+
+        {
+            PROFILE_SCOPE(Profiler::stage_score);
+            score1[m] = bestScore<method>(group1, m, true);
+            score2[m] = bestScore<method>(group2, m, false);
+        }
+
+        if(score1[m] > score2[m])
+        {
+            sinks1[m] = sinks[first_better];
+            sinks2[m] = sinks[second_worse];
+        }
+        else
+        {
+            sinks1[m] = sinks[first_worse];
+            sinks2[m] = sinks[second_better];
+        }
+    }
+
+    if(estimator)
+    {
+        // One read per mate present, classified just as route() would file it.
+        for(int m = 0; m < GroupBuffer::n_mates; ++m)
+        {
+            if(matched[m])
+            {
+                estimator->count(score1[m] > score2[m] ? Estimator::first_better : Estimator::second_better);
+            }
+            else if(group1.count(m))
+            {
+                estimator->count(Estimator::first_only);
+            }
+            else if(group2.count(m))
+            {
+                estimator->count(Estimator::second_only);
+            }
+        }
+    }
+
+    route(group1, 1, sinks1, matched, score1, score2);
+    route(group2, 2, sinks2, matched, score1, score2);
+}
+
+// The best score among one mate's candidate alignments in one input.
+template<scoringmethods method> uint32_t BamCmpEngine::bestScore(GroupBuffer& group, int mate, bool is_input_a)
+{
+    // The usual case: one alignment per mate.
+    if(group.count(mate) == 1 && !group.spilled())
+    {
+        return scoreWith<method>(group.front(mate), is_input_a);
+    }
+    group.rewind(mate);
+    uint32_t best = scoreWith<method>(group.next(mate), is_input_a);
+    for(bam1_t* rec = group.next(mate); rec; rec = group.next(mate))
+    {
+        best = std::max(best, scoreWith<method>(rec, is_input_a));
+    }
+    return best;
+}
+
+// Write one input's share of a group, mate by mate. If its mates are going to different
+// places, clear mate information to keep each output consistent.
+void BamCmpEngine::route(GroupBuffer& group, int input, RecordSink** mateSinks, const bool* matched, const uint32_t* score1, const uint32_t* score2)
+{
+    bool seen = false, split = false;
+    RecordSink* firstSink = 0;
+    for(int m = 0; m < GroupBuffer::n_mates; ++m)
+    {
+        if(!group.count(m))
+        {
+            continue;
+        }
+        if(!seen)
+        {
+            firstSink = mateSinks[m];
+            seen = true;
+        }
+        else if(mateSinks[m] != firstSink)
+        {
+            split = true;
+        }
+    }
+
+    for(int m = 0; m < GroupBuffer::n_mates; ++m)
+    {
+        group.rewind(m);
+        for(bam1_t* rec = group.next(m); rec; rec = group.next(m))
+        {
+            if(matched[m])
+            {
+                PROFILE_SCOPE(Profiler::stage_annotate);
+                bam_aux_append(rec, "as", 'i', sizeof(uint32_t), (uint8_t*)&score1[m]);
+                bam_aux_append(rec, "bs", 'i', sizeof(uint32_t), (uint8_t*)&score2[m]);
+            }
+            if(allScores && mateSinks[m])
+            {
+                PROFILE_SCOPE(Profiler::stage_annotate);
+                addAllScores(rec, input);
+            }
+            if(split)
+            {
+                clearMateInfo(rec);
+            }
+            if(mateSinks[m])
+            {
+                mateSinks[m]->write1(input, rec);
+            }
+        }
+    }
+}
+
+// Choose the join loop instantiated for this scoring method and name ordering, so that
+// neither is looked up again per record.
+void BamCmpEngine::run(RecordSource& in1, RecordSource& in2)
+{
+    switch(scoringmethod)
+    {
+    case scoringmethod_nmatches:
+        mixed_ordering ? runWith<scoringmethod_nmatches, true>(in1, in2) : runWith<scoringmethod_nmatches, false>(in1, in2);
+        break;
+    case scoringmethod_astag:
+        mixed_ordering ? runWith<scoringmethod_astag, true>(in1, in2) : runWith<scoringmethod_astag, false>(in1, in2);
+        break;
+    case scoringmethod_mapq:
+        mixed_ordering ? runWith<scoringmethod_mapq, true>(in1, in2) : runWith<scoringmethod_mapq, false>(in1, in2);
+        break;
+    case scoringmethod_balwayswins:
+        mixed_ordering ? runWith<scoringmethod_balwayswins, true>(in1, in2) : runWith<scoringmethod_balwayswins, false>(in1, in2);
+        break;
+    }
+}
+
+// --single: compare one qname group at a time, each split into its two genomes'
+// records, so that neither side ever holds more than the current group.
+void BamCmpEngine::runSplit(GenomeSplitter& splitter)
+{
+    while(splitter.nextGroup())
+    {
+        run(*splitter.getSide(1), *splitter.getSide(2));
+        if(estimator && estimator->stopped())
+        {
+            return;
+        }
+    }
+}
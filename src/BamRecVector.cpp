@@ -21,12 +21,23 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "BamRecVector.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <algorithm>
 #include <htslib/hts.h>
 
 #include "util.h"
 
-BamRecVector::BamRecVector()
+// Records kept from one group for the next are capped at this many bytes of buffers, so
+// a single very large group doesn't leave its memory behind for the rest of the run.
+static const uint64_t maxSpareBytes = 256 << 10;
+
+static uint64_t recordBytes(const bam1_t* rec)
+{
+    return sizeof(bam1_t) + rec->m_data;
+}
+
+BamRecVector::BamRecVector() : spareBytes(0)
 {
     //ctor
 }
@@ -34,6 +45,10 @@ BamRecVector::BamRecVector()
 BamRecVector::~BamRecVector()
 {
     clear();
+    for(std::vector<bam1_t*>::iterator it = spare.begin(), itend = spare.end(); it != itend; ++it)
+    {
+        bam_destroy1(*it);
+    }
 }
 
 void BamRecVector::take_add(bam1_t* src)
@@ -41,26 +56,58 @@ void BamRecVector::take_add(bam1_t* src)
     recs.push_back(src);
 }
 
+// Copies into a record kept from an earlier clear() where possible, reusing its buffer.
 void BamRecVector::copy_add(bam1_t* src)
 {
-    recs.push_back(bam_dup1(src));
+    if(spare.empty())
+    {
+        recs.push_back(bam_dup1(src));
+        return;
+    }
+    bam1_t* dst = spare.back();
+    spare.pop_back();
+    spareBytes -= recordBytes(dst);
+    if(!bam_copy1(dst, src))
+    {
+        fprintf(stderr, "Out of memory copying record %s\n", bam_get_qname(src));
+        exit(1);
+    }
+    recs.push_back(dst);
 }
 
 void BamRecVector::clear()
 {
     for(std::vector<bam1_t*>::iterator it = recs.begin(), itend = recs.end(); it != itend; ++it)
     {
-        bam_destroy1(*it);
+        uint64_t bytes = recordBytes(*it);
+        if(spareBytes + bytes <= maxSpareBytes)
+        {
+            spare.push_back(*it);
+            spareBytes += bytes;
+        }
+        else
+        {
+            bam_destroy1(*it);
+        }
     }
     recs.clear();
 }
 
+// Stable, so records of the same mate keep their input order.
+struct MateLess
+{
+    bool operator()(const bam1_t* a, const bam1_t* b) const
+    {
+        return flag2mate(a) < flag2mate(b);
+    }
+};
+
 void BamRecVector::sort()
 {
-    std::sort(recs.begin(), recs.end(), bamrec_lt);
+    std::stable_sort(recs.begin(), recs.end(), MateLess());
 }
 
-unsigned int BamRecVector::size()
+unsigned int BamRecVector::size() const
 {
     return recs.size();
 }
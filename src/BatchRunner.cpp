@@ -0,0 +1,319 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "BatchRunner.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <sys/stat.h>
+#include <htslib/sam.h>
+
+#include "HTSFileWrapper.h"
+#include "SamReader.h"
+#include "util.h"
+
+// Manifest lines are tab-separated: input1, input2, then any of
+//   a=, b=, A=, B=, C=, D=   outputs, as for the corresponding command-line options
+//   ref1=, ref2=             references, overriding --ref1 / --ref2 for this sample
+// Blank lines and lines starting with # are ignored.
+
+static uint64_t fileSize(const std::string& fname)
+{
+    struct stat st;
+    if(stat(fname.c_str(), &st) != 0)
+    {
+        return 0;
+    }
+    return st.st_size;
+}
+
+struct BiggerFirst
+{
+    template<class T> bool operator()(const T& a, const T& b) const
+    {
+        return a.bytes > b.bytes;
+    }
+};
+
+BatchRunner::BatchRunner(const char* manifest, scoringmethods _scoringmethod, bool _mixed_ordering, const OutputFormat* _formats,
+                         const char* defaultRef1, const char* defaultRef2, const std::string& _refCachePattern) :
+    scoringmethod(_scoringmethod), mixed_ordering(_mixed_ordering), refCachePattern(_refCachePattern),
+    maxGroupMemory(0), allScores(false), pool(0), nextSample(0), nDone(0)
+{
+    pthread_mutex_init(&lock, NULL);
+    for(int cat = 0; cat < BamCmpEngine::n_categories; ++cat)
+    {
+        formats[cat] = _formats[cat];
+    }
+
+    FILE* f = fopen(manifest, "r");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open manifest %s\n", manifest);
+        exit(1);
+    }
+    char* line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int lineno = 0;
+    while((linelen = getline(&line, &linecap, f)) > 0)
+    {
+        ++lineno;
+        std::vector<std::string> fields;
+        for(char* tok = strtok(line, "\t\r\n"); tok; tok = strtok(NULL, "\t\r\n"))
+        {
+            fields.push_back(std::string(tok));
+        }
+        if(fields.empty() || fields[0][0] == '#')
+        {
+            continue;
+        }
+        if(fields.size() < 3)
+        {
+            fprintf(stderr, "%s line %d: expected input1, input2 and at least one output\n", manifest, lineno);
+            exit(1);
+        }
+
+        Sample s;
+        s.line = lineno;
+        s.in1 = fields[0];
+        s.in2 = fields[1];
+        std::string ref1 = defaultRef1 ? defaultRef1 : "", ref2 = defaultRef2 ? defaultRef2 : "";
+        bool anyOutput = false;
+        for(size_t i = 2; i < fields.size(); ++i)
+        {
+            size_t eq = fields[i].find('=');
+            std::string key = fields[i].substr(0, eq);
+            if(eq == std::string::npos || eq + 1 == fields[i].size())
+            {
+                fprintf(stderr, "%s line %d: expected key=filename, not %s\n", manifest, lineno, fields[i].c_str());
+                exit(1);
+            }
+            std::string value = fields[i].substr(eq + 1);
+            int cat = BamCmpEngine::categoryOfKey(key);
+            if(cat >= 0)
+            {
+                s.outputs[cat] = value;
+                anyOutput = true;
+            }
+            else if(key == "ref1")
+            {
+                ref1 = value;
+            }
+            else if(key == "ref2")
+            {
+                ref2 = value;
+            }
+            else
+            {
+                fprintf(stderr, "%s line %d: unknown key %s\n", manifest, lineno, key.c_str());
+                exit(1);
+            }
+        }
+        if(!anyOutput)
+        {
+            fprintf(stderr, "%s line %d: no outputs given\n", manifest, lineno);
+            exit(1);
+        }
+        s.ref1 = ref1.empty() ? NULL : getRef(ref1);
+        s.ref2 = ref2.empty() ? NULL : getRef(ref2);
+        s.bytes = fileSize(s.in1) + fileSize(s.in2);
+        samples.push_back(s);
+    }
+    free(line);
+    fclose(f);
+
+    checkOutputNames();
+
+    // Start the longest samples first so the tail of the batch is made of short ones.
+    std::stable_sort(samples.begin(), samples.end(), BiggerFirst());
+}
+
+BatchRunner::~BatchRunner()
+{
+    for(std::map<std::string, RefCache*>::iterator it = refs.begin(), itend = refs.end(); it != itend; ++it)
+    {
+        delete it->second;
+    }
+    pthread_mutex_destroy(&lock);
+}
+
+size_t BatchRunner::size() const
+{
+    return samples.size();
+}
+
+void BatchRunner::setMaxGroupMemory(uint64_t bytes)
+{
+    maxGroupMemory = bytes;
+}
+
+void BatchRunner::setAllScores(bool _allScores)
+{
+    allScores = _allScores;
+}
+
+// Samples naming the same reference share one RefCache, so it is only indexed and hashed once.
+RefCache* BatchRunner::getRef(const std::string& fasta)
+{
+    std::map<std::string, RefCache*>::iterator it = refs.find(fasta);
+    if(it != refs.end())
+    {
+        return it->second;
+    }
+    RefCache* ret = new RefCache(fasta.c_str(), refCachePattern);
+    refs[fasta] = ret;
+    return ret;
+}
+
+// Outputs of one sample may share a file, as on the command line, but two samples
+// writing the same file (or reading another's output) would interleave garbage.
+void BatchRunner::checkOutputNames() const
+{
+    std::map<std::string, int> owner;
+    for(size_t i = 0; i < samples.size(); ++i)
+    {
+        for(int cat = 0; cat < BamCmpEngine::n_categories; ++cat)
+        {
+            const std::string& name = samples[i].outputs[cat];
+            if(name.empty())
+            {
+                continue;
+            }
+            std::map<std::string, int>::const_iterator it = owner.find(name);
+            if(it != owner.end() && it->second != samples[i].line)
+            {
+                fprintf(stderr, "Manifest lines %d and %d both write %s\n", it->second, samples[i].line, name.c_str());
+                exit(1);
+            }
+            owner[name] = samples[i].line;
+        }
+    }
+    for(size_t i = 0; i < samples.size(); ++i)
+    {
+        if(owner.count(samples[i].in1) || owner.count(samples[i].in2))
+        {
+            fprintf(stderr, "Manifest line %d reads a file that is also written by the batch\n", samples[i].line);
+            exit(1);
+        }
+    }
+}
+
+void BatchRunner::run(int jobs, htsThreadPool* _pool)
+{
+    pool = _pool;
+    if(jobs > (int)samples.size())
+    {
+        jobs = samples.size();
+    }
+    std::vector<pthread_t> threads(jobs);
+    for(int i = 0; i < jobs; ++i)
+    {
+        if(pthread_create(&threads[i], NULL, worker, this) != 0)
+        {
+            fprintf(stderr, "Failed to start batch worker thread\n");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < jobs; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void* BatchRunner::worker(void* arg)
+{
+    BatchRunner* self = (BatchRunner*)arg;
+    while(true)
+    {
+        pthread_mutex_lock(&self->lock);
+        size_t i = self->nextSample++;
+        pthread_mutex_unlock(&self->lock);
+        if(i >= self->samples.size())
+        {
+            break;
+        }
+        self->runSample(self->samples[i]);
+        pthread_mutex_lock(&self->lock);
+        ++self->nDone;
+        fprintf(stderr, "Batch: finished %s / %s (%lu of %lu)\n", self->samples[i].in1.c_str(), self->samples[i].in2.c_str(),
+                (unsigned long)self->nDone, (unsigned long)self->samples.size());
+        pthread_mutex_unlock(&self->lock);
+    }
+    return NULL;
+}
+
+// The equivalent of one two-input bamcmp run.
+void BatchRunner::runSample(const Sample& s)
+{
+    bam_hdr_t *header1, *header2;
+    htsFile* in1hf = RefCache::openInput(s.in1.c_str(), pool, s.ref1, &header1);
+    htsFile* in2hf = RefCache::openInput(s.in2.c_str(), pool, s.ref2, &header2);
+
+    BamCmpEngine engine(scoringmethod, mixed_ordering);
+    engine.setMaxGroupMemory(maxGroupMemory);
+    engine.setAllScores(allScores);
+    if(scoringmethod == scoringmethod_nmatches || allScores)
+    {
+        const FastaMap* fasta1 = s.ref1 ? s.ref1->sequences() : NULL;
+        const FastaMap* fasta2 = s.ref2 ? s.ref2->sequences() : NULL;
+        if(fasta1)
+        {
+            engine.setReference(1, fasta1, header1);
+        }
+        if(fasta2)
+        {
+            engine.setReference(2, fasta2, header2);
+        }
+    }
+    HTSFileWrapper* outs[BamCmpEngine::n_categories];
+    for(int cat = 0; cat < BamCmpEngine::n_categories; ++cat)
+    {
+        outs[cat] = NULL;
+        if(s.outputs[cat].empty())
+        {
+            continue;
+        }
+        // The "first" categories carry input 1's records; first_only, first_better and first_worse are the even ones.
+        bool first = (cat % 2) == 0;
+        outs[cat] = HTSFileWrapper::begin_or_die(s.outputs[cat].c_str(), formats[cat], first ? header1 : header2, first ? 1 : 2, pool, first ? s.ref1 : s.ref2);
+        engine.setSink((BamCmpEngine::category)cat, outs[cat]);
+    }
+
+    SamReader reader1(in1hf, header1, s.in1.c_str(), mixed_ordering, pool);
+    SamReader reader2(in2hf, header2, s.in2.c_str(), mixed_ordering, pool);
+    reader1.setRequiredFields(engine.requiredFields(1));
+    reader2.setRequiredFields(engine.requiredFields(2));
+    engine.run(reader1, reader2);
+
+    for(int cat = 0; cat < BamCmpEngine::n_categories; ++cat)
+    {
+        if(outs[cat])
+        {
+            HTSFileWrapper::close(outs[cat]);
+        }
+    }
+    hts_close(in1hf);
+    hts_close(in2hf);
+    bam_hdr_destroy(header1);
+    bam_hdr_destroy(header2);
+}
@@ -0,0 +1,249 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Checkpoint.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "HTSFileWrapper.h"
+#include "util.h"
+
+// Checkpoint files are tab-separated lines:
+//   bamcmp-checkpoint  1
+//   next               <total input records at which the next checkpoint is due>
+//   last_qname         <greatest qname already processed>
+//   input1 / input2    <BGZF virtual offset of next record> <records consumed> <filename>
+//   output             <file length in bytes> <filename>
+
+Checkpoint::Checkpoint(const char* _fname, uint64_t _interval, SamReader* _in1, SamReader* _in2, bool _mixed_ordering) :
+    fname(_fname), in1(_in1), in2(_in2), mixed_ordering(_mixed_ordering), interval(_interval), next_at(_interval)
+{
+    //ctor
+}
+
+Checkpoint::~Checkpoint()
+{
+    //dtor
+}
+
+// Checkpoints fall at fixed counts of consumed input records, so a resumed run flushes
+// its outputs at the same points an uninterrupted run would, and writes identical BGZF blocks.
+bool Checkpoint::due() const
+{
+    return in1->count() + in2->count() >= next_at;
+}
+
+// Called whenever both inputs are at a qname group boundary.
+void Checkpoint::atBoundary()
+{
+    if(due())
+    {
+        save();
+    }
+}
+
+void Checkpoint::save()
+{
+    const std::string& prev1 = in1->getPrevQname();
+    const std::string& prev2 = in2->getPrevQname();
+    const char* last_qname = "";
+    if(!prev1.empty() && !prev2.empty())
+    {
+        last_qname = qname_cmp(prev1.c_str(), prev2.c_str(), mixed_ordering) > 0 ? prev1.c_str() : prev2.c_str();
+    }
+    else if(!prev1.empty())
+    {
+        last_qname = prev1.c_str();
+    }
+    else if(!prev2.empty())
+    {
+        last_qname = prev2.c_str();
+    }
+
+    next_at += interval;
+
+    std::string tmpname = fname + ".tmp";
+    FILE* f = fopen(tmpname.c_str(), "w");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open checkpoint file %s for writing\n", tmpname.c_str());
+        exit(1);
+    }
+    fprintf(f, "bamcmp-checkpoint\t1\n");
+    fprintf(f, "next\t%llu\n", (unsigned long long)next_at);
+    fprintf(f, "last_qname\t%s\n", last_qname);
+    fprintf(f, "input1\t%lld\t%llu\t%s\n", (long long)in1->tell(), (unsigned long long)in1->count(), in1->getFilename().c_str());
+    fprintf(f, "input2\t%lld\t%llu\t%s\n", (long long)in2->tell(), (unsigned long long)in2->count(), in2->getFilename().c_str());
+
+    // Outputs must be on disk before the checkpoint that refers to them.
+    const std::vector<std::pair<std::string, HTSFileWrapper*> >& outs = HTSFileWrapper::getOpenOutputs();
+    for(std::vector<std::pair<std::string, HTSFileWrapper*> >::const_iterator it = outs.begin(), itend = outs.end(); it != itend; ++it)
+    {
+        fprintf(f, "output\t%lld\t%s\n", (long long)it->second->flush(), it->first.c_str());
+    }
+
+    if(fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0)
+    {
+        fprintf(stderr, "Failed to write checkpoint file %s\n", tmpname.c_str());
+        exit(1);
+    }
+    if(rename(tmpname.c_str(), fname.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to move checkpoint file into place at %s\n", fname.c_str());
+        exit(1);
+    }
+}
+
+void Checkpoint::load(int64_t offsets[2], uint64_t counts[2], std::string inputNames[2], std::string& last_qname)
+{
+    FILE* f = fopen(fname.c_str(), "r");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open checkpoint file %s\n", fname.c_str());
+        exit(1);
+    }
+
+    bool seenInput[2] = {false, false};
+    bool seenMagic = false;
+    char* line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while((linelen = getline(&line, &linecap, f)) > 0)
+    {
+        if(line[linelen - 1] == '\n')
+        {
+            line[--linelen] = '\0';
+        }
+        char* tab = strchr(line, '\t');
+        if(!tab)
+        {
+            continue;
+        }
+        *tab = '\0';
+        std::string key(line);
+        char* value = tab + 1;
+        if(key == "bamcmp-checkpoint")
+        {
+            seenMagic = (atoi(value) == 1);
+        }
+        else if(key == "next")
+        {
+            next_at = strtoull(value, NULL, 10);
+        }
+        else if(key == "last_qname")
+        {
+            last_qname = std::string(value);
+        }
+        else if(key == "input1" || key == "input2")
+        {
+            int i = key[5] - '1';
+            char* end;
+            offsets[i] = strtoll(value, &end, 10);
+            counts[i] = strtoull(end, &end, 10);
+            if(*end == '\t')
+            {
+                inputNames[i] = std::string(end + 1);
+                seenInput[i] = true;
+            }
+        }
+        else if(key == "output")
+        {
+            char* end;
+            int64_t offset = strtoll(value, &end, 10);
+            if(*end == '\t')
+            {
+                outputOffsets[std::string(end + 1)] = offset;
+            }
+        }
+    }
+    free(line);
+    fclose(f);
+
+    if(!(seenMagic && seenInput[0] && seenInput[1]))
+    {
+        fprintf(stderr, "%s is not a usable bamcmp checkpoint file\n", fname.c_str());
+        exit(1);
+    }
+}
+
+// Cut the outputs back to the checkpoint and move the inputs to match.
+void Checkpoint::resume()
+{
+    int64_t offsets[2];
+    uint64_t counts[2];
+    std::string inputNames[2];
+    std::string last_qname;
+    load(offsets, counts, inputNames, last_qname);
+
+    SamReader* ins[2] = {in1, in2};
+    for(int i = 0; i < 2; ++i)
+    {
+        if(!ins[i]->is_seekable())
+        {
+            fprintf(stderr, "Can't resume: input %s is not BAM\n", ins[i]->getFilename().c_str());
+            exit(1);
+        }
+        if(inputNames[i] != ins[i]->getFilename())
+        {
+            fprintf(stderr, "Can't resume: checkpoint %s was written for input %s, not %s\n", fname.c_str(), inputNames[i].c_str(), ins[i]->getFilename().c_str());
+            exit(1);
+        }
+    }
+
+    const std::vector<std::pair<std::string, HTSFileWrapper*> >& outs = HTSFileWrapper::getOpenOutputs();
+    if(outs.size() != outputOffsets.size())
+    {
+        fprintf(stderr, "Can't resume: checkpoint %s was written with a different set of outputs\n", fname.c_str());
+        exit(1);
+    }
+    for(std::vector<std::pair<std::string, HTSFileWrapper*> >::const_iterator it = outs.begin(), itend = outs.end(); it != itend; ++it)
+    {
+        std::map<std::string, int64_t>::const_iterator found = outputOffsets.find(it->first);
+        if(found == outputOffsets.end())
+        {
+            fprintf(stderr, "Can't resume: checkpoint %s has no record of output %s\n", fname.c_str(), it->first.c_str());
+            exit(1);
+        }
+        it->second->resumeAt(found->second);
+    }
+
+    for(int i = 0; i < 2; ++i)
+    {
+        ins[i]->seek(offsets[i], counts[i]);
+        if(!ins[i]->is_eof() && !last_qname.empty() && qname_cmp(bam_get_qname(ins[i]->getRec()), last_qname.c_str(), mixed_ordering) < 0)
+        {
+            fprintf(stderr, "Can't resume: input %s doesn't match checkpoint %s\n", ins[i]->getFilename().c_str(), fname.c_str());
+            exit(1);
+        }
+    }
+
+    fprintf(stderr, "Resuming from checkpoint %s after %llu input records (last read %s)\n", fname.c_str(),
+            (unsigned long long)(counts[0] + counts[1]), last_qname.c_str());
+}
+
+// A finished run has no use for its checkpoint, and resuming from it would truncate the outputs.
+void Checkpoint::remove()
+{
+    unlink(fname.c_str());
+}
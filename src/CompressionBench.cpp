@@ -0,0 +1,140 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "CompressionBench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "util.h"
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+CompressionBench::CompressionBench(const char* _input, uint64_t maxRecords, const char* _ref, htsThreadPool* _pool) :
+    input(_input), ref(_ref), pool(_pool), rawBytes(0)
+{
+    htsFile* hf = hts_begin_or_die(_input, "r", NULL, pool, ref);
+    header = sam_hdr_read(hf);
+    if(!header)
+    {
+        fprintf(stderr, "Failed to read the header of %s\n", _input);
+        exit(1);
+    }
+    bam1_t* rec = bam_init1();
+    while(records.size() < maxRecords && sam_read1(hf, header, rec) >= 0)
+    {
+        // As laid out in an uncompressed BAM: block_size, the fixed fields, then the data.
+        rawBytes += 36 + rec->l_data;
+        records.push_back(bam_dup1(rec));
+    }
+    bam_destroy1(rec);
+    hts_close(hf);
+    fprintf(stderr, "Loaded %lu records (%.1f MB of BAM record data) from %s\n", (unsigned long)records.size(), rawBytes / 1048576.0, _input);
+}
+
+CompressionBench::~CompressionBench()
+{
+    for(std::vector<bam1_t*>::iterator it = records.begin(), itend = records.end(); it != itend; ++it)
+    {
+        bam_destroy1(*it);
+    }
+    bam_hdr_destroy(header);
+}
+
+void CompressionBench::addSetting(const OutputFormat& format)
+{
+    settings.push_back(format);
+}
+
+// A spread of BAM levels, plus CRAM if there's a reference to encode against.
+void CompressionBench::addDefaultSettings()
+{
+    const char* specs[] = { "bam,level=0", "bam,level=1", "bam,level=4", "bam,level=6", "bam,level=9", "cram" };
+    int n = sizeof(specs) / sizeof(specs[0]);
+    for(int i = 0; i < n; ++i)
+    {
+        OutputFormat format;
+        format.parse(specs[i]);
+        if(format.isCram() && !ref)
+        {
+            continue;
+        }
+        settings.push_back(format);
+    }
+}
+
+void CompressionBench::run()
+{
+    fprintf(stderr, "%-40s %10s %10s %8s\n", "format", "seconds", "MB/s", "ratio");
+    for(std::vector<OutputFormat>::const_iterator it = settings.begin(), itend = settings.end(); it != itend; ++it)
+    {
+        runOne(*it);
+    }
+}
+
+void CompressionBench::runOne(const OutputFormat& format)
+{
+    const char* tmpdir = getenv("TMPDIR");
+    std::string tmpname = std::string(tmpdir ? tmpdir : "/tmp") + "/bamcmp-bench-XXXXXX";
+    int fd = mkstemp(&tmpname[0]);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Failed to create a temporary file for the compression benchmark\n");
+        exit(1);
+    }
+    ::close(fd);
+
+    double start = nowSeconds();
+    htsFile* hf = hts_begin_or_die(tmpname.c_str(), format.mode(), NULL, pool, format.isCram() ? ref : NULL);
+    format.apply(hf);
+    if(sam_hdr_write(hf, header))
+    {
+        fprintf(stderr, "Failed to write header for %s\n", tmpname.c_str());
+        exit(1);
+    }
+    for(std::vector<bam1_t*>::const_iterator it = records.begin(), itend = records.end(); it != itend; ++it)
+    {
+        if(sam_write1(hf, header, *it) < 0)
+        {
+            fprintf(stderr, "Failed to write to %s\n", tmpname.c_str());
+            exit(1);
+        }
+    }
+    if(hts_close(hf) != 0)
+    {
+        fprintf(stderr, "Failed to close %s\n", tmpname.c_str());
+        exit(1);
+    }
+    double secs = nowSeconds() - start;
+
+    struct stat st;
+    off_t size = stat(tmpname.c_str(), &st) == 0 ? st.st_size : 0;
+    unlink(tmpname.c_str());
+    fprintf(stderr, "%-40s %10.2f %10.1f %8.2f\n", format.describe().c_str(), secs, rawBytes / 1048576.0 / secs,
+            size ? (double)rawBytes / size : 0.0);
+}
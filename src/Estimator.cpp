@@ -0,0 +1,124 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Estimator.h"
+
+#include <math.h>
+#include <stdio.h>
+
+static const char* outcomeNames[Estimator::n_outcomes] =
+{
+    "input 1 only",
+    "input 2 only",
+    "input 1 better",
+    "input 2 better"
+};
+
+// 95% two-sided.
+static const double z = 1.959964;
+
+// Don't trust an interval, or stop on it, with fewer reads than this.
+static const uint64_t minReads = 1000;
+
+// How often, in sampled reads, to see whether the intervals are narrow enough.
+static const uint64_t checkEvery = 4096;
+
+Estimator::Estimator(double _fraction, double _tolerance) : fraction(_fraction), tolerance(_tolerance), total(0), nextCheck(minReads), stoppedEarly(false)
+{
+    // Take hashes up to fraction of the 64-bit range; a fraction of 1 samples everything.
+    // Fractions just below 1 can round up to 2^64, which doesn't fit, so clamp first.
+    double scaled = fraction * 18446744073709551616.0;
+    threshold = scaled >= 18446744073709551616.0 ? ~(uint64_t)0 : (uint64_t)scaled;
+    for(int i = 0; i < n_outcomes; ++i)
+    {
+        counts[i] = 0;
+    }
+}
+
+Estimator::~Estimator()
+{
+    //dtor
+}
+
+// True once every category's interval is within tolerance, if one was given. Called at
+// each qname group boundary; only does the arithmetic every checkEvery reads.
+bool Estimator::done()
+{
+    if(tolerance <= 0 || total < nextCheck)
+    {
+        return false;
+    }
+    nextCheck = total + checkEvery;
+    for(int i = 0; i < n_outcomes; ++i)
+    {
+        if(halfWidth(counts[i]) > tolerance)
+        {
+            return false;
+        }
+    }
+    stoppedEarly = true;
+    return true;
+}
+
+void Estimator::interval(uint64_t k, double& lo, double& hi) const
+{
+    if(!total)
+    {
+        lo = 0;
+        hi = 1;
+        return;
+    }
+    double n = total;
+    double p = k / n;
+    double denom = 1 + z * z / n;
+    double centre = (p + z * z / (2 * n)) / denom;
+    double spread = z * sqrt(p * (1 - p) / n + z * z / (4 * n * n)) / denom;
+    lo = centre - spread;
+    hi = centre + spread;
+}
+
+double Estimator::halfWidth(uint64_t k) const
+{
+    double lo, hi;
+    interval(k, lo, hi);
+    return (hi - lo) / 2;
+}
+
+void Estimator::report() const
+{
+    fprintf(stderr, "Estimate from %llu reads (%g of qnames sampled%s):\n", (unsigned long long)total, fraction,
+            stoppedEarly ? ", stopped early at the requested tolerance" : "");
+    for(int i = 0; i < n_outcomes; ++i)
+    {
+        double lo, hi;
+        interval(counts[i], lo, hi);
+        fprintf(stderr, "  %-16s %12llu  %7.3f%%  (95%% CI %.3f%% - %.3f%%)\n", outcomeNames[i], (unsigned long long)counts[i],
+                total ? 100.0 * counts[i] / total : 0.0, 100 * lo, 100 * hi);
+    }
+    if(stoppedEarly)
+    {
+        fprintf(stderr, "Warning: stopping early sampled only the start of the qname-sorted inputs (often the first lanes or tiles);\n"
+                        "the intervals assume a random sample and don't cover any difference between that part and the rest\n");
+    }
+    if(total < minReads)
+    {
+        fprintf(stderr, "Warning: fewer than %llu reads were sampled; consider a larger --estimate fraction\n", (unsigned long long)minReads);
+    }
+}
@@ -0,0 +1,300 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "FastaMap.h"
+
+#include <fcntl.h>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <htslib/faidx.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3_KERNEL
+#endif
+
+// Reference bases to the 4-bit codes BAM uses for read bases (A=1, C=2, G=4, T=8),
+// in either case. Everything else, N and the other IUPAC codes included, is N (15).
+static const uint8_t refCode[256] =
+{
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15,  1, 15,  2, 15, 15, 15,  4, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15,  8, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15,  1, 15,  2, 15, 15, 15,  4, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15,  8, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15
+};
+
+// The same for the SIMD kernel's pshufb, which looks up by the low nibble of the ASCII
+// character. That tells A, C, G and T apart in either case, but other letters share
+// their nibbles (S with C, W with G), so the kernel sends anything that isn't A, C, G
+// or T to N separately.
+static const uint8_t refCodeByLowNibble[16] =
+{
+    15, 1, 15, 2, 8, 15, 15, 4, 15, 15, 15, 15, 15, 15, 15, 15
+};
+
+FastaMap::FastaMap(const char* _fasta) : fasta(_fasta), base(NULL), size(0)
+{
+    int fd = open(_fasta, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Failed to open reference %s\n", _fasta);
+        exit(1);
+    }
+    size = st.st_size;
+    void* p = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if(p == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map reference %s\n", _fasta);
+        exit(1);
+    }
+    base = (const char*)p;
+    if(size >= 2 && (uint8_t)base[0] == 0x1f && (uint8_t)base[1] == 0x8b)
+    {
+        // Still fine for CRAM, so not an error.
+        fprintf(stderr, "Warning: reference %s is compressed, so it can't be used to count mismatches\n", _fasta);
+        munmap(p, size);
+        base = NULL;
+        return;
+    }
+    // Access is by position along each read's alignment, all over the genome.
+    madvise(p, size, MADV_RANDOM);
+    loadIndex();
+}
+
+FastaMap::~FastaMap()
+{
+    if(base)
+    {
+        munmap((void*)base, size);
+    }
+}
+
+// Read fasta.fai, building it first if there isn't one.
+void FastaMap::loadIndex()
+{
+    std::string fainame = fasta + ".fai";
+    if(access(fainame.c_str(), R_OK) != 0 && fai_build(fasta.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to build the index for reference %s\n", fasta.c_str());
+        exit(1);
+    }
+    FILE* f = fopen(fainame.c_str(), "r");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open %s\n", fainame.c_str());
+        exit(1);
+    }
+    char name[4096];
+    long long length, offset, lineBases, lineWidth;
+    while(fscanf(f, "%4095s %lld %lld %lld %lld%*[^\n]", name, &length, &offset, &lineBases, &lineWidth) == 5)
+    {
+        if(lineBases <= 0 || lineWidth < lineBases || offset + (length ? (length - 1) / lineBases * lineWidth + (length - 1) % lineBases : 0) >= (long long)size)
+        {
+            fprintf(stderr, "Index %s doesn't match the reference (sequence %s)\n", fainame.c_str(), name);
+            exit(1);
+        }
+        Entry& e = entries[name];
+        e.length = length;
+        e.offset = offset;
+        e.lineBases = lineBases;
+        e.lineWidth = lineWidth;
+    }
+    fclose(f);
+}
+
+// False if the FASTA couldn't be mapped as plain text.
+bool FastaMap::usable() const
+{
+    return base != NULL;
+}
+
+const FastaMap::Entry* FastaMap::find(const char* name) const
+{
+    std::map<std::string, Entry>::const_iterator it = entries.find(name);
+    return it == entries.end() ? NULL : &it->second;
+}
+
+// Mismatches among n reference bases at ref and the read bases starting at query
+// position qpos. A read base of = (0) matches anything.
+static uint32_t countScalar(const char* ref, const uint8_t* seq, int32_t qpos, int32_t n)
+{
+    uint32_t mismatches = 0;
+    for(int32_t i = 0; i < n; ++i)
+    {
+        uint8_t r = refCode[(uint8_t)ref[i]];
+        uint8_t q = bam_seqi(seq, qpos + i);
+        mismatches += (q != r && q != 0);
+    }
+    return mismatches;
+}
+
+#ifdef HAVE_SSSE3_KERNEL
+// As countScalar, for even qpos. 16 bases at a time: translate the reference with pshufb,
+// turn lanes that aren't A, C, G or T into N, unpack 8 bytes of read nibbles into 16
+// bytes, and count the lanes that differ.
+__attribute__((target("ssse3"))) static uint32_t countSSSE3(const char* ref, const uint8_t* seq, int32_t qpos, int32_t n)
+{
+    const __m128i table = _mm_loadu_si128((const __m128i*)refCodeByLowNibble);
+    const __m128i lowNibble = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i unknown = _mm_set1_epi8(15);
+    const __m128i lowerCase = _mm_set1_epi8(0x20);
+    uint32_t mismatches = 0;
+    int32_t i = 0;
+    const uint8_t* packed = seq + qpos / 2;
+    for(; i + 16 <= n; i += 16, packed += 8)
+    {
+        __m128i chars = _mm_loadu_si128((const __m128i*)(ref + i));
+        __m128i r = _mm_shuffle_epi8(table, _mm_and_si128(chars, lowNibble));
+        __m128i lower = _mm_or_si128(chars, lowerCase);
+        __m128i acgt = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('a')), _mm_cmpeq_epi8(lower, _mm_set1_epi8('c'))),
+                                    _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('g')), _mm_cmpeq_epi8(lower, _mm_set1_epi8('t'))));
+        r = _mm_or_si128(_mm_and_si128(acgt, r), _mm_andnot_si128(acgt, unknown));
+        __m128i bytes = _mm_loadl_epi64((const __m128i*)packed);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), lowNibble);
+        __m128i lo = _mm_and_si128(bytes, lowNibble);
+        // The first base of each byte is in its high nibble.
+        __m128i q = _mm_unpacklo_epi8(hi, lo);
+        __m128i same = _mm_or_si128(_mm_cmpeq_epi8(q, r), _mm_cmpeq_epi8(q, zero));
+        mismatches += 16 - __builtin_popcount(_mm_movemask_epi8(same));
+    }
+    return mismatches + countScalar(ref + i, seq, qpos + i, n - i);
+}
+
+static bool haveSSSE3()
+{
+    static int cached = -1;
+    if(cached < 0)
+    {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    }
+    return cached;
+}
+#endif
+
+// Mismatches between len read bases from qpos and the reference from pos, one FASTA
+// line at a time. Bases beyond the end of the sequence count as mismatches.
+uint32_t FastaMap::countMismatches(const Entry* e, int64_t pos, const uint8_t* seq, int32_t qpos, int32_t len) const
+{
+    uint32_t mismatches = 0;
+    if(pos < 0 || pos >= e->length)
+    {
+        return len;
+    }
+    if(pos + len > e->length)
+    {
+        mismatches += pos + len - e->length;
+        len = e->length - pos;
+    }
+    while(len > 0)
+    {
+        const char* ref = base + e->offset + pos / e->lineBases * e->lineWidth + pos % e->lineBases;
+        int32_t n = (int32_t)std::min<int64_t>(len, e->lineBases - pos % e->lineBases);
+        int32_t done = 0;
+        // The kernel wants the read to start on a byte boundary.
+        if(qpos & 1)
+        {
+            mismatches += countScalar(ref, seq, qpos, 1);
+            done = 1;
+        }
+#ifdef HAVE_SSSE3_KERNEL
+        if(haveSSSE3())
+        {
+            mismatches += countSSSE3(ref + done, seq, qpos + done, n - done);
+        }
+        else
+#endif
+        {
+            mismatches += countScalar(ref + done, seq, qpos + done, n - done);
+        }
+        pos += n;
+        qpos += n;
+        len -= n;
+    }
+    return mismatches;
+}
+
+ReferenceLookup::ReferenceLookup(const FastaMap* _fasta, const bam_hdr_t* header) : fasta(_fasta), byTid(header->n_targets)
+{
+    for(int32_t tid = 0; tid < header->n_targets; ++tid)
+    {
+        byTid[tid] = fasta->find(header->target_name[tid]);
+    }
+}
+
+ReferenceLookup::~ReferenceLookup()
+{
+    //dtor
+}
+
+bool ReferenceLookup::canCount(const bam1_t* rec) const
+{
+    return rec->core.tid >= 0 && rec->core.tid < (int32_t)byTid.size() && byTid[rec->core.tid] && rec->core.l_qseq > 0;
+}
+
+// Mismatched bases under the record's M operators.
+uint32_t ReferenceLookup::countMismatches(const bam1_t* rec) const
+{
+    const FastaMap::Entry* e = byTid[rec->core.tid];
+    const uint32_t* cigar = bam_get_cigar(rec);
+    const uint8_t* seq = bam_get_seq(rec);
+    int64_t pos = rec->core.pos;
+    int32_t qpos = 0;
+    uint32_t mismatches = 0;
+    for(uint32_t i = 0; i < rec->core.n_cigar; ++i)
+    {
+        int32_t n = bam_cigar_oplen(cigar[i]);
+        int type = bam_cigar_type(bam_cigar_op(cigar[i]));
+        if(bam_cigar_op(cigar[i]) == BAM_CMATCH && n > 0 && qpos + n <= rec->core.l_qseq)
+        {
+            mismatches += fasta->countMismatches(e, pos, seq, qpos, n);
+        }
+        // Bit 1: consumes the query; bit 2: consumes the reference.
+        if(type & 1)
+        {
+            qpos += n;
+        }
+        if(type & 2)
+        {
+            pos += n;
+        }
+    }
+    return mismatches;
+}
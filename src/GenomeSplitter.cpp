@@ -0,0 +1,210 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "GenomeSplitter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <set>
+
+#include "MemoryBudget.h"
+
+GenomeSplitter::GenomeSplitter(RecordSource* _reader, const std::vector<int>& _genomeOfTid) :
+    reader(_reader), genomeOfTid(_genomeOfTid)
+{
+    //ctor
+}
+
+GenomeSplitter::~GenomeSplitter()
+{
+    //dtor
+}
+
+static void read_contig_list(const char* fname, std::set<std::string>& contigs)
+{
+    FILE* f = fopen(fname, "r");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open contig list %s\n", fname);
+        exit(1);
+    }
+    char buf[4096];
+    while(fgets(buf, sizeof(buf), f))
+    {
+        char* name = strtok(buf, " \t\r\n");
+        if(name && name[0] != '#')
+        {
+            contigs.insert(std::string(name));
+        }
+    }
+    fclose(f);
+}
+
+static bool has_prefix(const char* name, const std::vector<std::string>& prefixes)
+{
+    for(std::vector<std::string>::const_iterator it = prefixes.begin(), itend = prefixes.end(); it != itend; ++it)
+    {
+        if(strncmp(name, it->c_str(), it->size()) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Work out which genome (1 or 2) each @SQ belongs to, by name prefix or by explicit contig lists.
+// Contigs that no rule claims go to the other genome when only one genome has rules.
+std::vector<int> GenomeSplitter::assignGenomes(const bam_hdr_t* header, const std::vector<std::string>& prefixes1, const std::vector<std::string>& prefixes2,
+                                               const char* contigs1, const char* contigs2)
+{
+    std::set<std::string> list1, list2;
+    if(contigs1)
+    {
+        read_contig_list(contigs1, list1);
+    }
+    if(contigs2)
+    {
+        read_contig_list(contigs2, list2);
+    }
+    bool rules1 = contigs1 || !prefixes1.empty();
+    bool rules2 = contigs2 || !prefixes2.empty();
+    if(!(rules1 || rules2))
+    {
+        fprintf(stderr, "Single-input mode needs --prefix1/--prefix2 or --contigs1/--contigs2 to tell the two genomes apart\n");
+        exit(1);
+    }
+
+    std::vector<int> genomes(header->n_targets, 0);
+    int counts[3] = {0, 0, 0};
+    for(int i = 0; i < header->n_targets; ++i)
+    {
+        const char* name = header->target_name[i];
+        bool in1 = list1.count(std::string(name)) || has_prefix(name, prefixes1);
+        bool in2 = list2.count(std::string(name)) || has_prefix(name, prefixes2);
+        if(in1 && in2)
+        {
+            fprintf(stderr, "Reference sequence %s matches the rules for both genomes\n", name);
+            exit(1);
+        }
+        else if(in1 || in2)
+        {
+            genomes[i] = in1 ? 1 : 2;
+        }
+        else if(rules1 != rules2)
+        {
+            genomes[i] = rules1 ? 2 : 1;
+        }
+        else
+        {
+            fprintf(stderr, "Reference sequence %s doesn't match the rules for either genome\n", name);
+            exit(1);
+        }
+        ++counts[genomes[i]];
+    }
+    fprintf(stderr, "Single-input mode: %d reference sequences in genome 1, %d in genome 2\n", counts[1], counts[2]);
+    return genomes;
+}
+
+RecordSource* GenomeSplitter::getSide(int genome)
+{
+    return genome == 1 ? (RecordSource*)&side1 : (RecordSource*)&side2;
+}
+
+// Replace the sides' contents with the reader's next qname group, divided by genome.
+// False once the input is exhausted.
+bool GenomeSplitter::nextGroup()
+{
+    side1.clear();
+    side2.clear();
+    if(reader->is_eof())
+    {
+        return false;
+    }
+    qname.assign(bam_get_qname(reader->getRec()));
+    while(!reader->is_eof() && strcmp(bam_get_qname(reader->getRec()), qname.c_str()) == 0)
+    {
+        reader->load();
+        bam1_t* rec = reader->getRec();
+        int genome = 0;
+        if(!(rec->core.flag & BAM_FUNMAP) && rec->core.tid >= 0)
+        {
+            genome = genomeOfTid[rec->core.tid];
+        }
+        if(genome != 2)
+        {
+            side1.push(rec);
+        }
+        if(genome != 1)
+        {
+            side2.push(rec);
+        }
+        reader->next();
+    }
+    return true;
+}
+
+GenomeSplitter::Side::Side()
+{
+    //ctor
+}
+
+GenomeSplitter::Side::~Side()
+{
+    clear();
+}
+
+// The queues can't spill, but hold one qname group at most; they're counted so that
+// the qname groups make room for them.
+void GenomeSplitter::Side::push(const bam1_t* rec)
+{
+    bam1_t* dup = bam_dup1(rec);
+    MemoryBudget::reserve(MemoryBudget::component_splitter, sizeof(bam1_t) + dup->m_data);
+    queue.push_back(dup);
+}
+
+void GenomeSplitter::Side::clear()
+{
+    while(!queue.empty())
+    {
+        next();
+    }
+}
+
+bool GenomeSplitter::Side::is_eof() const
+{
+    return queue.empty();
+}
+
+void GenomeSplitter::Side::next()
+{
+    if(queue.empty())
+    {
+        return;
+    }
+    MemoryBudget::release(MemoryBudget::component_splitter, sizeof(bam1_t) + queue.front()->m_data);
+    bam_destroy1(queue.front());
+    queue.pop_front();
+}
+
+bam1_t* GenomeSplitter::Side::getRec()
+{
+    return queue.front();
+}
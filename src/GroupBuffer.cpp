@@ -0,0 +1,174 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "GroupBuffer.h"
+
+#include <stdlib.h>
+
+#include "MemoryBudget.h"
+#include "util.h"
+
+// Spilled records are stored as the bam1_core_t, then l_data, then the data itself.
+
+GroupBuffer::GroupBuffer() : limit(0), used(0), spill(0), spillEnd(0), spillRec(bam_init1())
+{
+    clear();
+}
+
+GroupBuffer::~GroupBuffer()
+{
+    MemoryBudget::release(MemoryBudget::component_groups, used);
+    if(spill)
+    {
+        fclose(spill);
+    }
+    bam_destroy1(spillRec);
+}
+
+// 0 means no limit.
+void GroupBuffer::setLimit(uint64_t _limit)
+{
+    limit = _limit;
+}
+
+void GroupBuffer::clear()
+{
+    for(int m = 0; m < n_mates; ++m)
+    {
+        inMemory[m].clear();
+        spillOffsets[m].clear();
+        memPos[m] = 0;
+        spillPos[m] = 0;
+    }
+    MemoryBudget::release(MemoryBudget::component_groups, used);
+    used = 0;
+    // The temporary file is reused from the start for the next spilled group.
+    spillEnd = 0;
+}
+
+void GroupBuffer::add(bam1_t* rec)
+{
+    int mate = flag2mate(rec);
+    uint64_t size = sizeof(bam1_t) + rec->l_data;
+    // Once anything has spilled, everything after it must too, to keep each mate in input order.
+    // The global budget always admits a group's first record, so however tight it is the
+    // usual one-record groups never touch the disk.
+    if(spilled() || (limit && used + size > limit) ||
+       (used && !MemoryBudget::tryReserve(MemoryBudget::component_groups, size)))
+    {
+        spillOne(rec, mate);
+        return;
+    }
+    if(!used)
+    {
+        MemoryBudget::reserve(MemoryBudget::component_groups, size);
+    }
+    inMemory[mate].copy_add(rec);
+    used += size;
+}
+
+unsigned int GroupBuffer::count(int mate) const
+{
+    return inMemory[mate].size() + spillOffsets[mate].size();
+}
+
+bool GroupBuffer::spilled() const
+{
+    return spillEnd != 0;
+}
+
+// The first record for this mate, which must be held in memory.
+bam1_t* GroupBuffer::front(int mate)
+{
+    return inMemory[mate].get(0);
+}
+
+void GroupBuffer::rewind(int mate)
+{
+    memPos[mate] = 0;
+    spillPos[mate] = 0;
+}
+
+// The next record for this mate, or NULL when there are no more. A spilled record is
+// only valid until the following call, but may be modified until then.
+bam1_t* GroupBuffer::next(int mate)
+{
+    if(memPos[mate] < inMemory[mate].size())
+    {
+        return inMemory[mate].get(memPos[mate]++);
+    }
+    if(spillPos[mate] < spillOffsets[mate].size())
+    {
+        readSpilled(spillOffsets[mate][spillPos[mate]++]);
+        return spillRec;
+    }
+    return NULL;
+}
+
+void GroupBuffer::spillOne(const bam1_t* rec, int mate)
+{
+    if(!spill)
+    {
+        spill = tmpfile();
+        if(!spill)
+        {
+            fprintf(stderr, "Failed to create a temporary file to hold a large qname group\n");
+            exit(1);
+        }
+    }
+    if(fseek(spill, spillEnd, SEEK_SET) != 0 ||
+       fwrite(&rec->core, sizeof(bam1_core_t), 1, spill) != 1 ||
+       fwrite(&rec->l_data, sizeof(rec->l_data), 1, spill) != 1 ||
+       fwrite(rec->data, 1, rec->l_data, spill) != (size_t)rec->l_data)
+    {
+        fprintf(stderr, "Failed to write a large qname group to a temporary file\n");
+        exit(1);
+    }
+    spillOffsets[mate].push_back(spillEnd);
+    spillEnd += sizeof(bam1_core_t) + sizeof(rec->l_data) + rec->l_data;
+}
+
+void GroupBuffer::readSpilled(long offset)
+{
+    int l_data;
+    if(fseek(spill, offset, SEEK_SET) != 0 ||
+       fread(&spillRec->core, sizeof(bam1_core_t), 1, spill) != 1 ||
+       fread(&l_data, sizeof(l_data), 1, spill) != 1)
+    {
+        fprintf(stderr, "Failed to read back a large qname group from a temporary file\n");
+        exit(1);
+    }
+    if((int)spillRec->m_data < l_data)
+    {
+        spillRec->m_data = l_data;
+        spillRec->data = (uint8_t*)realloc(spillRec->data, spillRec->m_data);
+        if(!spillRec->data)
+        {
+            fprintf(stderr, "Out of memory reading back a large qname group\n");
+            exit(1);
+        }
+    }
+    if(fread(spillRec->data, 1, l_data, spill) != (size_t)l_data)
+    {
+        fprintf(stderr, "Failed to read back a large qname group from a temporary file\n");
+        exit(1);
+    }
+    spillRec->l_data = l_data;
+}
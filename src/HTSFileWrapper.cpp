@@ -23,12 +23,25 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <htslib/bgzf.h>
+#include <htslib/hts_endian.h>
 
+#include "MemoryBudget.h"
+#include "Profiler.h"
 #include "util.h"
 
 std::vector<std::pair<std::string, HTSFileWrapper*> > HTSFileWrapper::openOutputs;
+std::map<std::pair<std::string, std::string>, bam_hdr_t*> HTSFileWrapper::mergedHeaders;
 
-HTSFileWrapper* HTSFileWrapper::begin_or_die(const char* fname, const char* mode, bam_hdr_t* header, int inputNumber, int nthreads)
+// Raw BAM records are gathered up to this many bytes per bgzf_write.
+static const size_t passthroughBatch = 256 << 10;
+
+// Guards openOutputs and mergedHeaders, which batch mode shares between samples running concurrently.
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+HTSFileWrapper* HTSFileWrapper::begin_or_die(const char* fname, const OutputFormat& format, bam_hdr_t* header, int inputNumber, htsThreadPool* pool, RefCache* ref)
 {
     if(inputNumber != 1 && inputNumber != 2)
     {
@@ -37,6 +50,7 @@ HTSFileWrapper* HTSFileWrapper::begin_or_die(const char* fname, const char* mode
     }
     HTSFileWrapper* ret = NULL;
     std::string sfname(fname);
+    pthread_mutex_lock(&registryLock);
     for(std::vector<std::pair<std::string, HTSFileWrapper*> >::iterator it = HTSFileWrapper::openOutputs.begin(), itend = HTSFileWrapper::openOutputs.end(); it != itend && !ret; ++it)
     {
         if(it->first == sfname)
@@ -47,16 +61,19 @@ HTSFileWrapper* HTSFileWrapper::begin_or_die(const char* fname, const char* mode
     }
     if(!ret)
     {
-        ret = new HTSFileWrapper(sfname, mode, nthreads);
+        ret = new HTSFileWrapper(sfname, format, pool);
         HTSFileWrapper::openOutputs.push_back(std::make_pair(sfname, ret));
     }
+    pthread_mutex_unlock(&registryLock);
     if(inputNumber == 1)
     {
         ret->setHeader1(header);
+        ret->setReference1(ref);
     }
     else
     {
         ret->setHeader2(header);
+        ret->setReference2(ref);
     }
     return ret;
 }
@@ -65,12 +82,28 @@ void HTSFileWrapper::close(HTSFileWrapper* f)
 {
     if(!f->unref())
     {
+        pthread_mutex_lock(&registryLock);
+        for(std::vector<std::pair<std::string, HTSFileWrapper*> >::iterator it = openOutputs.begin(), itend = openOutputs.end(); it != itend; ++it)
+        {
+            if(it->second == f)
+            {
+                openOutputs.erase(it);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&registryLock);
         delete f;
     }
 }
 
-HTSFileWrapper::HTSFileWrapper(const std::string& _fname, const char* _mode, int _nthreads)  :
-        fname(_fname), mode(_mode), hts(0), refCount(1), nthreads(_nthreads), header2_offset(0), header1(0), header2(0), headerOut(0)
+const std::vector<std::pair<std::string, HTSFileWrapper*> >& HTSFileWrapper::getOpenOutputs()
+{
+    return openOutputs;
+}
+
+HTSFileWrapper::HTSFileWrapper(const std::string& _fname, const OutputFormat& _format, htsThreadPool* _pool)  :
+        fname(_fname), format(_format), hts(0), refCount(1), pool(_pool), header2_offset(0), header1(0), header2(0), headerOut(0), ownsHeaderOut(false),
+        ref1(0), ref2(0), resuming(false), bufferBytes(0), passthrough(false), slimRec(0), stats(0)
 {
     //ctor
 }
@@ -78,6 +111,11 @@ HTSFileWrapper::HTSFileWrapper(const std::string& _fname, const char* _mode, int
 HTSFileWrapper::~HTSFileWrapper()
 {
     //dtor
+    if(slimRec)
+    {
+        bam_destroy1(slimRec);
+    }
+    delete stats;
 }
 
 void HTSFileWrapper::setHeader1(bam_hdr_t* h1)
@@ -92,6 +130,18 @@ void HTSFileWrapper::setHeader2(bam_hdr_t* h2)
     header2 = h2;
 }
 
+void HTSFileWrapper::setReference1(RefCache* r1)
+{
+    checkHeaderNotWritten();
+    ref1 = r1;
+}
+
+void HTSFileWrapper::setReference2(RefCache* r2)
+{
+    checkHeaderNotWritten();
+    ref2 = r2;
+}
+
 void HTSFileWrapper::ref()
 {
     ++refCount;
@@ -102,7 +152,18 @@ uint32_t HTSFileWrapper:: unref()
     checkStarted();
     if(refCount == 1)
     {
+        drainPending();
         hts_close(hts);
+        MemoryBudget::release(MemoryBudget::component_outputs, bufferBytes);
+        if(stats)
+        {
+            stats->write(fname, headerOut);
+        }
+        if(ownsHeaderOut)
+        {
+            bam_hdr_destroy(headerOut);
+            ownsHeaderOut = false;
+        }
     }
     return --refCount;
 }
@@ -126,6 +187,11 @@ void HTSFileWrapper::checkStarted()
     {
         headerOut = header2;
     }
+    else if((headerOut = findMergedHeader()) != NULL)
+    {
+        // Some other output, perhaps for another sample in a batch, already built this combination.
+        header2_offset = header1->n_targets;
+    }
     else
     {
         header2_offset = header1->n_targets;
@@ -304,9 +370,55 @@ void HTSFileWrapper::checkStarted()
             read_offset += len;
         }
         headerOut->text[headerOut->l_text] = '\0';
+        storeMergedHeader();
     }
     // Header complete, now open and write it:
-    hts = hts_begin_or_die(fname.c_str(), mode, headerOut, nthreads);
+    {
+        const char* fai = NULL;
+        if(format.isCram())
+        {
+            if(header1 && header2)
+            {
+                // No single FASTA covers the combined A_/B_ reference; have CRAM find each
+                // sequence by MD5 in the shared reference cache instead. The combined header
+                // is shared, so tag a copy.
+                headerOut = bam_hdr_dup(headerOut);
+                ownsHeaderOut = true;
+                addM5Tags();
+            }
+            else
+            {
+                RefCache* ref = header1 ? ref1 : ref2;
+                fai = ref ? ref->fastaName() : NULL;
+            }
+        }
+        if(resuming)
+        {
+            // Carry on from where a checkpointed run left off; the header is already there.
+            std::string amode(format.mode());
+            amode[amode.find('w')] = 'a';
+            hts = hts_begin_or_die(fname.c_str(), amode.c_str(), NULL, pool, fai);
+        }
+        else
+        {
+            hts = hts_begin_or_die(fname.c_str(), format.mode(), headerOut, pool, fai);
+        }
+        format.apply(hts);
+        // BAM to BAM, records can be copied out as they are encoded in memory, which is
+        // the on-disk layout on a little-endian host.
+        uint16_t one = 1;
+        passthrough = hts_get_format(hts)->format == bam && hts_get_bgzfp(hts) && *(uint8_t*)&one == 1;
+        if(passthrough)
+        {
+            pending.reserve(passthroughBatch * 2);
+        }
+        bufferBytes = hts_buffer_bytes(hts, pool) + (passthrough ? passthroughBatch * 2 : 0);
+        MemoryBudget::reserve(MemoryBudget::component_outputs, bufferBytes);
+        if(format.isStats())
+        {
+            stats = new OutputStats();
+        }
+    }
     return;
 oom:
     fprintf(stderr, "Malloc failure while building combined header\n");
@@ -315,7 +427,23 @@ oom:
 
 void HTSFileWrapper::write1(int headerNum, bam1_t* rec)
 {
+    PROFILE_SCOPE(Profiler::stage_write);
     checkStarted();
+    if(format.isSlim())
+    {
+        rec = slimCopy(rec);
+    }
+    if(stats)
+    {
+        int offset = headerNum == 2 ? header2_offset : 0;
+        stats->add(rec, rec->core.tid == -1 ? -1 : rec->core.tid + offset, rec->core.mtid == -1 ? -1 : rec->core.mtid + offset);
+    }
+    if(passthrough && appendRaw(headerNum, rec))
+    {
+        return;
+    }
+    // Whatever was gathered raw must go out first, to keep the records in order.
+    drainPending();
     if(headerNum == 2)
     {
         if(rec->core.tid != -1)
@@ -344,6 +472,155 @@ void HTSFileWrapper::write1(int headerNum, bam1_t* rec)
     }
 }
 
+// Append rec to the pending raw BAM, with tid / mtid moved into the output header's
+// numbering in the copy. False for the records bam_write1 has to treat specially (a
+// CIGAR too long for the BAM field, coordinates beyond 32 bits), which go the slow way.
+bool HTSFileWrapper::appendRaw(int headerNum, const bam1_t* rec)
+{
+    const bam1_core_t& c = rec->core;
+    if(c.n_cigar > 0xffff || c.pos > INT32_MAX || c.mpos > INT32_MAX || c.isize < INT32_MIN || c.isize > INT32_MAX)
+    {
+        return false;
+    }
+    int offset = headerNum == 2 ? header2_offset : 0;
+    // In memory the qname is padded with extra NULs to align what follows; on disk it isn't.
+    uint32_t l_qname = c.l_qname - c.l_extranul;
+    uint32_t block_len = 32 + rec->l_data - c.l_extranul;
+    size_t at = pending.size();
+    pending.resize(at + 4 + block_len);
+    uint8_t* p = &pending[at];
+    u32_to_le(block_len, p);
+    i32_to_le(c.tid == -1 ? -1 : c.tid + offset, p + 4);
+    i32_to_le(c.pos, p + 8);
+    u32_to_le((uint32_t)c.bin << 16 | (uint32_t)c.qual << 8 | l_qname, p + 12);
+    u32_to_le((uint32_t)c.flag << 16 | c.n_cigar, p + 16);
+    i32_to_le(c.l_qseq, p + 20);
+    i32_to_le(c.mtid == -1 ? -1 : c.mtid + offset, p + 24);
+    i32_to_le(c.mpos, p + 28);
+    i32_to_le(c.isize, p + 32);
+    memcpy(p + 36, rec->data, l_qname);
+    memcpy(p + 36 + l_qname, rec->data + c.l_qname, rec->l_data - c.l_qname);
+    if(pending.size() >= passthroughBatch)
+    {
+        drainPending();
+    }
+    return true;
+}
+
+// The aux fields a slim output keeps: the scores bamcmp itself attaches.
+static bool isScoreTag(const uint8_t* tag)
+{
+    static const char* const keep[] = { "as", "bs", "om", "sm", "sa", "sq" };
+    for(size_t i = 0; i != sizeof(keep) / sizeof(keep[0]); ++i)
+    {
+        if(tag[0] == keep[i][0] && tag[1] == keep[i][1])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// rec with its sequence, qualities and all aux fields but the score tags stripped, in
+// storage reused from one record to the next.
+bam1_t* HTSFileWrapper::slimCopy(const bam1_t* rec)
+{
+    if(!slimRec)
+    {
+        slimRec = bam_init1();
+    }
+    if(slimRec->m_data < (uint32_t)rec->l_data)
+    {
+        uint8_t* data = (uint8_t*)realloc(slimRec->data, rec->l_data);
+        if(!data)
+        {
+            fprintf(stderr, "Malloc failure while writing %s\n", fname.c_str());
+            exit(1);
+        }
+        slimRec->data = data;
+        slimRec->m_data = rec->l_data;
+    }
+    size_t keep = rec->core.l_qname + rec->core.n_cigar * 4;
+    memcpy(slimRec->data, rec->data, keep);
+    uint8_t* out = slimRec->data + keep;
+    const uint8_t* end = rec->data + rec->l_data;
+    for(const uint8_t* p = bam_get_aux(rec); p && end - p >= 3;)
+    {
+        const uint8_t* next = aux_next(p, end);
+        if(next && isScoreTag(p))
+        {
+            memcpy(out, p, next - p);
+            out += next - p;
+        }
+        p = next;
+    }
+    slimRec->core = rec->core;
+    slimRec->core.l_qseq = 0;
+    slimRec->l_data = out - slimRec->data;
+    return slimRec;
+}
+
+void HTSFileWrapper::drainPending()
+{
+    if(pending.empty())
+    {
+        return;
+    }
+    if(bgzf_write(hts_get_bgzfp(hts), &pending[0], pending.size()) < 0)
+    {
+        fprintf(stderr, "Failed to write to %s\n", fname.c_str());
+        exit(1);
+    }
+    pending.clear();
+}
+
+// CRAM containers can't be cut off and appended to at an arbitrary record.
+bool HTSFileWrapper::canCheckpoint() const
+{
+    return !format.isCram();
+}
+
+// Push everything written so far out to the file, and return its length in bytes.
+// Ends the current BGZF block, so the file can later be cut back to this point.
+int64_t HTSFileWrapper::flush()
+{
+    checkStarted();
+    drainPending();
+    hFILE* hf;
+    BGZF* bgzf = hts_get_bgzfp(hts);
+    if(bgzf)
+    {
+        if(bgzf_flush(bgzf) < 0)
+        {
+            fprintf(stderr, "Failed to flush %s\n", fname.c_str());
+            exit(1);
+        }
+        hf = bgzf->fp;
+    }
+    else
+    {
+        hf = hts->fp.hfile;
+    }
+    if(hflush(hf) < 0)
+    {
+        fprintf(stderr, "Failed to flush %s\n", fname.c_str());
+        exit(1);
+    }
+    return htell(hf);
+}
+
+// Discard anything written after offset by a previous run, and append from there.
+void HTSFileWrapper::resumeAt(int64_t offset)
+{
+    checkHeaderNotWritten();
+    if(truncate(fname.c_str(), offset) != 0)
+    {
+        fprintf(stderr, "Failed to truncate %s to %lld bytes for resuming\n", fname.c_str(), (long long)offset);
+        exit(1);
+    }
+    resuming = true;
+}
+
 void HTSFileWrapper::checkHeaderNotWritten()
 {
     if(headerOut)
@@ -352,3 +629,112 @@ void HTSFileWrapper::checkHeaderNotWritten()
         exit(1);
     }
 }
+
+// What a combined header is built from: a header's text and its binary target list,
+// which needn't agree (a BAM's text may have no @SQ lines at all).
+static std::string merged_header_key(const bam_hdr_t* h)
+{
+    std::string key(h->text, h->l_text);
+    key += '\0';
+    for(int32_t i = 0; i < h->n_targets; ++i)
+    {
+        char len[16];
+        snprintf(len, sizeof(len), "\t%u\n", (unsigned)h->target_len[i]);
+        key += h->target_name[i];
+        key += len;
+    }
+    return key;
+}
+
+bam_hdr_t* HTSFileWrapper::findMergedHeader()
+{
+    pthread_mutex_lock(&registryLock);
+    std::map<std::pair<std::string, std::string>, bam_hdr_t*>::const_iterator it =
+        mergedHeaders.find(std::make_pair(merged_header_key(header1), merged_header_key(header2)));
+    bam_hdr_t* ret = (it == mergedHeaders.end()) ? NULL : it->second;
+    pthread_mutex_unlock(&registryLock);
+    return ret;
+}
+
+// Keep the combined header for reuse by any output combining the same two headers.
+// If another thread got there first, use its copy instead.
+void HTSFileWrapper::storeMergedHeader()
+{
+    std::pair<std::string, std::string> key(merged_header_key(header1), merged_header_key(header2));
+    pthread_mutex_lock(&registryLock);
+    std::pair<std::map<std::pair<std::string, std::string>, bam_hdr_t*>::iterator, bool> ins =
+        mergedHeaders.insert(std::make_pair(key, headerOut));
+    if(!ins.second)
+    {
+        bam_hdr_destroy(headerOut);
+        headerOut = ins.first->second;
+    }
+    else
+    {
+        // Kept for the life of the process, along with the two keys.
+        MemoryBudget::reserve(MemoryBudget::component_headers, header_bytes(headerOut) + key.first.size() + key.second.size());
+    }
+    pthread_mutex_unlock(&registryLock);
+}
+
+// Give every @SQ line of the combined header an M5 tag, looking A_ sequences up in
+// reference 1 and B_ sequences in reference 2.
+void HTSFileWrapper::addM5Tags()
+{
+    if(!(ref1 && ref2))
+    {
+        fprintf(stderr, "Writing CRAM file %s, which combines records from both inputs, needs both --ref1 and --ref2\n", fname.c_str());
+        exit(1);
+    }
+
+    std::string text;
+    const char* line = headerOut->text;
+    while(*line)
+    {
+        const char* nl = strchr(line, '\n');
+        const char* end = nl ? nl : line + strlen(line);
+        std::string sline(line, end - line);
+        if(sline.compare(0, 3, "@SQ") == 0 && sline.find("\tM5:") == std::string::npos)
+        {
+            size_t sn = sline.find("\tSN:");
+            if(sn != std::string::npos)
+            {
+                size_t snend = sline.find('\t', sn + 4);
+                std::string name = sline.substr(sn + 4, snend == std::string::npos ? std::string::npos : snend - (sn + 4));
+                const char* md5 = NULL;
+                if(name.compare(0, 2, "A_") == 0)
+                {
+                    md5 = ref1->md5(name.substr(2));
+                }
+                else if(name.compare(0, 2, "B_") == 0)
+                {
+                    md5 = ref2->md5(name.substr(2));
+                }
+                if(!md5)
+                {
+                    fprintf(stderr, "Sequence %s in the header for %s is not in the matching reference\n", name.c_str(), fname.c_str());
+                    exit(1);
+                }
+                sline += "\tM5:";
+                sline += md5;
+            }
+        }
+        text += sline;
+        if(nl)
+        {
+            text += '\n';
+        }
+        line = nl ? nl + 1 : end;
+    }
+
+    char* newtext = (char*)malloc(text.size() + 1);
+    if(!newtext)
+    {
+        fprintf(stderr, "Malloc failure while building combined header\n");
+        exit(1);
+    }
+    memcpy(newtext, text.c_str(), text.size() + 1);
+    free(headerOut->text);
+    headerOut->text = newtext;
+    headerOut->l_text = text.size();
+}
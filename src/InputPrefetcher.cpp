@@ -0,0 +1,298 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "InputPrefetcher.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "MemoryBudget.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+InputPrefetcher::InputPrefetcher(const char* _fname, int _depth, size_t _chunk) :
+    fname(_fname), fd(-1), depth(_depth), chunk(_chunk), filesize(0), stop(false), ring(NULL),
+    reader_pos(0), next_notify(0), issued(0), bufferBytes(0)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    struct stat st;
+    fd = open(fname.c_str(), O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        // Pipes and the like can't be read ahead of the reader.
+        if(fd >= 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+        return;
+    }
+    filesize = st.st_size;
+
+#ifdef HAVE_LIBURING
+    struct io_uring* r = (struct io_uring*)malloc(sizeof(struct io_uring));
+    if(r && io_uring_queue_init(depth, r, 0) == 0)
+    {
+        ring = r;
+    }
+    else
+    {
+        // Kernel too old, or io_uring disabled by policy: fall back to posix_fadvise.
+        free(r);
+    }
+#endif
+
+    // io_uring gives each read in flight a buffer of its own; if --max-memory can't spare
+    // them all, keep fewer reads in flight (and a shorter window) rather than go over.
+    int slots = ring ? depth : 1;
+    while(slots > 1 && !MemoryBudget::tryReserve(MemoryBudget::component_readahead, (uint64_t)slots * chunk))
+    {
+        slots /= 2;
+    }
+    if(slots == 1)
+    {
+        MemoryBudget::reserve(MemoryBudget::component_readahead, chunk);
+    }
+    if(ring)
+    {
+        depth = slots;
+    }
+    bufferBytes = (uint64_t)slots * chunk;
+
+    if(pthread_create(&thread, NULL, InputPrefetcher::run, this) != 0)
+    {
+        fprintf(stderr, "Failed to start read-ahead thread for %s\n", fname.c_str());
+        exit(1);
+    }
+}
+
+InputPrefetcher::~InputPrefetcher()
+{
+    if(fd >= 0)
+    {
+        pthread_mutex_lock(&lock);
+        stop = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(thread, NULL);
+        ::close(fd);
+        MemoryBudget::release(MemoryBudget::component_readahead, bufferBytes);
+    }
+#ifdef HAVE_LIBURING
+    if(ring)
+    {
+        io_uring_queue_exit((struct io_uring*)ring);
+        free(ring);
+    }
+#endif
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+// Called by the reader with the compressed offset it has reached. Only takes the lock
+// once per chunk, so it's cheap enough to call for every record.
+void InputPrefetcher::consumed(int64_t offset)
+{
+    if(offset < next_notify)
+    {
+        return;
+    }
+    next_notify = offset + chunk;
+    pthread_mutex_lock(&lock);
+    reader_pos = offset;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+const char* InputPrefetcher::backendName() const
+{
+    if(fd < 0)
+    {
+        return "off";
+    }
+    return ring ? "io_uring" : "posix_fadvise";
+}
+
+void* InputPrefetcher::run(void* arg)
+{
+    InputPrefetcher* self = (InputPrefetcher*)arg;
+    self->loop();
+    return NULL;
+}
+
+void InputPrefetcher::loop()
+{
+    if(ring)
+    {
+        loopUring();
+    }
+    else
+    {
+        loopFadvise();
+    }
+}
+
+// If the reader has seeked past what we've fetched (skipping through a qname index),
+// carry on from where it is rather than reading the bytes it skipped. Call with the
+// lock held.
+void InputPrefetcher::catchUp()
+{
+    if(issued < reader_pos)
+    {
+        issued = reader_pos;
+    }
+}
+
+// Wait until the reader is within depth chunks of what we've fetched. Returns false
+// once there's nothing more to do.
+bool InputPrefetcher::waitForRoom()
+{
+    pthread_mutex_lock(&lock);
+    catchUp();
+    while(!stop && issued < filesize && issued >= reader_pos + (off_t)(depth * chunk))
+    {
+        pthread_cond_wait(&cond, &lock);
+        catchUp();
+    }
+    bool more = !stop && issued < filesize;
+    pthread_mutex_unlock(&lock);
+    return more;
+}
+
+void InputPrefetcher::loopUring()
+{
+#ifdef HAVE_LIBURING
+    struct io_uring* r = (struct io_uring*)ring;
+
+    std::vector<void*> bufs(depth);
+    std::vector<int> freeslots;
+    for(int i = 0; i < depth; ++i)
+    {
+        bufs[i] = malloc(chunk);
+        if(!bufs[i])
+        {
+            fprintf(stderr, "Malloc failure allocating read-ahead buffers\n");
+            exit(1);
+        }
+        freeslots.push_back(i);
+    }
+
+    int inflight = 0;
+    for(;;)
+    {
+        pthread_mutex_lock(&lock);
+        bool stopping = stop;
+        catchUp();
+        off_t limit = reader_pos + (off_t)(depth * chunk);
+        pthread_mutex_unlock(&lock);
+        if(stopping)
+        {
+            break;
+        }
+
+        while(inflight < depth && issued < filesize && issued < limit)
+        {
+            struct io_uring_sqe* sqe = io_uring_get_sqe(r);
+            if(!sqe)
+            {
+                break;
+            }
+            int slot = freeslots.back();
+            freeslots.pop_back();
+            size_t len = (size_t)(filesize - issued) < chunk ? (size_t)(filesize - issued) : chunk;
+            io_uring_prep_read(sqe, fd, bufs[slot], len, issued);
+            io_uring_sqe_set_data(sqe, (void*)(intptr_t)slot);
+            issued += len;
+            ++inflight;
+        }
+        io_uring_submit(r);
+
+        if(inflight > 0)
+        {
+            // The data itself is discarded: completing the read is what fills the page cache.
+            struct io_uring_cqe* cqe;
+            if(io_uring_wait_cqe(r, &cqe) == 0)
+            {
+                freeslots.push_back((int)(intptr_t)io_uring_cqe_get_data(cqe));
+                io_uring_cqe_seen(r, cqe);
+                --inflight;
+            }
+        }
+        else if(!waitForRoom())
+        {
+            break;
+        }
+    }
+
+    while(inflight > 0)
+    {
+        struct io_uring_cqe* cqe;
+        if(io_uring_wait_cqe(r, &cqe) != 0)
+        {
+            break;
+        }
+        io_uring_cqe_seen(r, cqe);
+        --inflight;
+    }
+    for(int i = 0; i < depth; ++i)
+    {
+        free(bufs[i]);
+    }
+#endif
+}
+
+void InputPrefetcher::loopFadvise()
+{
+    void* buf = malloc(chunk);
+    if(!buf)
+    {
+        fprintf(stderr, "Malloc failure allocating read-ahead buffer\n");
+        exit(1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while(waitForRoom())
+    {
+        size_t len = (size_t)(filesize - issued) < chunk ? (size_t)(filesize - issued) : chunk;
+        // Ask for the whole window ahead, then read this chunk ourselves: that fills the
+        // cache even on filesystems that ignore the advice.
+        posix_fadvise(fd, issued, depth * chunk, POSIX_FADV_WILLNEED);
+        size_t done = 0;
+        while(done < len)
+        {
+            ssize_t n = pread(fd, buf, len - done, issued + done);
+            if(n <= 0)
+            {
+                break;
+            }
+            done += n;
+        }
+        issued += len;
+    }
+    free(buf);
+}
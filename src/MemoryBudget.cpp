@@ -0,0 +1,113 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MemoryBudget.h"
+
+#include <stdio.h>
+
+static const char* componentNames[MemoryBudget::n_components] =
+{
+    "qname groups",
+    "single-input queues",
+    "merged headers",
+    "read-ahead buffers",
+    "input buffers",
+    "output buffers"
+};
+
+uint64_t MemoryBudget::limit = 0;
+uint64_t MemoryBudget::total = 0;
+uint64_t MemoryBudget::totalPeak = 0;
+uint64_t MemoryBudget::used[n_components];
+uint64_t MemoryBudget::peak[n_components];
+uint64_t MemoryBudget::refused[n_components];
+
+// 0 means no limit: everything is still counted, so the peaks can be reported.
+void MemoryBudget::setLimit(uint64_t _limit)
+{
+    limit = _limit;
+}
+
+uint64_t MemoryBudget::getLimit()
+{
+    return limit;
+}
+
+uint64_t MemoryBudget::getPeak(component c)
+{
+    return peak[c];
+}
+
+void MemoryBudget::notePeak(uint64_t* p, uint64_t now)
+{
+    uint64_t old = *p;
+    while(now > old)
+    {
+        uint64_t seen = __sync_val_compare_and_swap(p, old, now);
+        if(seen == old)
+        {
+            break;
+        }
+        old = seen;
+    }
+}
+
+// Reserve bytes for c only if that keeps the total within the limit. Callers that get
+// false are expected to make do without: spill, shrink or wait.
+bool MemoryBudget::tryReserve(component c, uint64_t bytes)
+{
+    uint64_t now = __sync_add_and_fetch(&total, bytes);
+    if(limit && now > limit)
+    {
+        __sync_sub_and_fetch(&total, bytes);
+        __sync_add_and_fetch(&refused[c], 1);
+        return false;
+    }
+    notePeak(&totalPeak, now);
+    notePeak(&peak[c], __sync_add_and_fetch(&used[c], bytes));
+    return true;
+}
+
+// For memory that can't be done without; may take the total over the limit.
+void MemoryBudget::reserve(component c, uint64_t bytes)
+{
+    notePeak(&totalPeak, __sync_add_and_fetch(&total, bytes));
+    notePeak(&peak[c], __sync_add_and_fetch(&used[c], bytes));
+}
+
+void MemoryBudget::release(component c, uint64_t bytes)
+{
+    __sync_sub_and_fetch(&used[c], bytes);
+    __sync_sub_and_fetch(&total, bytes);
+}
+
+void MemoryBudget::report()
+{
+    fprintf(stderr, "Memory budget %.1f MB, peak use %.1f MB:\n", limit / 1048576.0, totalPeak / 1048576.0);
+    for(int c = 0; c < n_components; ++c)
+    {
+        fprintf(stderr, "  %-20s %10.1f MB", componentNames[c], peak[c] / 1048576.0);
+        if(refused[c])
+        {
+            fprintf(stderr, "  (%lu requests refused)", (unsigned long)refused[c]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
@@ -0,0 +1,204 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MergedReader.h"
+
+#include <algorithm>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MemoryBudget.h"
+#include "util.h"
+
+MergedReader::MergedReader(const std::vector<std::string>& fnames, htsThreadPool* pool, RefCache* ref, bool _mixed_ordering) :
+    filenames(fnames), header(NULL), mixed_ordering(_mixed_ordering), headerBytes(0)
+{
+    for(size_t i = 0; i != filenames.size(); ++i)
+    {
+        bam_hdr_t* h;
+        htsFile* hf = RefCache::openInput(filenames[i].c_str(), pool, ref, &h);
+        files.push_back(hf);
+        headers.push_back(h);
+    }
+    mergeHeaders();
+    for(size_t i = 0; i != files.size(); ++i)
+    {
+        // Each lane parses with its own header; mergeHeaders has checked their targets agree.
+        lanes.push_back(new SamReader(files[i], headers[i], filenames[i].c_str(), mixed_ordering, pool));
+        if(!lanes[i]->is_eof())
+        {
+            heap.push_back(i);
+        }
+    }
+    LaneAfter after = { this };
+    std::make_heap(heap.begin(), heap.end(), after);
+}
+
+MergedReader::~MergedReader()
+{
+    for(size_t i = 0; i != lanes.size(); ++i)
+    {
+        delete lanes[i];
+        hts_close(files[i]);
+        bam_hdr_destroy(headers[i]);
+    }
+    for(size_t i = 0; i != prefetchers.size(); ++i)
+    {
+        delete prefetchers[i];
+    }
+    MemoryBudget::release(MemoryBudget::component_headers, headerBytes);
+    bam_hdr_destroy(header);
+}
+
+bool MergedReader::LaneAfter::operator()(int a, int b) const
+{
+    int cmp = qname_cmp(bam_get_qname(owner->lanes[a]->getRec()), bam_get_qname(owner->lanes[b]->getRec()), owner->mixed_ordering);
+    return cmp > 0 || (cmp == 0 && a > b);
+}
+
+// Records from every lane refer to reference sequences by index, so the lanes must list
+// the same ones in the same order. Read groups differ from lane to lane: the merged
+// header is the first lane's, with any @RG lines whose IDs it lacks added to its text.
+void MergedReader::mergeHeaders()
+{
+    const bam_hdr_t* first = headers[0];
+    std::string text(first->text, first->l_text);
+    std::set<std::string> rgIds;
+    for(size_t lane = 0; lane != headers.size(); ++lane)
+    {
+        const bam_hdr_t* h = headers[lane];
+        bool sameTargets = h->n_targets == first->n_targets;
+        for(int32_t i = 0; sameTargets && i < h->n_targets; ++i)
+        {
+            sameTargets = h->target_len[i] == first->target_len[i] && strcmp(h->target_name[i], first->target_name[i]) == 0;
+        }
+        if(!sameTargets)
+        {
+            fprintf(stderr, "%s and %s weren't aligned against the same reference sequences, so they can't be merged\n", filenames[0].c_str(), filenames[lane].c_str());
+            exit(1);
+        }
+
+        const char* p = h->text;
+        const char* end = h->text + h->l_text;
+        while(p < end)
+        {
+            const char* nl = (const char*)memchr(p, '\n', end - p);
+            if(!nl)
+            {
+                nl = end;
+            }
+            if(end - p > 4 && strncmp(p, "@RG\t", 4) == 0)
+            {
+                const char* id = strstr(p, "\tID:");
+                if(id && id < nl)
+                {
+                    id += 4;
+                    std::string rgId(id, strcspn(id, "\t\n"));
+                    if(rgIds.insert(rgId).second && lane != 0)
+                    {
+                        if(!text.empty() && text[text.size() - 1] != '\n')
+                        {
+                            text += '\n';
+                        }
+                        text.append(p, nl - p);
+                        text += '\n';
+                    }
+                }
+            }
+            p = nl + 1;
+        }
+    }
+    // The targets come from the first lane's binary list, which the records' tids index
+    // whatever the text says; only the text takes the extra read groups.
+    header = bam_hdr_dup(first);
+    char* newtext = (char*)malloc(text.size() + 1);
+    if(!header || !newtext)
+    {
+        fprintf(stderr, "Failed to build a merged header for %s and the other files given with it\n", filenames[0].c_str());
+        exit(1);
+    }
+    memcpy(newtext, text.c_str(), text.size() + 1);
+    free(header->text);
+    header->text = newtext;
+    header->l_text = text.size();
+    headerBytes = header_bytes(header);
+    MemoryBudget::reserve(MemoryBudget::component_headers, headerBytes);
+}
+
+// The combined header, with every lane's read groups. It lives as long as this reader.
+bam_hdr_t* MergedReader::getHeader()
+{
+    return header;
+}
+
+bool MergedReader::is_eof() const
+{
+    return heap.empty();
+}
+
+void MergedReader::next()
+{
+    if(heap.empty())
+    {
+        return;
+    }
+    LaneAfter after = { this };
+    std::pop_heap(heap.begin(), heap.end(), after);
+    SamReader* lane = lanes[heap.back()];
+    lane->next();
+    if(lane->is_eof())
+    {
+        heap.pop_back();
+    }
+    else
+    {
+        std::push_heap(heap.begin(), heap.end(), after);
+    }
+}
+
+bam1_t* MergedReader::getRec()
+{
+    return lanes[heap.front()]->getRec();
+}
+
+void MergedReader::load()
+{
+    lanes[heap.front()]->load();
+}
+
+void MergedReader::setRequiredFields(int fields)
+{
+    for(size_t i = 0; i != lanes.size(); ++i)
+    {
+        lanes[i]->setRequiredFields(fields);
+    }
+}
+
+void MergedReader::setPrefetch(int depth, size_t chunk)
+{
+    for(size_t i = 0; i != lanes.size(); ++i)
+    {
+        prefetchers.push_back(new InputPrefetcher(filenames[i].c_str(), depth, chunk));
+        lanes[i]->setPrefetcher(prefetchers[i]);
+        fprintf(stderr, "Read-ahead: %d x %llu bytes for %s (%s)\n", depth, (unsigned long long)chunk, filenames[i].c_str(), prefetchers[i]->backendName());
+    }
+}
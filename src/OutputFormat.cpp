@@ -0,0 +1,190 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "OutputFormat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+OutputFormat::OutputFormat() : format("bam"), modeString("wb1"), level(-1), blockSize(0), seqsPerSlice(0), slim(false), stats(false)
+{
+    //ctor
+}
+
+OutputFormat::~OutputFormat()
+{
+    //dtor
+}
+
+// False if spec doesn't parse, in which case this is left unchanged.
+bool OutputFormat::parse(const std::string& spec)
+{
+    OutputFormat parsed;
+    size_t comma = spec.find(',');
+    parsed.format = spec.substr(0, comma);
+    if(parsed.format != "bam" && parsed.format != "cram" && parsed.format != "sam")
+    {
+        return false;
+    }
+    while(comma != std::string::npos)
+    {
+        size_t next = spec.find(',', comma + 1);
+        std::string opt = spec.substr(comma + 1, next == std::string::npos ? std::string::npos : next - comma - 1);
+        comma = next;
+        if(opt == "slim")
+        {
+            parsed.slim = true;
+            continue;
+        }
+        if(opt == "stats")
+        {
+            parsed.stats = true;
+            continue;
+        }
+        size_t eq = opt.find('=');
+        if(eq == std::string::npos)
+        {
+            return false;
+        }
+        std::string key = opt.substr(0, eq);
+        std::string value = opt.substr(eq + 1);
+        char* end;
+        if(key == "level")
+        {
+            parsed.level = strtol(value.c_str(), &end, 10);
+            if(value.empty() || *end || parsed.level < 0 || parsed.level > 9 || parsed.format == "sam")
+            {
+                return false;
+            }
+        }
+        else if(key == "block_size")
+        {
+            parsed.blockSize = parse_size(value.c_str());
+            if(!parsed.blockSize || parsed.blockSize > (1 << 30))
+            {
+                return false;
+            }
+        }
+        else if(key == "seqs_per_slice")
+        {
+            parsed.seqsPerSlice = strtol(value.c_str(), &end, 10);
+            if(value.empty() || *end || parsed.seqsPerSlice <= 0 || parsed.format != "cram")
+            {
+                return false;
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    if(parsed.format == "bam")
+    {
+        parsed.modeString = "wb";
+        parsed.modeString += (char)('0' + (parsed.level < 0 ? 1 : parsed.level));
+    }
+    else if(parsed.format == "cram")
+    {
+        parsed.modeString = "wc";
+        if(parsed.level >= 0)
+        {
+            parsed.modeString += (char)('0' + parsed.level);
+        }
+    }
+    else
+    {
+        parsed.modeString = "w";
+    }
+    *this = parsed;
+    return true;
+}
+
+const char* OutputFormat::mode() const
+{
+    return modeString.c_str();
+}
+
+bool OutputFormat::isCram() const
+{
+    return format == "cram";
+}
+
+bool OutputFormat::isSlim() const
+{
+    return slim;
+}
+
+bool OutputFormat::isStats() const
+{
+    return stats;
+}
+
+void OutputFormat::setStats(bool _stats)
+{
+    stats = _stats;
+}
+
+// Options htslib only takes once the file is open.
+void OutputFormat::apply(htsFile* hf) const
+{
+    if(blockSize && hts_set_opt(hf, HTS_OPT_BLOCK_SIZE, (int)blockSize) != 0)
+    {
+        fprintf(stderr, "Failed to set the block size of %s\n", hf->fn);
+        exit(1);
+    }
+    if(seqsPerSlice && hts_set_opt(hf, CRAM_OPT_SEQS_PER_SLICE, seqsPerSlice) != 0)
+    {
+        fprintf(stderr, "Failed to set the slice size of %s\n", hf->fn);
+        exit(1);
+    }
+}
+
+std::string OutputFormat::describe() const
+{
+    char buf[128];
+    std::string ret = format;
+    if(level >= 0 || format == "bam")
+    {
+        snprintf(buf, sizeof(buf), ",level=%d", level < 0 ? 1 : level);
+        ret += buf;
+    }
+    if(blockSize)
+    {
+        snprintf(buf, sizeof(buf), ",block_size=%llu", (unsigned long long)blockSize);
+        ret += buf;
+    }
+    if(seqsPerSlice)
+    {
+        snprintf(buf, sizeof(buf), ",seqs_per_slice=%d", seqsPerSlice);
+        ret += buf;
+    }
+    if(slim)
+    {
+        ret += ",slim";
+    }
+    if(stats)
+    {
+        ret += ",stats";
+    }
+    return ret;
+}
@@ -0,0 +1,259 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "OutputStats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "util.h"
+
+// Checksums multiply per-record CRCs modulo this prime, so record order doesn't matter.
+static const uint64_t checksumModulus = 0x7fffffff;
+
+// The aux tags samtools checksum covers by default.
+static const char* const auxTags[] = {"BC", "FI", "QT", "RT", "TC"};
+
+const char* const OutputStats::counterNames[OutputStats::n_counters] =
+{
+    "total",
+    "primary",
+    "secondary",
+    "supplementary",
+    "duplicates",
+    "primary_duplicates",
+    "mapped",
+    "primary_mapped",
+    "paired_in_sequencing",
+    "read1",
+    "read2",
+    "properly_paired",
+    "with_itself_and_mate_mapped",
+    "singletons",
+    "with_mate_mapped_to_a_different_chr",
+    "with_mate_mapped_to_a_different_chr_mapq5"
+};
+
+OutputStats::OutputStats() : unplaced(0), checksummed(0), flagProduct(1), nameProduct(1), seqProduct(1), qualProduct(1), auxProduct(1), recordProduct(1)
+{
+    //ctor
+    for(int i = 0; i < n_counters; ++i)
+    {
+        counts[0][i] = counts[1][i] = 0;
+    }
+}
+
+OutputStats::~OutputStats()
+{
+    //dtor
+}
+
+uint64_t OutputStats::combine(uint64_t product, uint32_t crc)
+{
+    // Zero would wipe out the product, so it stands in as 1.
+    uint64_t factor = crc % checksumModulus;
+    return factor ? product * factor % checksumModulus : product;
+}
+
+// Count rec as written, with tid and mtid in the output header's numbering.
+void OutputStats::add(const bam1_t* rec, int tid, int mtid)
+{
+    uint16_t flag = rec->core.flag;
+    uint64_t* c = counts[(flag & BAM_FQCFAIL) ? 1 : 0];
+    bool isMapped = !(flag & BAM_FUNMAP);
+    ++c[total];
+    if(flag & BAM_FSECONDARY)
+    {
+        ++c[secondary];
+    }
+    else if(flag & BAM_FSUPPLEMENTARY)
+    {
+        ++c[supplementary];
+    }
+    else
+    {
+        ++c[primary];
+        c[primary_duplicates] += (flag & BAM_FDUP) != 0;
+        c[primary_mapped] += isMapped;
+        if(flag & BAM_FPAIRED)
+        {
+            ++c[paired];
+            c[read1] += (flag & BAM_FREAD1) != 0;
+            c[read2] += (flag & BAM_FREAD2) != 0;
+            if(isMapped)
+            {
+                c[properly_paired] += (flag & BAM_FPROPER_PAIR) != 0;
+                if(flag & BAM_FMUNMAP)
+                {
+                    ++c[singletons];
+                }
+                else
+                {
+                    ++c[both_mapped];
+                    if(tid != mtid)
+                    {
+                        ++c[mate_other_chr];
+                        c[mate_other_chr_mapq5] += rec->core.qual >= 5;
+                    }
+                }
+            }
+        }
+    }
+    c[duplicates] += (flag & BAM_FDUP) != 0;
+    c[mapped] += isMapped;
+
+    // idxstats counts every record by the reference it is placed on.
+    if(tid < 0)
+    {
+        ++unplaced;
+    }
+    else
+    {
+        if((size_t)tid >= mappedOn.size())
+        {
+            mappedOn.resize(tid + 1, 0);
+            unmappedOn.resize(tid + 1, 0);
+        }
+        ++(isMapped ? mappedOn : unmappedOn)[tid];
+    }
+
+    // Checksums follow samtools checksum's defaults: primary records only, each read as
+    // sequenced (reverse-strand sequence and qualities turned back round), its PAIRED,
+    // READ1 and READ2 flags, and the auxTags it has. Each field's CRC32 goes into its
+    // own product, and one CRC32 over all of them into the combined product.
+    if(flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))
+    {
+        return;
+    }
+    ++checksummed;
+    uint16_t flagBits = flag & (BAM_FPAIRED | BAM_FREAD1 | BAM_FREAD2);
+    uint8_t flagBytes[2] = {(uint8_t)(flagBits & 0xff), (uint8_t)(flagBits >> 8)};
+    uint32_t flagCrc = crc32(0L, flagBytes, 2);
+
+    const char* qname = bam_get_qname(rec);
+    uint32_t nameLen = rec->core.l_qname - rec->core.l_extranul - 1;
+    uint32_t nameCrc = crc32(0L, (const Bytef*)qname, nameLen);
+
+    int32_t len = rec->core.l_qseq;
+    seq.resize(len);
+    qual.resize(len);
+    const uint8_t* s = bam_get_seq(rec);
+    const uint8_t* q = bam_get_qual(rec);
+    bool reverse = (flag & BAM_FREVERSE) != 0;
+    static const char complement[] = "=TGKCYSBAWRDMHVN";
+    for(int32_t i = 0; i < len; ++i)
+    {
+        int from = reverse ? len - 1 - i : i;
+        int base = bam_seqi(s, from);
+        seq[i] = reverse ? complement[base] : seq_nt16_str[base];
+        qual[i] = q[from];
+    }
+    uint32_t seqCrc = crc32(0L, (const Bytef*)seq.data(), len);
+    uint32_t qualCrc = crc32(0L, (const Bytef*)qual.data(), len);
+
+    uint32_t recordCrc = crc32(0L, (const Bytef*)qname, nameLen);
+    recordCrc = crc32(recordCrc, flagBytes, 2);
+    recordCrc = crc32(recordCrc, (const Bytef*)seq.data(), len);
+    recordCrc = crc32(recordCrc, (const Bytef*)qual.data(), len);
+
+    // Tags as stored in BAM (tag, type and value), in auxTags order.
+    uint32_t auxCrc = crc32(0L, Z_NULL, 0);
+    const uint8_t* auxEnd = rec->data + rec->l_data;
+    for(size_t i = 0; i < sizeof(auxTags) / sizeof(auxTags[0]); ++i)
+    {
+        const uint8_t* value = bam_aux_get(rec, auxTags[i]);
+        const uint8_t* next = value ? aux_next(value - 2, auxEnd) : NULL;
+        if(next)
+        {
+            auxCrc = crc32(auxCrc, value - 2, next - (value - 2));
+            recordCrc = crc32(recordCrc, value - 2, next - (value - 2));
+        }
+    }
+
+    flagProduct = combine(flagProduct, flagCrc);
+    nameProduct = combine(nameProduct, nameCrc);
+    seqProduct = combine(seqProduct, seqCrc);
+    qualProduct = combine(qualProduct, qualCrc);
+    auxProduct = combine(auxProduct, auxCrc);
+    recordProduct = combine(recordProduct, recordCrc);
+}
+
+static void write_json_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for(; *s; ++s)
+    {
+        if(*s == '"' || *s == '\\')
+        {
+            fputc('\\', f);
+        }
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// Write fname.stats.json.
+void OutputStats::write(const std::string& fname, const bam_hdr_t* header) const
+{
+    std::string jsonName = fname + ".stats.json";
+    FILE* f = fopen(jsonName.c_str(), "w");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", jsonName.c_str());
+        exit(1);
+    }
+    fprintf(f, "{\n  \"file\": ");
+    write_json_string(f, fname.c_str());
+    fprintf(f, ",\n  \"flagstat\": {\n");
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        fprintf(f, "    \"%s\": {", pass ? "qc_failed" : "qc_passed");
+        for(int i = 0; i < n_counters; ++i)
+        {
+            fprintf(f, "%s\n      \"%s\": %llu", i ? "," : "", counterNames[i], (unsigned long long)counts[pass][i]);
+        }
+        fprintf(f, "\n    }%s\n", pass ? "" : ",");
+    }
+    fprintf(f, "  },\n  \"idxstats\": [\n");
+    for(int32_t i = 0; i < header->n_targets; ++i)
+    {
+        bool seen = (size_t)i < mappedOn.size();
+        fprintf(f, "    {\"name\": ");
+        write_json_string(f, header->target_name[i]);
+        fprintf(f, ", \"length\": %llu, \"mapped\": %llu, \"unmapped\": %llu},\n", (unsigned long long)header->target_len[i],
+                (unsigned long long)(seen ? mappedOn[i] : 0), (unsigned long long)(seen ? unmappedOn[i] : 0));
+    }
+    fprintf(f, "    {\"name\": \"*\", \"length\": 0, \"mapped\": 0, \"unmapped\": %llu}\n", (unsigned long long)unplaced);
+    fprintf(f, "  ],\n  \"checksum\": {\n");
+    fprintf(f, "    \"count\": %llu,\n", (unsigned long long)checksummed);
+    fprintf(f, "    \"flag\": \"%08llx\",\n", (unsigned long long)flagProduct);
+    fprintf(f, "    \"seq\": \"%08llx\",\n", (unsigned long long)seqProduct);
+    fprintf(f, "    \"qual\": \"%08llx\",\n", (unsigned long long)qualProduct);
+    fprintf(f, "    \"name\": \"%08llx\",\n", (unsigned long long)nameProduct);
+    fprintf(f, "    \"aux\": \"%08llx\",\n", (unsigned long long)auxProduct);
+    fprintf(f, "    \"combined\": \"%08llx\"\n", (unsigned long long)recordProduct);
+    fprintf(f, "  }\n}\n");
+    if(fclose(f) != 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", jsonName.c_str());
+        exit(1);
+    }
+}
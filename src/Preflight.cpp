@@ -0,0 +1,474 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Preflight.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <htslib/bgzf.h>
+#include <htslib/hts_endian.h>
+#include <htslib/sam.h>
+
+#include "util.h"
+
+// Records are sampled from about this much decompressed data at each of samplesPerFile
+// places in a BAM file.
+static const int samplesPerFile = 16;
+static const size_t sampleBytes = 256 << 10;
+
+Preflight::Preflight(int _nthreads) : nthreads(_nthreads), nextJob(0)
+{
+    //ctor
+    pthread_mutex_init(&lock, NULL);
+}
+
+Preflight::~Preflight()
+{
+    //dtor
+    pthread_mutex_destroy(&lock);
+}
+
+// The value of tag in the @HD line of text, or empty if there isn't one.
+static std::string hd_field(const char* text, const char* tag)
+{
+    if(strncmp(text, "@HD", 3) != 0)
+    {
+        return std::string();
+    }
+    const char* eol = strchr(text, '\n');
+    std::string hd(text, eol ? eol - text : strlen(text));
+    size_t at = hd.find(std::string("\t") + tag + ":");
+    if(at == std::string::npos)
+    {
+        return std::string();
+    }
+    at += 4;
+    return hd.substr(at, hd.find('\t', at) == std::string::npos ? std::string::npos : hd.find('\t', at) - at);
+}
+
+// Reads the header, which tells us the format and declared sort order. Only BAM files
+// that can be reopened (not pipes) are sampled.
+void Preflight::addFile(int input, const char* fname)
+{
+    File f;
+    f.input = input;
+    f.fname = fname;
+    f.sampled = false;
+    struct stat st;
+    if(stat(fname, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        files.push_back(f);
+        return;
+    }
+    htsFile* hf = hts_open(fname, "r");
+    if(!hf)
+    {
+        fprintf(stderr, "Failed to open %s\n", fname);
+        exit(1);
+    }
+    bam_hdr_t* header = sam_hdr_read(hf);
+    if(!header)
+    {
+        fprintf(stderr, "Failed to read the header of %s\n", fname);
+        exit(1);
+    }
+    f.so = hd_field(header->text, "SO");
+    f.ss = hd_field(header->text, "SS");
+    if(f.so == "coordinate")
+    {
+        fprintf(stderr, "Pre-flight: %s is sorted by coordinate (SO:coordinate); sort it by name with samtools sort -n or Picard SortSam first\n", fname);
+        exit(1);
+    }
+    if(hts_get_format(hf)->format == bam && hts_get_bgzfp(hf))
+    {
+        f.sampled = true;
+        for(int i = 0; i < samplesPerFile; ++i)
+        {
+            Sample s;
+            s.coffset = (int64_t)((double)st.st_size * i / samplesPerFile);
+            s.firstBlock = s.lastBlock = -1;
+            s.nrecs = s.nmapped = s.withNM = s.withMD = s.withAS = 0;
+            f.samples.push_back(s);
+        }
+    }
+    bam_hdr_destroy(header);
+    hts_close(hf);
+    files.push_back(f);
+}
+
+void Preflight::run()
+{
+    jobs.clear();
+    for(size_t i = 0; i != files.size(); ++i)
+    {
+        for(size_t j = 0; j != files[i].samples.size(); ++j)
+        {
+            jobs.push_back(std::make_pair(i, j));
+        }
+    }
+    int nworkers = nthreads < (int)jobs.size() ? nthreads : (int)jobs.size();
+    std::vector<pthread_t> threads(nworkers);
+    for(int i = 0; i < nworkers; ++i)
+    {
+        if(pthread_create(&threads[i], NULL, worker, this) != 0)
+        {
+            fprintf(stderr, "Failed to start pre-flight thread\n");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < nworkers; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void* Preflight::worker(void* arg)
+{
+    Preflight* self = (Preflight*)arg;
+    while(true)
+    {
+        pthread_mutex_lock(&self->lock);
+        size_t i = self->nextJob++;
+        pthread_mutex_unlock(&self->lock);
+        if(i >= self->jobs.size())
+        {
+            break;
+        }
+        self->sample(self->files[self->jobs[i].first], self->jobs[i].second);
+    }
+    return NULL;
+}
+
+// Could p be the start of a BAM record, given what follows it? If so, *next is where the
+// following record would start.
+static bool plausible_record(const uint8_t* p, const uint8_t* end, int32_t n_targets, const uint8_t** next)
+{
+    if(end - p < 36)
+    {
+        return false;
+    }
+    int32_t block_len = le_to_i32(p);
+    int32_t tid = le_to_i32(p + 4), pos = le_to_i32(p + 8);
+    uint32_t l_qname = p[12];
+    uint32_t n_cigar = le_to_u16(p + 16);
+    int32_t l_seq = le_to_i32(p + 20);
+    int32_t mtid = le_to_i32(p + 24), mpos = le_to_i32(p + 28);
+    if(block_len < 32 || tid < -1 || tid >= n_targets || mtid < -1 || mtid >= n_targets || pos < -1 || mpos < -1 || l_qname < 2 || l_seq < 0)
+    {
+        return false;
+    }
+    if(32 + l_qname + 4 * (int64_t)n_cigar + (l_seq + 1) / 2 + (int64_t)l_seq > block_len || end - p < 36 + l_qname)
+    {
+        return false;
+    }
+    const uint8_t* qname = p + 36;
+    for(uint32_t i = 0; i + 1 < l_qname; ++i)
+    {
+        // SAM's QNAME alphabet: printable, no spaces, no '@'.
+        if(qname[i] < '!' || qname[i] > '~' || qname[i] == '@')
+        {
+            return false;
+        }
+    }
+    if(qname[l_qname - 1] != '\0')
+    {
+        return false;
+    }
+    *next = p + 4 + block_len;
+    return true;
+}
+
+// Decode records from about sampleBytes of f's sample j, starting at the first BGZF block
+// at or after its coffset and stopping before any block at or after the next sample's,
+// so that in a small file samples neither overlap nor repeat a block. Blocks don't start
+// at record boundaries, so the first record is found by looking for a run of plausible
+// records, as BAM splitting tools do.
+void Preflight::sample(File& f, size_t j)
+{
+    Sample& s = f.samples[j];
+    int64_t limit = j + 1 < f.samples.size() ? f.samples[j + 1].coffset : INT64_MAX;
+    htsFile* hf = hts_open(f.fname.c_str(), "r");
+    bam_hdr_t* header = hf ? sam_hdr_read(hf) : NULL;
+    if(!header)
+    {
+        fprintf(stderr, "Failed to read the header of %s\n", f.fname.c_str());
+        exit(1);
+    }
+    BGZF* bgzf = hts_get_bgzfp(hf);
+    bool resync = s.coffset != 0;
+    if(resync)
+    {
+        // Find the next BGZF block header: gzip magic with the BC extra field.
+        int fd = open(f.fname.c_str(), O_RDONLY);
+        uint8_t buf[1 << 16];
+        ssize_t got = fd < 0 ? -1 : pread(fd, buf, sizeof(buf), s.coffset);
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        int64_t block = -1;
+        for(ssize_t i = 0; i + 18 <= got && block < 0; ++i)
+        {
+            if(buf[i] == 0x1f && buf[i + 1] == 0x8b && buf[i + 2] == 8 && buf[i + 3] == 4 &&
+               le_to_u16(buf + i + 10) == 6 && buf[i + 12] == 'B' && buf[i + 13] == 'C' && le_to_u16(buf + i + 14) == 2)
+            {
+                block = s.coffset + i;
+            }
+        }
+        if(block < 0 || bgzf_seek(bgzf, block << 16, SEEK_SET) < 0)
+        {
+            bam_hdr_destroy(header);
+            hts_close(hf);
+            return;
+        }
+    }
+    // A block at a time, so as to know where each came from.
+    std::vector<uint8_t> data(sampleBytes);
+    size_t got = 0;
+    while(got < sampleBytes)
+    {
+        if(bgzf->block_offset >= bgzf->block_length && (bgzf_read_block(bgzf) != 0 || bgzf->block_length == 0))
+        {
+            break;
+        }
+        if(bgzf->block_address >= limit)
+        {
+            break;
+        }
+        if(s.firstBlock < 0)
+        {
+            s.firstBlock = bgzf->block_address;
+        }
+        s.lastBlock = bgzf->block_address;
+        size_t want = std::min((size_t)(bgzf->block_length - bgzf->block_offset), sampleBytes - got);
+        ssize_t n = bgzf_read(bgzf, &data[got], want);
+        if(n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+    const uint8_t* p = &data[0];
+    const uint8_t* end = p + got;
+    if(resync)
+    {
+        for(; p < end; ++p)
+        {
+            const uint8_t* q = p;
+            int chained = 0;
+            while(chained < 4 && q < end && plausible_record(q, end, header->n_targets, &q))
+            {
+                ++chained;
+            }
+            if(chained == 4 || (chained > 0 && q >= end))
+            {
+                break;
+            }
+        }
+    }
+
+    std::string prev;
+    const uint8_t* next;
+    while(plausible_record(p, end, header->n_targets, &next) && next <= end)
+    {
+        std::string qname((const char*)p + 36);
+        if(!prev.empty())
+        {
+            if(s.badMixed.empty() && qname_cmp(prev.c_str(), qname.c_str(), true) > 0)
+            {
+                s.badMixed = prev + " came before " + qname;
+            }
+            if(s.badLexical.empty() && qname_cmp(prev.c_str(), qname.c_str(), false) > 0)
+            {
+                s.badLexical = prev + " came before " + qname;
+            }
+        }
+        else
+        {
+            s.first = qname;
+        }
+        prev = qname;
+        ++s.nrecs;
+        if(!(le_to_u16(p + 18) & BAM_FUNMAP))
+        {
+            ++s.nmapped;
+            uint32_t n_cigar = le_to_u16(p + 16);
+            int32_t l_seq = le_to_i32(p + 20);
+            const uint8_t* aux = p + 36 + p[12] + 4 * n_cigar + (l_seq + 1) / 2 + l_seq;
+            bool nm = false, md = false, as = false;
+            for(const uint8_t* a = aux; a && next - a >= 3; a = aux_next(a, next))
+            {
+                nm = nm || (a[0] == 'N' && a[1] == 'M');
+                md = md || (a[0] == 'M' && a[1] == 'D');
+                as = as || (a[0] == 'A' && a[1] == 'S');
+            }
+            s.withNM += nm;
+            s.withMD += md;
+            s.withAS += as;
+        }
+        p = next;
+    }
+    s.last = prev;
+    bam_hdr_destroy(header);
+    hts_close(hf);
+}
+
+// Are f's samples, and the boundaries between them, in the given order? If not, why says
+// where they aren't.
+bool Preflight::fileFits(const File& f, bool mixed, std::string& why) const
+{
+    const Sample* prev = NULL;
+    for(size_t i = 0; i != f.samples.size(); ++i)
+    {
+        const Sample& s = f.samples[i];
+        if(!s.nrecs)
+        {
+            continue;
+        }
+        const std::string& bad = mixed ? s.badMixed : s.badLexical;
+        if(!bad.empty())
+        {
+            why = bad;
+            return false;
+        }
+        // Only samples from successive stretches of the file say anything about the
+        // order between them.
+        if(prev && prev->lastBlock < s.firstBlock && qname_cmp(prev->last.c_str(), s.first.c_str(), mixed) > 0)
+        {
+            why = prev->last + " came before " + s.first;
+            return false;
+        }
+        prev = &s;
+    }
+    return true;
+}
+
+// The ordering to join with: the one given if the samples agree with it, otherwise the
+// only one every sampled input fits, falling back on the headers' SS sub-sort and then
+// on the default. Exits with a diagnosis if the inputs fit neither.
+bool Preflight::chooseOrdering(bool given, bool mixed_ordering)
+{
+    bool allMixed = true, allLexical = true;
+    std::string mixedFile, mixedWhy, lexicalFile, lexicalWhy;
+    std::string ssHint;
+    for(size_t i = 0; i != files.size(); ++i)
+    {
+        const File& f = files[i];
+        if(f.ss == "queryname:natural" || f.ss == "queryname:lexicographical")
+        {
+            ssHint = f.ss;
+        }
+        if(!f.sampled)
+        {
+            continue;
+        }
+        std::string mWhy, lWhy;
+        bool m = fileFits(f, true, mWhy);
+        bool l = fileFits(f, false, lWhy);
+        if(!m && !l)
+        {
+            fprintf(stderr, "Pre-flight: %s isn't sorted by name%s: %s (samtools -n order) and %s (Picard / htsjdk order)\n",
+                    f.fname.c_str(), f.so.empty() ? "" : (" (header says SO:" + f.so + ")").c_str(), mWhy.c_str(), lWhy.c_str());
+            fprintf(stderr, "Sort it with samtools sort -n (then use -n) or Picard SortSam SORT_ORDER=queryname (then use -N)\n");
+            exit(1);
+        }
+        if(!m && allMixed)
+        {
+            mixedFile = f.fname;
+            mixedWhy = mWhy;
+        }
+        if(!l && allLexical)
+        {
+            lexicalFile = f.fname;
+            lexicalWhy = lWhy;
+        }
+        allMixed = allMixed && m;
+        allLexical = allLexical && l;
+    }
+    if(!allMixed && !allLexical)
+    {
+        fprintf(stderr, "Pre-flight: the inputs are sorted differently: %s is in Picard / htsjdk order (%s) but %s is in samtools -n order (%s); re-sort one to match the other\n",
+                mixedFile.c_str(), mixedWhy.c_str(), lexicalFile.c_str(), lexicalWhy.c_str());
+        exit(1);
+    }
+    if(given)
+    {
+        if(mixed_ordering && !allMixed)
+        {
+            fprintf(stderr, "Pre-flight: -n expects samtools -n order, but in %s %s; that is Picard / htsjdk order, so use -N\n", mixedFile.c_str(), mixedWhy.c_str());
+            exit(1);
+        }
+        if(!mixed_ordering && !allLexical)
+        {
+            fprintf(stderr, "Pre-flight: -N expects Picard / htsjdk order, but in %s %s; that is samtools -n order, so use -n\n", lexicalFile.c_str(), lexicalWhy.c_str());
+            exit(1);
+        }
+        return mixed_ordering;
+    }
+    bool choice = mixed_ordering;
+    if(allMixed != allLexical)
+    {
+        choice = allMixed;
+    }
+    else if(!ssHint.empty())
+    {
+        choice = ssHint == "queryname:natural";
+    }
+    fprintf(stderr, "Pre-flight: using %s\n", choice ? "samtools -n order (-n)" : "Picard / htsjdk order (-N)");
+    return choice;
+}
+
+// Fail now, rather than hours in, if -s as will meet records without AS; warn if
+// matching bases will have to be counted without NM or MD.
+void Preflight::checkTags(int input, bool needAS, bool needMatches)
+{
+    for(size_t i = 0; i != files.size(); ++i)
+    {
+        const File& f = files[i];
+        uint64_t mapped = 0, nm = 0, md = 0, as = 0;
+        for(size_t j = 0; j != f.samples.size(); ++j)
+        {
+            mapped += f.samples[j].nmapped;
+            nm += f.samples[j].withNM;
+            md += f.samples[j].withMD;
+            as += f.samples[j].withAS;
+        }
+        if(f.input != input || !mapped)
+        {
+            continue;
+        }
+        if(needAS && as < mapped)
+        {
+            fprintf(stderr, "Pre-flight: -s as needs an AS tag on every mapped record, but only %llu of %llu sampled from %s have one\n",
+                    (unsigned long long)as, (unsigned long long)mapped, f.fname.c_str());
+            exit(1);
+        }
+        if(needMatches && !nm && !md)
+        {
+            fprintf(stderr, "Warning: none of the %llu mapped records sampled from %s have NM or MD tags; give --ref%d to count mismatches against the reference\n",
+                    (unsigned long long)mapped, f.fname.c_str(), input);
+        }
+    }
+}
@@ -0,0 +1,288 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// At most this many stage instances go into the trace; beyond that they are only counted.
+static const uint64_t maxTraceEvents = 4000000;
+
+static const char* stageNames[Profiler::n_stages] =
+{
+    "read input 1",
+    "read input 2",
+    "collect group",
+    "score",
+    "annotate",
+    "write"
+};
+
+struct TraceEvent
+{
+    int stage;
+    uint64_t startNs;
+    uint64_t durNs;
+};
+
+struct Profiler::ThreadState
+{
+    int tid;
+    int fds[n_counters];
+    bool counting;
+    uint64_t ns[n_stages];
+    uint64_t calls[n_stages];
+    uint64_t counts[n_stages][n_counters];
+    std::vector<TraceEvent> events;
+};
+
+bool Profiler::enabled = false;
+std::string Profiler::traceFile;
+
+static __thread Profiler::ThreadState* threadState = 0;
+static std::vector<Profiler::ThreadState*> threadStates;
+static pthread_mutex_t threadStatesLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t epochNs;
+static uint64_t nTraceEvents = 0;
+static uint64_t nDroppedEvents = 0;
+static bool warnedNoCounters = false;
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void Profiler::start(const char* _traceFile)
+{
+    traceFile = _traceFile;
+    epochNs = nowNs();
+    enabled = true;
+}
+
+// Counters follow the calling thread only, so every thread opens its own group on first use.
+Profiler::ThreadState* Profiler::newThreadState()
+{
+    static const uint64_t configs[n_counters] =
+    {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    ThreadState* ts = new ThreadState;
+    memset(ts->ns, 0, sizeof(ts->ns));
+    memset(ts->calls, 0, sizeof(ts->calls));
+    memset(ts->counts, 0, sizeof(ts->counts));
+    ts->counting = true;
+    for(int i = 0; i < n_counters; ++i)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        ts->fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : ts->fds[0], 0);
+        if(ts->fds[i] < 0)
+        {
+            ts->counting = false;
+            for(int j = 0; j < i; ++j)
+            {
+                close(ts->fds[j]);
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&threadStatesLock);
+    if(!ts->counting && !warnedNoCounters)
+    {
+        fprintf(stderr, "Warning: hardware counters are unavailable (see /proc/sys/kernel/perf_event_paranoid); profiling times only\n");
+        warnedNoCounters = true;
+    }
+    ts->tid = threadStates.size();
+    threadStates.push_back(ts);
+    pthread_mutex_unlock(&threadStatesLock);
+    return ts;
+}
+
+void Profiler::readCounters(ThreadState* ts, uint64_t* out)
+{
+    if(!ts->counting)
+    {
+        return;
+    }
+    uint64_t buf[1 + n_counters];
+    if(read(ts->fds[0], buf, sizeof(buf)) != (ssize_t)sizeof(buf))
+    {
+        memset(out, 0, n_counters * sizeof(uint64_t));
+        return;
+    }
+    memcpy(out, buf + 1, n_counters * sizeof(uint64_t));
+}
+
+Profiler::ThreadState* Profiler::begin(uint64_t& startNs, uint64_t* startCounters)
+{
+    if(!threadState)
+    {
+        threadState = newThreadState();
+    }
+    readCounters(threadState, startCounters);
+    startNs = nowNs();
+    return threadState;
+}
+
+void Profiler::end(ThreadState* ts, stage s, uint64_t startNs, const uint64_t* startCounters)
+{
+    uint64_t endNs = nowNs();
+    uint64_t endCounters[n_counters];
+    readCounters(ts, endCounters);
+
+    ts->ns[s] += endNs - startNs;
+    ++ts->calls[s];
+    if(ts->counting)
+    {
+        for(int i = 0; i < n_counters; ++i)
+        {
+            ts->counts[s][i] += endCounters[i] - startCounters[i];
+        }
+    }
+
+    if(__sync_fetch_and_add(&nTraceEvents, 1) < maxTraceEvents)
+    {
+        TraceEvent ev = { s, startNs - epochNs, endNs - startNs };
+        ts->events.push_back(ev);
+    }
+    else
+    {
+        __sync_fetch_and_add(&nDroppedEvents, 1);
+    }
+}
+
+// Print the summary, write the trace and stop profiling. Call once the other threads are done.
+void Profiler::finish()
+{
+    if(!enabled)
+    {
+        return;
+    }
+    enabled = false;
+
+    uint64_t ns[n_stages], calls[n_stages], counts[n_stages][n_counters];
+    memset(ns, 0, sizeof(ns));
+    memset(calls, 0, sizeof(calls));
+    memset(counts, 0, sizeof(counts));
+    bool counting = !threadStates.empty();
+    for(size_t t = 0; t < threadStates.size(); ++t)
+    {
+        ThreadState* ts = threadStates[t];
+        counting = counting && ts->counting;
+        for(int s = 0; s < n_stages; ++s)
+        {
+            ns[s] += ts->ns[s];
+            calls[s] += ts->calls[s];
+            for(int i = 0; i < n_counters; ++i)
+            {
+                counts[s][i] += ts->counts[s][i];
+            }
+        }
+    }
+
+    // Stages nest (reads happen while collecting a group, for example), so times are inclusive.
+    fprintf(stderr, "Profile (%lu threads; inclusive times):\n", (unsigned long)threadStates.size());
+    fprintf(stderr, "%-14s %12s %12s %10s", "stage", "calls", "total ms", "ns/call");
+    if(counting)
+    {
+        fprintf(stderr, " %15s %15s %6s %12s %12s", "cycles", "instructions", "IPC", "LLC misses", "br misses");
+    }
+    fprintf(stderr, "\n");
+    for(int s = 0; s < n_stages; ++s)
+    {
+        if(!calls[s])
+        {
+            continue;
+        }
+        fprintf(stderr, "%-14s %12llu %12.1f %10.0f", stageNames[s], (unsigned long long)calls[s], ns[s] / 1e6, (double)ns[s] / calls[s]);
+        if(counting)
+        {
+            fprintf(stderr, " %15llu %15llu %6.2f %12llu %12llu", (unsigned long long)counts[s][counter_cycles], (unsigned long long)counts[s][counter_instructions],
+                    counts[s][counter_cycles] ? (double)counts[s][counter_instructions] / counts[s][counter_cycles] : 0.0,
+                    (unsigned long long)counts[s][counter_llc_misses], (unsigned long long)counts[s][counter_branch_misses]);
+        }
+        fprintf(stderr, "\n");
+    }
+    if(nDroppedEvents)
+    {
+        fprintf(stderr, "The trace holds the first %llu stage instances; %llu more were only counted\n", (unsigned long long)maxTraceEvents, (unsigned long long)nDroppedEvents);
+    }
+
+    FILE* f = fopen(traceFile.c_str(), "w");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open profile trace %s\n", traceFile.c_str());
+        exit(1);
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for(size_t t = 0; t < threadStates.size(); ++t)
+    {
+        ThreadState* ts = threadStates[t];
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", first ? "" : ",\n", ts->tid, ts->tid);
+        first = false;
+        for(std::vector<TraceEvent>::const_iterator it = ts->events.begin(), itend = ts->events.end(); it != itend; ++it)
+        {
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"bamcmp\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    stageNames[it->stage], ts->tid, it->startNs / 1e3, it->durNs / 1e3);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if(fclose(f) != 0)
+    {
+        fprintf(stderr, "Failed to write profile trace %s\n", traceFile.c_str());
+        exit(1);
+    }
+    fprintf(stderr, "Wrote profile trace to %s (open in chrome://tracing or ui.perfetto.dev)\n", traceFile.c_str());
+
+    for(size_t t = 0; t < threadStates.size(); ++t)
+    {
+        if(threadStates[t]->counting)
+        {
+            for(int i = 0; i < n_counters; ++i)
+            {
+                close(threadStates[t]->fds[i]);
+            }
+        }
+        delete threadStates[t];
+    }
+    threadStates.clear();
+}
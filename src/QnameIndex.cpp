@@ -0,0 +1,223 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "QnameIndex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <htslib/sam.h>
+
+#include "SamReader.h"
+#include "util.h"
+
+QnameIndex::QnameIndex(bool _mixed_ordering) : mixed_ordering(_mixed_ordering), cursor(0)
+{
+    //ctor
+}
+
+QnameIndex::~QnameIndex()
+{
+    //dtor
+}
+
+static int64_t file_size(const char* fname)
+{
+    struct stat st;
+    return stat(fname, &st) == 0 ? (int64_t)st.st_size : -1;
+}
+
+// Write fname.qni, sampling the position of every'th record, and of each record
+// thereafter until the qname changes, so that every entry starts a qname group.
+void QnameIndex::build(const char* fname, bool mixed_ordering, uint64_t every, htsThreadPool* pool)
+{
+    htsFile* hf = hts_begin_or_die(fname, "r", NULL, pool, NULL);
+    bam_hdr_t* header = sam_hdr_read(hf);
+    if(!header)
+    {
+        fprintf(stderr, "Failed to read the header of %s\n", fname);
+        exit(1);
+    }
+    std::string outname = std::string(fname) + ".qni";
+    std::string tmpname = outname + ".tmp";
+    FILE* f = fopen(tmpname.c_str(), "w");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", tmpname.c_str());
+        exit(1);
+    }
+    uint64_t entries = 0;
+    {
+        SamReader reader(hf, header, fname, mixed_ordering, pool);
+        if(!reader.is_seekable())
+        {
+            fprintf(stderr, "Only BAM files can be indexed by qname; %s isn't one\n", fname);
+            exit(1);
+        }
+        // Only positions and qnames are needed.
+        reader.setRequiredFields(0);
+        fprintf(f, "bamcmp-qnameindex\t1\n");
+        fprintf(f, "order\t%s\n", mixed_ordering ? "mixed" : "lexical");
+        fprintf(f, "size\t%lld\n", (long long)file_size(fname));
+        uint64_t due = 0;
+        while(!reader.is_eof())
+        {
+            if(reader.count() >= due && reader.getPrevQname() != bam_get_qname(reader.getRec()))
+            {
+                fprintf(f, "%lld\t%llu\t%s\n", (long long)reader.tell(), (unsigned long long)reader.count(), bam_get_qname(reader.getRec()));
+                due = reader.count() + every;
+                ++entries;
+            }
+            reader.next();
+        }
+    }
+    if(fclose(f) != 0 || rename(tmpname.c_str(), outname.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", outname.c_str());
+        exit(1);
+    }
+    fprintf(stderr, "Wrote %llu entries to %s\n", (unsigned long long)entries, outname.c_str());
+    bam_hdr_destroy(header);
+    hts_close(hf);
+}
+
+// fname's index, or NULL if there isn't one or it can't be used: built for the other
+// ordering, or for a different version of the file.
+QnameIndex* QnameIndex::load(const char* fname, bool mixed_ordering)
+{
+    std::string idxname = std::string(fname) + ".qni";
+    FILE* f = fopen(idxname.c_str(), "r");
+    if(!f)
+    {
+        return NULL;
+    }
+    char order[16];
+    long long size;
+    if(fscanf(f, "bamcmp-qnameindex\t1\norder\t%15s\nsize\t%lld\n", order, &size) != 2)
+    {
+        fprintf(stderr, "Warning: %s isn't a qname index; ignoring it\n", idxname.c_str());
+        fclose(f);
+        return NULL;
+    }
+    if(strcmp(order, mixed_ordering ? "mixed" : "lexical") != 0 || size != file_size(fname))
+    {
+        fprintf(stderr, "Warning: %s was built for a different %s; ignoring it\n", idxname.c_str(),
+                size != file_size(fname) ? "file" : "sort order");
+        fclose(f);
+        return NULL;
+    }
+    QnameIndex* idx = new QnameIndex(mixed_ordering);
+    char line[1024];
+    bool ok = true;
+    while(ok && fgets(line, sizeof(line), f))
+    {
+        // offset<TAB>count<TAB>qname<NEWLINE>, each entry starting a later qname group
+        // than the last, so all three strictly increase.
+        char* end;
+        size_t len = strlen(line);
+        ok = len && line[len - 1] == '\n';
+        if(ok)
+        {
+            line[len - 1] = '\0';
+            long long offset = strtoll(line, &end, 10);
+            ok = end != line && *end == '\t' && offset >= 0;
+            char* countStart = end + 1;
+            unsigned long long count = ok ? strtoull(countStart, &end, 10) : 0;
+            ok = ok && end != countStart && *end == '\t';
+            const char* name = end + 1;
+            ok = ok && *name;
+            if(ok && !idx->offsets.empty())
+            {
+                ok = offset > idx->offsets.back() && count > idx->counts.back() &&
+                     qname_cmp(idx->names.c_str() + idx->nameAt.back(), name, mixed_ordering) < 0;
+            }
+            if(ok)
+            {
+                idx->offsets.push_back(offset);
+                idx->counts.push_back(count);
+                idx->nameAt.push_back(idx->names.size());
+                idx->names.append(name, strlen(name) + 1);
+            }
+        }
+    }
+    fclose(f);
+    if(!ok)
+    {
+        fprintf(stderr, "Warning: %s is damaged or out of order; ignoring it\n", idxname.c_str());
+        delete idx;
+        return NULL;
+    }
+    return idx;
+}
+
+size_t QnameIndex::size() const
+{
+    return offsets.size();
+}
+
+bool QnameIndex::before(size_t entry, const char* qname) const
+{
+    return qname_cmp(names.c_str() + nameAt[entry], qname, mixed_ordering) < 0;
+}
+
+// The last entry whose qname sorts before qname. Lookups are expected to move forward
+// through the file, so the search gallops forward from the previous answer rather than
+// bisecting the whole index, and falls back to the start if asked to go back.
+bool QnameIndex::findBefore(const char* qname, int64_t& offset, uint64_t& count)
+{
+    size_t n = offsets.size();
+    if(cursor < n && !before(cursor, qname))
+    {
+        cursor = 0;
+    }
+    if(!n || !before(cursor, qname))
+    {
+        return false;
+    }
+    // Invariant: before(lo) holds; hi is past the end or !before(hi).
+    size_t lo = cursor, step = 1, hi = lo + 1;
+    while(hi < n && before(hi, qname))
+    {
+        lo = hi;
+        step *= 2;
+        hi = lo + step;
+    }
+    if(hi > n)
+    {
+        hi = n;
+    }
+    while(hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(before(mid, qname))
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    cursor = lo;
+    offset = offsets[lo];
+    count = counts[lo];
+    return true;
+}
@@ -0,0 +1,220 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ReadGroupSplitter.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+std::vector<std::pair<std::string, ReadGroupSplitter*> > ReadGroupSplitter::openSplitters;
+
+ReadGroupSplitter* ReadGroupSplitter::begin_or_die(const char* fname, const OutputFormat& format, bam_hdr_t* header, int inputNumber, htsThreadPool* pool, RefCache* ref)
+{
+    if(inputNumber != 1 && inputNumber != 2)
+    {
+        fprintf(stderr, "inputNumber must be 1 or 2\n");
+        exit(1);
+    }
+    ReadGroupSplitter* ret = NULL;
+    std::string sfname(fname);
+    for(std::vector<std::pair<std::string, ReadGroupSplitter*> >::iterator it = openSplitters.begin(), itend = openSplitters.end(); it != itend && !ret; ++it)
+    {
+        if(it->first == sfname)
+        {
+            ++it->second->refCount;
+            ret = it->second;
+        }
+    }
+    if(!ret)
+    {
+        ret = new ReadGroupSplitter(sfname, format, pool);
+        openSplitters.push_back(std::make_pair(sfname, ret));
+    }
+    ret->setInput(inputNumber, header, ref);
+    return ret;
+}
+
+void ReadGroupSplitter::close(ReadGroupSplitter* s)
+{
+    if(--s->refCount)
+    {
+        return;
+    }
+    for(std::vector<std::pair<std::string, ReadGroupSplitter*> >::iterator it = openSplitters.begin(), itend = openSplitters.end(); it != itend; ++it)
+    {
+        if(it->second == s)
+        {
+            openSplitters.erase(it);
+            break;
+        }
+    }
+    delete s;
+}
+
+ReadGroupSplitter::ReadGroupSplitter(const std::string& _fname, const OutputFormat& _format, htsThreadPool* _pool) :
+    fname(_fname), format(_format), pool(_pool), refCount(1)
+{
+    headers[0] = headers[1] = NULL;
+    refs[0] = refs[1] = NULL;
+}
+
+ReadGroupSplitter::~ReadGroupSplitter()
+{
+    for(std::map<std::string, Output>::iterator it = outputs.begin(), itend = outputs.end(); it != itend; ++it)
+    {
+        // The file was registered once for each input it takes records from.
+        for(int i = 0; i < 2; ++i)
+        {
+            if(it->second.headers[i])
+            {
+                HTSFileWrapper::close(it->second.file);
+            }
+        }
+        for(int i = 0; i < 2; ++i)
+        {
+            if(it->second.headers[i])
+            {
+                bam_hdr_destroy(it->second.headers[i]);
+            }
+        }
+    }
+}
+
+void ReadGroupSplitter::setInput(int inputNumber, bam_hdr_t* header, RefCache* ref)
+{
+    if(!outputs.empty())
+    {
+        fprintf(stderr, "Read group splitter for %s given another input after writing started\n", fname.c_str());
+        exit(1);
+    }
+    headers[inputNumber - 1] = header;
+    refs[inputNumber - 1] = ref;
+}
+
+void ReadGroupSplitter::write1(int headerNum, bam1_t* rec)
+{
+    uint8_t* tag = bam_aux_get(rec, "RG");
+    if(tag && *tag == 'Z')
+    {
+        rg.assign((const char*)tag + 1);
+    }
+    else
+    {
+        rg.clear();
+    }
+    std::map<std::string, Output>::iterator it = outputs.find(rg);
+    Output& out = it == outputs.end() ? open(rg) : it->second;
+    out.file->write1(headerNum, rec);
+}
+
+ReadGroupSplitter::Output& ReadGroupSplitter::open(const std::string& id)
+{
+    std::string name = fileName(id);
+    std::pair<std::map<std::string, std::string>::iterator, bool> ins = idOfFile.insert(std::make_pair(name, id));
+    if(!ins.second)
+    {
+        fprintf(stderr, "Read groups %s and %s would both be written to %s\n", ins.first->second.c_str(), id.c_str(), name.c_str());
+        exit(1);
+    }
+
+    Output& out = outputs[id];
+    out.file = NULL;
+    for(int i = 0; i < 2; ++i)
+    {
+        out.headers[i] = NULL;
+        if(headers[i])
+        {
+            out.headers[i] = filterHeader(headers[i], id);
+            out.file = HTSFileWrapper::begin_or_die(name.c_str(), format, out.headers[i], i + 1, pool, refs[i]);
+        }
+    }
+    if(!out.file)
+    {
+        fprintf(stderr, "Started writing records to %s without any header\n", name.c_str());
+        exit(1);
+    }
+    return out;
+}
+
+// out.bam -> out.<id>.bam; characters that don't belong in a file name become _.
+std::string ReadGroupSplitter::fileName(const std::string& id) const
+{
+    if(id.empty())
+    {
+        return fname;
+    }
+    std::string safe(id);
+    for(std::string::iterator it = safe.begin(), itend = safe.end(); it != itend; ++it)
+    {
+        if(!(isalnum((unsigned char)*it) || *it == '.' || *it == '-' || *it == '_'))
+        {
+            *it = '_';
+        }
+    }
+    return insert_before_extension(fname, safe);
+}
+
+// A copy of header without any @RG line but id's.
+bam_hdr_t* ReadGroupSplitter::filterHeader(const bam_hdr_t* header, const std::string& id)
+{
+    std::string text;
+    std::string idField = "\tID:" + id;
+    const char* line = header->text;
+    const char* textEnd = header->text + header->l_text;
+    while(line < textEnd)
+    {
+        const char* nl = (const char*)memchr(line, '\n', textEnd - line);
+        const char* end = nl ? nl : textEnd;
+        std::string sline(line, end - line);
+        bool keep = true;
+        if(sline.compare(0, 3, "@RG") == 0)
+        {
+            size_t pos = sline.find(idField);
+            keep = !id.empty() && pos != std::string::npos &&
+                   (pos + idField.size() == sline.size() || sline[pos + idField.size()] == '\t');
+        }
+        if(keep)
+        {
+            text += sline;
+            if(nl)
+            {
+                text += '\n';
+            }
+        }
+        line = nl ? nl + 1 : textEnd;
+    }
+
+    bam_hdr_t* ret = bam_hdr_dup(header);
+    char* newtext = (char*)malloc(text.size() + 1);
+    if(!ret || !newtext)
+    {
+        fprintf(stderr, "Malloc failure while building read group header\n");
+        exit(1);
+    }
+    memcpy(newtext, text.c_str(), text.size() + 1);
+    free(ret->text);
+    ret->text = newtext;
+    ret->l_text = text.size();
+    return ret;
+}
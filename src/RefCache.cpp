@@ -0,0 +1,301 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "RefCache.h"
+
+#include <vector>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <htslib/faidx.h>
+#include <htslib/hts_md5.h>
+
+#include "util.h"
+
+RefCache::RefCache(const char* _fasta, const std::string& _cachePattern) : fasta(_fasta), cachePattern(_cachePattern), populated(false), fastaMap(NULL), fastaMapTried(false)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+RefCache::~RefCache()
+{
+    delete fastaMap;
+    pthread_mutex_destroy(&lock);
+}
+
+// Same default location htslib itself uses when REF_CACHE is unset.
+std::string RefCache::defaultCachePattern()
+{
+    const char* env = getenv("REF_CACHE");
+    if(env && *env)
+    {
+        return std::string(env);
+    }
+    const char* base = getenv("XDG_CACHE_HOME");
+    std::string dir;
+    if(base && *base)
+    {
+        dir = std::string(base);
+    }
+    else
+    {
+        base = getenv("HOME");
+        dir = std::string(base ? base : "/tmp") + "/.cache";
+    }
+    return dir + "/hts-ref/%2s/%2s/%s";
+}
+
+const char* RefCache::fastaName() const
+{
+    return fasta.c_str();
+}
+
+// Open an input and read its header. A CRAM input whose @SQ lines all carry M5 tags for
+// sequences of ref decodes from the shared cache, like CRAM outputs, rather than loading
+// the FASTA a second time; without usable M5 tags it falls back to the FASTA itself.
+htsFile* RefCache::openInput(const char* fname, htsThreadPool* pool, RefCache* ref, bam_hdr_t** header)
+{
+    htsFile* hf = hts_begin_or_die(fname, "r", NULL, pool, NULL);
+    *header = sam_hdr_read(hf);
+    if(!*header)
+    {
+        fprintf(stderr, "Failed to read the header of %s\n", fname);
+        exit(1);
+    }
+    if(ref && hts_get_format(hf)->format == cram && !ref->coversHeader(*header) && hts_set_fai_filename(hf, ref->fastaName()))
+    {
+        fprintf(stderr, "Failed to use reference %s for %s\n", ref->fastaName(), fname);
+        exit(1);
+    }
+    return hf;
+}
+
+// Make sure every sequence in the FASTA has an entry in the cache and note its MD5.
+// Safe to call from several threads; the first caller does the work.
+void RefCache::populate()
+{
+    pthread_mutex_lock(&lock);
+    if(!populated)
+    {
+        doPopulate();
+        populated = true;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// The FASTA mapped for reading bases directly, or NULL if it can't be (it's compressed).
+// Mapped on first use; safe to call from several threads.
+const FastaMap* RefCache::sequences()
+{
+    pthread_mutex_lock(&lock);
+    if(!fastaMapTried)
+    {
+        fastaMap = new FastaMap(fasta.c_str());
+        if(!fastaMap->usable())
+        {
+            delete fastaMap;
+            fastaMap = NULL;
+        }
+        fastaMapTried = true;
+    }
+    pthread_mutex_unlock(&lock);
+    return fastaMap;
+}
+
+void RefCache::doPopulate()
+{
+    faidx_t* fai = fai_load(fasta.c_str());
+    if(!fai)
+    {
+        fprintf(stderr, "Failed to load or build the index for reference %s\n", fasta.c_str());
+        exit(1);
+    }
+    hts_md5_context* md5ctx = hts_md5_init();
+    if(!md5ctx)
+    {
+        fprintf(stderr, "Failed to initialise MD5 context\n");
+        exit(1);
+    }
+    for(int i = 0, ilim = faidx_nseq(fai); i != ilim; ++i)
+    {
+        const char* name = faidx_iseq(fai, i);
+        int len = 0;
+        char* seq = faidx_fetch_seq(fai, name, 0, faidx_seq_len(fai, name) - 1, &len);
+        if(!seq || len < 0)
+        {
+            fprintf(stderr, "Failed to read sequence %s from reference %s\n", name, fasta.c_str());
+            exit(1);
+        }
+        // M5 is defined over the upper-cased sequence, and that's also what the cache holds.
+        for(int j = 0; j < len; ++j)
+        {
+            seq[j] = toupper((unsigned char)seq[j]);
+        }
+        unsigned char digest[16];
+        char hex[33];
+        hts_md5_reset(md5ctx);
+        hts_md5_update(md5ctx, seq, len);
+        hts_md5_final(digest, md5ctx);
+        hts_md5_hex(hex, digest);
+
+        std::string smd5(hex);
+        md5s[std::string(name)] = smd5;
+        cachedMd5s.insert(smd5);
+        store(smd5, seq, len);
+        free(seq);
+    }
+    hts_md5_destroy(md5ctx);
+    fai_destroy(fai);
+}
+
+const char* RefCache::md5(const std::string& seqname)
+{
+    populate();
+    std::map<std::string, std::string>::const_iterator it = md5s.find(seqname);
+    if(it == md5s.end())
+    {
+        return NULL;
+    }
+    return it->second.c_str();
+}
+
+// True if every @SQ line in header has an M5 tag naming a sequence now in the cache.
+bool RefCache::coversHeader(const bam_hdr_t* header)
+{
+    // Look for the M5 tags first: without them the FASTA is used directly, and there's
+    // no need to fill the cache.
+    std::vector<std::string> wanted;
+    for(const char* line = header->text; line && *line;)
+    {
+        const char* nl = strchr(line, '\n');
+        std::string sline(line, nl ? nl - line : strlen(line));
+        line = nl ? nl + 1 : NULL;
+        if(sline.compare(0, 3, "@SQ") != 0)
+        {
+            continue;
+        }
+        size_t m5 = sline.find("\tM5:");
+        if(m5 == std::string::npos)
+        {
+            return false;
+        }
+        size_t m5end = sline.find('\t', m5 + 4);
+        std::string md5 = sline.substr(m5 + 4, m5end == std::string::npos ? std::string::npos : m5end - (m5 + 4));
+        for(size_t i = 0; i < md5.size(); ++i)
+        {
+            md5[i] = tolower((unsigned char)md5[i]);
+        }
+        wanted.push_back(md5);
+    }
+    if(wanted.size() != (size_t)header->n_targets)
+    {
+        return false;
+    }
+    populate();
+    for(size_t i = 0; i < wanted.size(); ++i)
+    {
+        if(!cachedMd5s.count(wanted[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Expand the REF_CACHE pattern: %Ns consumes N characters of the MD5, %s the remainder.
+std::string RefCache::cachePath(const std::string& md5) const
+{
+    std::string path;
+    size_t used = 0;
+    for(size_t i = 0; i < cachePattern.size(); ++i)
+    {
+        if(cachePattern[i] != '%')
+        {
+            path += cachePattern[i];
+            continue;
+        }
+        size_t j = i + 1;
+        size_t n = 0;
+        while(j < cachePattern.size() && isdigit((unsigned char)cachePattern[j]))
+        {
+            n = n * 10 + (cachePattern[j] - '0');
+            ++j;
+        }
+        if(j < cachePattern.size() && cachePattern[j] == 's')
+        {
+            if(n == 0 || used + n > md5.size())
+            {
+                n = md5.size() - used;
+            }
+            path += md5.substr(used, n);
+            used += n;
+            i = j;
+        }
+        else
+        {
+            path += cachePattern[i];
+        }
+    }
+    if(used < md5.size())
+    {
+        path += "/" + md5.substr(used);
+    }
+    return path;
+}
+
+void RefCache::store(const std::string& md5, const char* seq, int len) const
+{
+    std::string path = cachePath(md5);
+    if(access(path.c_str(), R_OK) == 0)
+    {
+        return;
+    }
+
+    // mkdir -p the directory part:
+    for(size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+    {
+        std::string dir = path.substr(0, slash);
+        if(mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "Failed to create reference cache directory %s\n", dir.c_str());
+            exit(1);
+        }
+    }
+
+    // Write under a temporary name and rename, so concurrent runs never see a partial entry.
+    char tmpname[32];
+    snprintf(tmpname, sizeof(tmpname), ".tmp.%d", (int)getpid());
+    std::string tmppath = path + tmpname;
+    FILE* f = fopen(tmppath.c_str(), "wb");
+    if(!f || fwrite(seq, 1, len, f) != (size_t)len || fclose(f) != 0)
+    {
+        fprintf(stderr, "Failed to write reference cache entry %s\n", tmppath.c_str());
+        exit(1);
+    }
+    if(rename(tmppath.c_str(), path.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to move reference cache entry into place at %s\n", path.c_str());
+        exit(1);
+    }
+}
@@ -22,22 +22,40 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <htslib/hts.h>
+#include <htslib/hts_endian.h>
 
+#include "MemoryBudget.h"
 #include "util.h"
 
-extern bool mixed_ordering;
-
-SamReader::SamReader(htsFile* _hf, bam_hdr_t* _header, const char* fname) : hf(_hf), header(_header), eof(false), filename(fname)
+SamReader::SamReader(htsFile* _hf, bam_hdr_t* _header, const char* fname, bool _mixed_ordering, htsThreadPool* pool) : hf(_hf), header(_header),
+    textParser(NULL), eof(false), filename(fname), rec_offset(-1), nconsumed(0), prefetcher(NULL), index(NULL), mixed_ordering(_mixed_ordering), coreOnly(false),
+    pendingBytes(0), pendingNCigar(0), pendingLQseq(0)
 {
-    rec = bam_init1();
-    prev_rec = bam_init1();
-    next();
+    // Only BAM gives us a BGZF virtual offset for every record.
+    bgzf = hts_get_bgzfp(hf);
+    seekable = hts_get_format(hf)->format == bam && bgzf != NULL;
+    ownRec = bam_init1();
+    rec = ownRec;
+    // sam_read1 parses SAM text one line at a time on this thread, which can't keep up
+    // with a fast aligner; parse it in chunks on the pool instead.
+    if(hts_get_format(hf)->format == sam)
+    {
+        textParser = new SamTextParser(hf, header, fname, pool);
+    }
+    // The reader doesn't see the thread pool, so this counts only the file's own buffer;
+    // decompression queued on the pool isn't counted.
+    bufferBytes = header_bytes(header) + hts_buffer_bytes(hf, NULL);
+    MemoryBudget::reserve(MemoryBudget::component_inputs, bufferBytes);
+    read();
 }
 
 SamReader::~SamReader()
 {
-    bam_destroy1(rec);
+    MemoryBudget::release(MemoryBudget::component_inputs, bufferBytes);
+    delete textParser;
+    bam_destroy1(ownRec);
 }
 
 bool SamReader::is_eof() const
@@ -54,16 +72,45 @@ void SamReader::next()
 
     if(rec->data)
     {
-        bam_copy1(prev_rec, rec);
+        // Only the qname is needed to check ordering, which is much cheaper to keep than the whole record.
+        prev_qname.assign(bam_get_qname(rec), rec->core.l_qname - rec->core.l_extranul - 1);
+        ++nconsumed;
     }
 
-    if(sam_read1(hf, header, rec) < 0)
+    skipPending();
+    read();
+}
+
+void SamReader::read()
+{
+    if(seekable)
+    {
+        rec_offset = bgzf_tell(bgzf);
+    }
+    if(prefetcher)
+    {
+        // Compressed offset of the block being read.
+        prefetcher->consumed(bgzf_tell(bgzf) >> 16);
+    }
+    if(textParser)
+    {
+        bam1_t* parsed = textParser->next();
+        if(parsed)
+        {
+            rec = parsed;
+        }
+        else
+        {
+            eof = true;
+        }
+    }
+    else if((seekable ? readCore() : sam_read1(hf, header, rec)) < 0)
     {
         eof = true;
     }
-    if(prev_rec->data && (!eof) && qname_cmp(bam_get_qname(rec), bam_get_qname(prev_rec)) < 0)
+    if((!prev_qname.empty()) && (!eof) && qname_cmp(bam_get_qname(rec), prev_qname.c_str(), mixed_ordering) < 0)
     {
-        fprintf(stderr, "Order went backwards! In file %s, record %s belongs before %s. Re-sort your files and try again.\n", filename.c_str(), bam_get_qname(rec), bam_get_qname(prev_rec));
+        fprintf(stderr, "Order went backwards! In file %s, record %s belongs before %s. Re-sort your files and try again.\n", filename.c_str(), bam_get_qname(rec), prev_qname.c_str());
         if(mixed_ordering)
         {
             fprintf(stderr, "Expected order was the mixed string/integer ordering produced by samtools sort -n; use -N to switch to Picard / htsjdk string ordering\n");
@@ -80,3 +127,266 @@ bam1_t* SamReader::getRec()
 {
     return rec;
 }
+
+// The qname of the record most recently moved past, or empty if there is none.
+const std::string& SamReader::getPrevQname() const
+{
+    return prev_qname;
+}
+
+bool SamReader::is_seekable() const
+{
+    return seekable;
+}
+
+// Virtual offset of the current record, for seek().
+int64_t SamReader::tell() const
+{
+    return rec_offset;
+}
+
+// Number of records moved past so far.
+uint64_t SamReader::count() const
+{
+    return nconsumed;
+}
+
+void SamReader::seek(int64_t offset, uint64_t _count)
+{
+    if(!seekable || bgzf_seek(bgzf, offset, SEEK_SET) < 0)
+    {
+        fprintf(stderr, "Failed to seek in %s\n", filename.c_str());
+        exit(1);
+    }
+    // Forget the previous record; there is nothing to check ordering against any more.
+    prev_qname.clear();
+    pendingBytes = 0;
+    nconsumed = _count;
+    eof = false;
+    read();
+}
+
+const std::string& SamReader::getFilename() const
+{
+    return filename;
+}
+
+void SamReader::setIndex(QnameIndex* _index)
+{
+    index = _index;
+}
+
+// Seek to the last indexed record before qname, if that's in a later BGZF block than
+// the current record; the blocks in between are never decompressed.
+bool SamReader::skipTo(const char* qname)
+{
+    int64_t offset;
+    uint64_t at;
+    if(!index || eof || !index->findBefore(qname, offset, at) || (offset >> 16) <= (rec_offset >> 16))
+    {
+        return false;
+    }
+    seek(offset, at);
+    return true;
+}
+
+// Read-ahead is paced by the compressed offset, so it needs BGZF input (BAM or bgzipped SAM).
+void SamReader::setPrefetcher(InputPrefetcher* _prefetcher)
+{
+    if(!bgzf)
+    {
+        fprintf(stderr, "Warning: read-ahead needs BGZF-compressed input, so it won't be used for %s\n", filename.c_str());
+        return;
+    }
+    prefetcher = _prefetcher;
+}
+
+// Tell the reader which SAM_* fields of each record will actually be looked at. CRAM
+// then skips decoding the rest. BAM records are always read as just the core fields and
+// qname, with the rest left in the stream until load() asks for it; if nothing beyond
+// those is wanted at all, the rest of each record is skipped without being copied.
+void SamReader::setRequiredFields(int fields)
+{
+    const htsFormat* fmt = hts_get_format(hf);
+    if(fmt->format == cram)
+    {
+        if(hts_set_opt(hf, CRAM_OPT_REQUIRED_FIELDS, fields) != 0)
+        {
+            fprintf(stderr, "Warning: failed to restrict the fields decoded from %s\n", filename.c_str());
+        }
+    }
+    else if(fmt->format == bam && bgzf)
+    {
+        coreOnly = !(fields & (SAM_CIGAR | SAM_SEQ | SAM_QUAL | SAM_AUX | SAM_RGAUX));
+    }
+}
+
+// Read one BAM record's core and qname, leaving it with no CIGAR, sequence, qualities or
+// tags until load(). Returns -1 at EOF, like sam_read1.
+int SamReader::readCore()
+{
+    uint8_t buf[36];
+    ssize_t got = bgzf_read(bgzf, buf, 4);
+    if(got == 0)
+    {
+        return -1;
+    }
+    if(got != 4 || bgzf_read(bgzf, buf + 4, 32) != 32)
+    {
+        fprintf(stderr, "Truncated record in %s\n", filename.c_str());
+        exit(1);
+    }
+    int32_t block_len = le_to_i32(buf);
+    bam1_core_t* c = &rec->core;
+    c->tid = le_to_i32(buf + 4);
+    c->pos = le_to_i32(buf + 8);
+    uint32_t x2 = le_to_u32(buf + 12);
+    c->bin = x2 >> 16;
+    c->qual = (x2 >> 8) & 0xff;
+    uint32_t l_qname = x2 & 0xff;
+    uint32_t x3 = le_to_u32(buf + 16);
+    c->flag = x3 >> 16;
+    c->n_cigar = 0;
+    c->l_qseq = 0;
+    c->mtid = le_to_i32(buf + 24);
+    c->mpos = le_to_i32(buf + 28);
+    c->isize = le_to_i32(buf + 32);
+    pendingNCigar = x3 & 0xffff;
+    pendingLQseq = le_to_i32(buf + 20);
+
+    int32_t rest = block_len - 32 - (int32_t)l_qname;
+    if(l_qname == 0 || rest < 0 || pendingLQseq < 0 ||
+       (int64_t)pendingNCigar * 4 + ((int64_t)pendingLQseq + 1) / 2 + pendingLQseq > rest)
+    {
+        fprintf(stderr, "Malformed record in %s\n", filename.c_str());
+        exit(1);
+    }
+    // As in bam_read1, pad the qname with NULs so that the CIGAR after it is aligned.
+    c->l_extranul = (4 - (l_qname & 3)) & 3;
+    c->l_qname = l_qname + c->l_extranul;
+    if(rec->m_data < c->l_qname)
+    {
+        rec->m_data = c->l_qname;
+        rec->data = (uint8_t*)realloc(rec->data, rec->m_data);
+        if(!rec->data)
+        {
+            fprintf(stderr, "Out of memory reading %s\n", filename.c_str());
+            exit(1);
+        }
+    }
+    rec->l_data = c->l_qname;
+    if(bgzf_read(bgzf, rec->data, l_qname) != (ssize_t)l_qname)
+    {
+        fprintf(stderr, "Truncated record in %s\n", filename.c_str());
+        exit(1);
+    }
+    memset(rec->data + l_qname - 1, 0, c->l_extranul + 1);
+
+    pendingBytes = rest;
+    if(coreOnly)
+    {
+        skipPending();
+    }
+    return 0;
+}
+
+// Pass over whatever of the current record load() wasn't asked for.
+void SamReader::skipPending()
+{
+    while(pendingBytes > 0)
+    {
+        int n = pendingBytes < (int32_t)sizeof(skipbuf) ? pendingBytes : (int32_t)sizeof(skipbuf);
+        if(bgzf_read(bgzf, skipbuf, n) != n)
+        {
+            fprintf(stderr, "Truncated record in %s\n", filename.c_str());
+            exit(1);
+        }
+        pendingBytes -= n;
+    }
+}
+
+// Read the CIGAR, sequence, qualities and tags of a record readCore() left in the stream.
+void SamReader::load()
+{
+    if(pendingBytes <= 0 || eof)
+    {
+        return;
+    }
+    uint32_t l_data = rec->core.l_qname + pendingBytes;
+    if(rec->m_data < l_data)
+    {
+        uint8_t* data = (uint8_t*)realloc(rec->data, l_data);
+        if(!data)
+        {
+            fprintf(stderr, "Out of memory reading %s\n", filename.c_str());
+            exit(1);
+        }
+        rec->data = data;
+        rec->m_data = l_data;
+    }
+    if(bgzf_read(bgzf, rec->data + rec->core.l_qname, pendingBytes) != pendingBytes)
+    {
+        fprintf(stderr, "Truncated record in %s\n", filename.c_str());
+        exit(1);
+    }
+    rec->l_data = l_data;
+    rec->core.n_cigar = pendingNCigar;
+    rec->core.l_qseq = pendingLQseq;
+    pendingBytes = 0;
+    if(rec->core.n_cigar == 2)
+    {
+        expandLongCigar();
+    }
+}
+
+// A CIGAR of more than 65535 operations is stored as <l_qseq>S<ref length>N with the real
+// one in a CG:B,I tag; move it back into place, as bam_read1 does.
+void SamReader::expandLongCigar()
+{
+    const uint32_t* cigar = bam_get_cigar(rec);
+    if(bam_cigar_op(cigar[0]) != BAM_CSOFT_CLIP || (int32_t)bam_cigar_oplen(cigar[0]) != rec->core.l_qseq || bam_cigar_op(cigar[1]) != BAM_CREF_SKIP)
+    {
+        return;
+    }
+    uint8_t* cg = bam_aux_get(rec, "CG");
+    if(!cg || cg[0] != 'B' || (cg[1] != 'I' && cg[1] != 'i'))
+    {
+        return;
+    }
+    uint32_t n = le_to_u32(cg + 2);
+    uint8_t* tagStart = cg - 2;
+    size_t tagLen = 8 + (size_t)n * 4;
+    uint8_t* end = rec->data + rec->l_data;
+    if(tagStart + tagLen > end)
+    {
+        fprintf(stderr, "Malformed CG tag in %s\n", filename.c_str());
+        exit(1);
+    }
+    size_t l_qname = rec->core.l_qname;
+    uint8_t* afterCigar = rec->data + l_qname + 8;
+    size_t beforeTag = tagStart - afterCigar;
+    size_t afterTag = end - (tagStart + tagLen);
+    size_t l_data = l_qname + (size_t)n * 4 + beforeTag + afterTag;
+    uint8_t* data = (uint8_t*)malloc(l_data);
+    if(!data)
+    {
+        fprintf(stderr, "Out of memory reading %s\n", filename.c_str());
+        exit(1);
+    }
+    uint8_t* out = data;
+    memcpy(out, rec->data, l_qname);
+    out += l_qname;
+    for(uint32_t i = 0; i < n; ++i, out += 4)
+    {
+        uint32_t op = le_to_u32(cg + 6 + 4 * i);
+        memcpy(out, &op, 4);
+    }
+    memcpy(out, afterCigar, beforeTag);
+    out += beforeTag;
+    memcpy(out, tagStart + tagLen, afterTag);
+    free(rec->data);
+    rec->data = data;
+    rec->m_data = l_data;
+    rec->l_data = l_data;
+    rec->core.n_cigar = n;
+}
@@ -0,0 +1,290 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SamTextParser.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+
+#include "MemoryBudget.h"
+
+// Bytes of text per batch: a few thousand typical records, enough to amortise a pool job.
+static const size_t chunkSize = 1 << 20;
+
+SamTextParser::SamTextParser(htsFile* _hf, bam_hdr_t* _header, const char* fname, htsThreadPool* pool) :
+    hf(_hf), header(_header), filename(fname), tpool(NULL), queue(NULL), maxInFlight(1), inFlight(0), current(NULL),
+    inputDone(false), lineno(_hf->lineno)
+{
+    if(pool && pool->pool)
+    {
+        tpool = pool->pool;
+        // Never more in flight than the queue holds, so dispatching can't block while
+        // finished batches wait to be collected.
+        maxInFlight = hts_tpool_size(tpool) * 2;
+        queue = hts_tpool_process_init(tpool, maxInFlight, 0);
+        if(!queue)
+        {
+            fprintf(stderr, "Failed to create a parsing queue for %s\n", filename.c_str());
+            exit(1);
+        }
+        // sam_parse1 looks up RNAME and RNEXT in the header's name table, which htslib
+        // builds on first use. Build it now, as htslib's own threaded reader does, so
+        // the pool threads only ever read it.
+        if(sam_hdr_name2tid(header, "*") < -1)
+        {
+            fprintf(stderr, "Failed to index the header of %s\n", filename.c_str());
+            exit(1);
+        }
+    }
+    // Reading the header stops at the first record's line, which is left in hf->line.
+    if(hf->line.l)
+    {
+        carry.assign(hf->line.s, hf->line.l);
+        carry += '\n';
+        hf->line.l = 0;
+        --lineno;
+    }
+    // Each batch holds its text and about as much again once parsed.
+    bufferBytes = (uint64_t)(maxInFlight + 1) * chunkSize * 2;
+    MemoryBudget::reserve(MemoryBudget::component_inputs, bufferBytes);
+}
+
+SamTextParser::~SamTextParser()
+{
+    if(current)
+    {
+        freeBatches.push_back(current);
+    }
+    while(inFlight)
+    {
+        freeBatches.push_back(collect());
+    }
+    if(queue)
+    {
+        hts_tpool_process_destroy(queue);
+    }
+    for(size_t i = 0; i != freeBatches.size(); ++i)
+    {
+        destroyBatch(freeBatches[i]);
+    }
+    MemoryBudget::release(MemoryBudget::component_inputs, bufferBytes);
+}
+
+void SamTextParser::destroyBatch(Batch* b)
+{
+    for(size_t i = 0; i != b->recs.size(); ++i)
+    {
+        bam_destroy1(b->recs[i]);
+    }
+    delete b;
+}
+
+// The next record in input order, or NULL at the end. The record stays valid until the
+// following call.
+bam1_t* SamTextParser::next()
+{
+    while(!current || current->used == current->n)
+    {
+        if(current)
+        {
+            freeBatches.push_back(current);
+            current = NULL;
+        }
+        dispatch();
+        if(!inFlight)
+        {
+            return NULL;
+        }
+        current = collect();
+        if(current->badLine >= 0)
+        {
+            fprintf(stderr, "Failed to parse line %lld of %s\n", (long long)current->badLine, filename.c_str());
+            exit(1);
+        }
+    }
+    return current->recs[current->used++];
+}
+
+// Read and hand out chunks until the pool has as many as it may hold, or the input ends.
+void SamTextParser::dispatch()
+{
+    while(inFlight < maxInFlight && !inputDone)
+    {
+        Batch* b;
+        if(freeBatches.empty())
+        {
+            b = new Batch;
+            b->header = header;
+        }
+        else
+        {
+            b = freeBatches.back();
+            freeBatches.pop_back();
+        }
+        if(!readChunk(b))
+        {
+            freeBatches.push_back(b);
+            break;
+        }
+        ++inFlight;
+        if(queue)
+        {
+            if(hts_tpool_dispatch(tpool, queue, parseBatch, b) < 0)
+            {
+                fprintf(stderr, "Failed to queue parsing of %s\n", filename.c_str());
+                exit(1);
+            }
+        }
+        else
+        {
+            parseBatch(b);
+            parsed.push_back(b);
+        }
+    }
+}
+
+// The oldest batch handed out, once it has been parsed.
+SamTextParser::Batch* SamTextParser::collect()
+{
+    Batch* b;
+    if(queue)
+    {
+        hts_tpool_result* r = hts_tpool_next_result_wait(queue);
+        if(!r)
+        {
+            fprintf(stderr, "Failed to collect parsed records from %s\n", filename.c_str());
+            exit(1);
+        }
+        b = (Batch*)hts_tpool_result_data(r);
+        hts_tpool_delete_result(r, 0);
+    }
+    else
+    {
+        b = parsed.front();
+        parsed.pop_front();
+    }
+    --inFlight;
+    return b;
+}
+
+// Fill b with whole lines: the partial line left over from the last chunk, then as much
+// more as fits, cut back to the last newline. False once there is nothing left to read.
+bool SamTextParser::readChunk(Batch* b)
+{
+    size_t len = carry.size();
+    if(b->text.size() < len + chunkSize + 1)
+    {
+        b->text.resize(len + chunkSize + 1);
+    }
+    memcpy(&b->text[0], carry.data(), len);
+    size_t lineEnd = 0;
+    while(!inputDone)
+    {
+        if(len == b->text.size() - 1)
+        {
+            // A line longer than the buffer; make room for the rest of it.
+            b->text.resize(b->text.size() * 2);
+        }
+        ssize_t got = readRaw(&b->text[len], b->text.size() - 1 - len);
+        if(got < 0)
+        {
+            fprintf(stderr, "Failed to read %s\n", filename.c_str());
+            exit(1);
+        }
+        if(got == 0)
+        {
+            inputDone = true;
+            break;
+        }
+        len += got;
+        if(len >= chunkSize)
+        {
+            char* nl = (char*)memrchr(&b->text[0], '\n', len);
+            if(nl)
+            {
+                lineEnd = nl - &b->text[0] + 1;
+                break;
+            }
+        }
+    }
+    if(inputDone)
+    {
+        if(len && b->text[len - 1] != '\n')
+        {
+            b->text[len++] = '\n';
+        }
+        lineEnd = len;
+    }
+    carry.assign(&b->text[lineEnd], len - lineEnd);
+    b->len = lineEnd;
+    b->firstLine = lineno + 1;
+    lineno += std::count(&b->text[0], &b->text[0] + lineEnd, '\n');
+    return lineEnd != 0;
+}
+
+ssize_t SamTextParser::readRaw(char* buf, size_t n)
+{
+    BGZF* bgzf = hts_get_bgzfp(hf);
+    if(bgzf)
+    {
+        return bgzf_read(bgzf, buf, n);
+    }
+    return hread(hf->fp.hfile, buf, n);
+}
+
+// Pool job: parse every line of a batch's text into its records, reusing the ones left
+// from the batch's previous use.
+void* SamTextParser::parseBatch(void* arg)
+{
+    Batch* b = (Batch*)arg;
+    b->n = 0;
+    b->used = 0;
+    b->badLine = -1;
+    char* p = &b->text[0];
+    char* end = p + b->len;
+    for(int64_t line = b->firstLine; p != end; ++line)
+    {
+        char* nl = (char*)memchr(p, '\n', end - p);
+        *nl = '\0';
+        if(nl != p)
+        {
+            if(b->n == b->recs.size())
+            {
+                b->recs.push_back(bam_init1());
+            }
+            kstring_t ks;
+            ks.s = p;
+            ks.l = nl - p;
+            ks.m = ks.l + 1;
+            if(sam_parse1(&ks, b->header, b->recs[b->n]) < 0)
+            {
+                b->badLine = line;
+                break;
+            }
+            ++b->n;
+        }
+        p = nl + 1;
+    }
+    return b;
+}
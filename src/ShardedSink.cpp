@@ -0,0 +1,76 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ShardedSink.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+ShardedSink* ShardedSink::begin_or_die(const char* fname, int nshards, const OutputFormat& format, bam_hdr_t* header, int inputNumber, htsThreadPool* pool, RefCache* ref)
+{
+    ShardedSink* ret = new ShardedSink();
+    for(int i = 0; i < nshards; ++i)
+    {
+        std::string name = shardName(fname, i, nshards);
+        ret->shards.push_back(HTSFileWrapper::begin_or_die(name.c_str(), format, header, inputNumber, pool, ref));
+    }
+    return ret;
+}
+
+void ShardedSink::close(ShardedSink* s)
+{
+    for(size_t i = 0; i != s->shards.size(); ++i)
+    {
+        HTSFileWrapper::close(s->shards[i]);
+    }
+    delete s;
+}
+
+// Numbers are zero-padded to the same width, so the shards list in order.
+std::string ShardedSink::shardName(const std::string& fname, int shard, int nshards)
+{
+    int width = 1;
+    for(int n = nshards - 1; n >= 10; n /= 10)
+    {
+        ++width;
+    }
+    char num[16];
+    snprintf(num, sizeof(num), "%0*d", width, shard);
+    return insert_before_extension(fname, num);
+}
+
+ShardedSink::ShardedSink()
+{
+    //ctor
+}
+
+ShardedSink::~ShardedSink()
+{
+    //dtor
+}
+
+void ShardedSink::write1(int headerNum, bam1_t* rec)
+{
+    // Multiply-shift maps the hash's high bits onto [0, shards) without a division.
+    uint64_t shard = ((qname_hash(bam_get_qname(rec)) >> 32) * shards.size()) >> 32;
+    shards[shard]->write1(headerNum, rec);
+}
@@ -0,0 +1,245 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ThreadLayout.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+ThreadLayout::ThreadLayout(int _nthreads) : nthreads(_nthreads), inputNode(0), outputNode(0), inputThreads(0), outputThreads(0)
+{
+    readTopology();
+
+    // The node with the most usable CPUs hosts the join and the inputs.
+    for(size_t i = 1; i < nodes.size(); ++i)
+    {
+        if(nodes[i].size() > nodes[inputNode].size())
+        {
+            inputNode = i;
+        }
+    }
+
+    // Decompression is several times cheaper than compression, so inputs get about a
+    // quarter of the budget, and always leave a CPU on their node for the join itself.
+    const std::vector<int>& home = nodes[inputNode];
+    inputThreads = std::max(1, nthreads / 4);
+    inputThreads = std::min(inputThreads, std::max(1, (int)home.size() - 1));
+    outputThreads = std::max(1, nthreads - inputThreads);
+
+    inputCpus.assign(home.begin(), home.begin() + std::min(home.size(), (size_t)inputThreads + 1));
+
+    // Outputs take the other nodes first, then whatever is left on the input node.
+    size_t best = 0;
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        if((int)i != inputNode)
+        {
+            outputCpus.insert(outputCpus.end(), nodes[i].begin(), nodes[i].end());
+            if(nodes[i].size() > best)
+            {
+                best = nodes[i].size();
+                outputNode = i;
+            }
+        }
+    }
+    if(outputCpus.empty())
+    {
+        outputNode = inputNode;
+    }
+    outputCpus.insert(outputCpus.end(), home.begin() + inputCpus.size(), home.end());
+    if(outputCpus.empty())
+    {
+        // A single CPU: nothing to separate.
+        outputCpus = inputCpus;
+    }
+}
+
+ThreadLayout::~ThreadLayout()
+{
+    //dtor
+}
+
+// CPUs this process may use, grouped by NUMA node. Without NUMA information in sysfs
+// (some containers), everything is one node.
+void ThreadLayout::readTopology()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        fprintf(stderr, "Failed to read this process's CPU affinity\n");
+        exit(1);
+    }
+
+    for(int node = 0; ; ++node)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(path, "r");
+        if(!f)
+        {
+            break;
+        }
+        char buf[4096];
+        std::string list = fgets(buf, sizeof(buf), f) ? std::string(buf) : std::string();
+        fclose(f);
+        std::vector<int> all = parseCpuList(list), usable;
+        for(size_t i = 0; i < all.size(); ++i)
+        {
+            if(all[i] < CPU_SETSIZE && CPU_ISSET(all[i], &allowed))
+            {
+                usable.push_back(all[i]);
+            }
+        }
+        nodes.push_back(usable);
+    }
+
+    size_t total = 0;
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        total += nodes[i].size();
+    }
+    if(total == 0)
+    {
+        nodes.clear();
+        nodes.push_back(std::vector<int>());
+        for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if(CPU_ISSET(cpu, &allowed))
+            {
+                nodes[0].push_back(cpu);
+            }
+        }
+    }
+}
+
+// sysfs CPU lists look like "0-15,32-47".
+std::vector<int> ThreadLayout::parseCpuList(const std::string& list)
+{
+    std::vector<int> cpus;
+    const char* p = list.c_str();
+    while(*p)
+    {
+        char* end;
+        long lo = strtol(p, &end, 10);
+        if(end == p)
+        {
+            break;
+        }
+        long hi = lo;
+        p = end;
+        if(*p == '-')
+        {
+            hi = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for(long cpu = lo; cpu <= hi; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+        if(*p == ',')
+        {
+            ++p;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return cpus;
+}
+
+std::string ThreadLayout::formatCpuList(const std::vector<int>& cpus)
+{
+    std::vector<int> sorted(cpus);
+    std::sort(sorted.begin(), sorted.end());
+    std::string ret;
+    char buf[32];
+    for(size_t i = 0; i < sorted.size(); )
+    {
+        size_t j = i;
+        while(j + 1 < sorted.size() && sorted[j + 1] == sorted[j] + 1)
+        {
+            ++j;
+        }
+        if(j == i)
+        {
+            snprintf(buf, sizeof(buf), "%s%d", ret.empty() ? "" : ",", sorted[i]);
+        }
+        else
+        {
+            snprintf(buf, sizeof(buf), "%s%d-%d", ret.empty() ? "" : ",", sorted[i], sorted[j]);
+        }
+        ret += buf;
+        i = j + 1;
+    }
+    return ret;
+}
+
+// Threads inherit both their creator's CPU affinity and its memory policy, so pinning the
+// calling thread just before creating a pool places all of that pool's threads.
+void ThreadLayout::placeCallingThread(const std::vector<int>& cpus, int node)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(size_t i = 0; i < cpus.size(); ++i)
+    {
+        CPU_SET(cpus[i], &set);
+    }
+    if(sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+        fprintf(stderr, "Warning: failed to set CPU affinity to %s\n", formatCpuList(cpus).c_str());
+    }
+
+    unsigned long nodemask[16];
+    memset(nodemask, 0, sizeof(nodemask));
+    nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    // Best effort; not every kernel or container allows it.
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, (unsigned long)(8 * sizeof(nodemask)));
+}
+
+// Create the input and output pools on their CPUs, then leave the calling (join) thread
+// pinned alongside the inputs.
+void ThreadLayout::createPools(htsThreadPool* inputPool, htsThreadPool* outputPool)
+{
+    placeCallingThread(inputCpus, inputNode);
+    inputPool->pool = hts_tpool_init(inputThreads);
+    placeCallingThread(outputCpus, outputNode);
+    outputPool->pool = hts_tpool_init(outputThreads);
+    if(!inputPool->pool || !outputPool->pool)
+    {
+        fprintf(stderr, "Failed to create the input and output thread pools\n");
+        exit(1);
+    }
+    placeCallingThread(inputCpus, inputNode);
+}
+
+void ThreadLayout::report() const
+{
+    fprintf(stderr, "Thread layout: %lu NUMA node(s) usable\n", (unsigned long)nodes.size());
+    fprintf(stderr, "  join + %d input thread(s): node %d, CPUs %s\n", inputThreads, inputNode, formatCpuList(inputCpus).c_str());
+    fprintf(stderr, "  %d output thread(s): node %d preferred, CPUs %s\n", outputThreads, outputNode, formatCpuList(outputCpus).c_str());
+}
@@ -19,6 +19,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <string>
@@ -29,38 +31,139 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <htslib/bgzf.h>
 
 #include "util.h"
+#include "Estimator.h"
 #include "HTSFileWrapper.h"
 #include "SamReader.h"
-#include "BamRecVector.h"
-
-extern bool mixed_ordering;
-
-enum scoringmethods
-{
-    scoringmethod_nmatches,
-    scoringmethod_astag,
-    scoringmethod_mapq,
-    scoringmethod_balwayswins
-};
-
-static scoringmethods scoringmethod;
-
-static bool warned_nm_anomaly = false;
-static bool warned_nm_md_tags = false;
+#include "BamCmpEngine.h"
+#include "RefCache.h"
+#include "Checkpoint.h"
+#include "CompressionBench.h"
+#include "GenomeSplitter.h"
+#include "BatchRunner.h"
+#include "MemoryBudget.h"
+#include "MergedReader.h"
+#include "OutputFormat.h"
+#include "Preflight.h"
+#include "Profiler.h"
+#include "QnameIndex.h"
+#include "ReadGroupSplitter.h"
+#include "ShardedSink.h"
+#include "ThreadLayout.h"
 
 static void usage()
 {
-    fprintf(stderr, "Usage: bamcmp -1 input1.s/b/cram -2 input2.s/b/cram [-a first_only.xam] [-b second_only.xam] [-A first_better.xam] [-B second_better.xam] [-C first_worse.xam] [-D second_worse.xam] [-t nthreads] [-n | -N] [-s scoring_method]\n");
-    fprintf(stderr, "\t-n\tExpect input sorted as per samtools -n (Mixed string / integer ordering, default)\n");
+    fprintf(stderr, "Usage: bamcmp -1 input1.s/b/cram... -2 input2.s/b/cram... [--input1-list file] [--input2-list file] [-a first_only.xam] [-b second_only.xam] [-A first_better.xam] [-B second_better.xam] [-C first_worse.xam] [-D second_worse.xam] [-t nthreads] [-n | -N] [-s scoring_method] [-O fmt[,opt=val...]] [--output-fmt-for X=fmt...] [--ref1 ref1.fa] [--ref2 ref2.fa] [--ref-cache pattern] [--checkpoint file [--checkpoint-interval n] [--resume]] [--prefetch depth [--prefetch-chunk size]] [--max-group-mem size] [--max-memory size] [--split-rg | --shards n] [--stats] [--all-scores] [--affinity] [--no-preflight] [--profile trace.json]\n");
+    fprintf(stderr, "       bamcmp --single -1 input.s/b/cram [--prefix1 p] [--prefix2 p] [--contigs1 file] [--contigs2 file] [output and scoring options as above]\n");
+    fprintf(stderr, "       bamcmp --estimate fraction [--tolerance t] -1 input1.s/b/cram -2 input2.s/b/cram [-t nthreads] [-n | -N] [-s scoring_method] [--single ...] [--ref1 ref1.fa] [--ref2 ref2.fa]\n");
+    fprintf(stderr, "       bamcmp bench-compress [-t nthreads] [--records n] [--ref ref.fa] input.s/b/cram [fmt[,opt=val...] ...]\n");
+    fprintf(stderr, "       bamcmp index [-t nthreads] [-n | -N] [--every n] input.bam...\n");
+    fprintf(stderr, "       bamcmp batch [--jobs n] [-t nthreads] [-n | -N] [-s scoring_method] [-O fmt[,opt=val...]] [--output-fmt-for X=fmt...] [--ref1 ref1.fa] [--ref2 ref2.fa] [--ref-cache pattern] [--max-group-mem size] [--max-memory size] [--stats] [--all-scores] [--profile trace.json] manifest.tsv\n");
+    fprintf(stderr, "\t-1 file, -2 file\tInputs 1 and 2; repeat to give several name-sorted files per input (e.g. one per lane), which are merged by qname as they are read\n");
+    fprintf(stderr, "\t--input1-list file, --input2-list file\tRead more files for input 1 / 2 from file, one per line\n");
+    fprintf(stderr, "\t-n\tExpect input sorted as per samtools -n (Mixed string / integer ordering)\n");
     fprintf(stderr, "\t-N\tExpect input sorted as per Picard / htsjdk name ordering (lexical ordering)\n");
+    fprintf(stderr, "\t\tWith neither, the order is chosen by the pre-flight check, or is -n without it\n");
+    fprintf(stderr, "\t--no-preflight\tDon't sample the inputs before starting to check their sort order and tags\n");
     fprintf(stderr, "\t-s match\tScore hits by the number of bases that match the reference, as given by the CIGAR string and NM / MD attributes (default)\n");
     fprintf(stderr, "\t-s as\tScore hits according to the AS attribute written by some aligners\n");
     fprintf(stderr, "\t-s mapq\tScore hits according to the MAPQ SAM field\n");
     fprintf(stderr, "\t-s balwayswins\tAlways award hits to input B, regardless of alignment scores (equivalent to filtering A by any read mapped in B)\n");
+    fprintf(stderr, "\t-t nthreads\tSize of the thread pool shared by all inputs and outputs for (de)compression\n");
+    fprintf(stderr, "\t-O fmt[,opt=val...]\tWrite outputs as bam (default), cram or sam. Options: level=0-9 (BAM defaults to 1), block_size=size (I/O buffer), seqs_per_slice=n (CRAM), slim (drop sequence, qualities and all but the score tags), stats (as --stats, for this output)\n");
+    fprintf(stderr, "\t--output-fmt-for X=fmt[,opt=val...]\tOverride -O for output X (a, b, A, B, C or D); may be repeated\n");
+    fprintf(stderr, "\t--ref1 ref.fa\tReference FASTA input 1 was aligned against, for CRAM input and output\n");
+    fprintf(stderr, "\t--ref2 ref.fa\tReference FASTA input 2 was aligned against, for CRAM input and output\n");
+    fprintf(stderr, "\t--ref-cache pattern\tMD5-keyed reference cache shared by all CRAM files, as for htslib's REF_CACHE (default: $REF_CACHE or ~/.cache/hts-ref/%%2s/%%2s/%%s)\n");
+    fprintf(stderr, "\t--checkpoint file\tPeriodically record progress in file (BAM inputs, BAM or SAM outputs only)\n");
+    fprintf(stderr, "\t--checkpoint-interval n\tCheckpoint every n input records (default 10000000)\n");
+    fprintf(stderr, "\t--resume\tCarry on from the --checkpoint file left by an interrupted run, with the same options\n");
+    fprintf(stderr, "\t--single\tInput 1 was aligned once against a concatenated reference of both genomes; split each qname group by genome and compare as if there were two inputs\n");
+    fprintf(stderr, "\t--prefix1 p, --prefix2 p\tIn --single mode, reference sequences whose names start with p belong to genome 1 / 2 (may be repeated)\n");
+    fprintf(stderr, "\t--contigs1 file, --contigs2 file\tIn --single mode, reference sequences listed in file belong to genome 1 / 2\n");
+    fprintf(stderr, "\t--prefetch depth\tKeep depth reads in flight ahead of each BGZF input's reader (io_uring if built with USE_LIBURING=1, else posix_fadvise)\n");
+    fprintf(stderr, "\t--prefetch-chunk size\tSize of each read-ahead request (default 8M)\n");
+    fprintf(stderr, "\t--max-group-mem size\tHold at most size bytes of records for one qname in memory, using a temporary file beyond that (default 512M, 0 for no limit)\n");
+    fprintf(stderr, "\t--max-memory size\tKeep bamcmp's own buffers within size bytes in total, spilling qname groups and shortening read-ahead as needed, and report peak use per component\n");
+    fprintf(stderr, "\t--estimate fraction\tWrite nothing; classify only reads whose qname hashes into this fraction (e.g. 0.01) and report the fraction of reads in each category with 95%% confidence intervals\n");
+    fprintf(stderr, "\t--tolerance t\tWith --estimate, stop once every interval is within +/- t (e.g. 0.001)\n");
+    fprintf(stderr, "\t--split-rg\tWrite each output as one file per read group (RG tag), inserting the group's ID before the extension; records without RG keep the plain name\n");
+    fprintf(stderr, "\t--shards n\tWrite each output as n files by qname hash, inserting the shard number before the extension; a read's alignments and its mate's always share a shard\n");
+    fprintf(stderr, "\t--stats\tAlongside each output, write OUTPUT.stats.json with its flagstat, idxstats and checksum figures, gathered while writing\n");
+    fprintf(stderr, "\t--affinity\tPin the join and input decompression threads to one NUMA node and output compression to the other CPUs, splitting -t between them\n");
+    fprintf(stderr, "\t--all-scores\tTag each output record with its own score under every method: sm (matching bases), sa (AS, if present) and sq (MAPQ)\n");
+    fprintf(stderr, "\t--profile trace.json\tTime each stage, with hardware counters where available; print a summary and write a Chrome / Perfetto trace\n");
+    fprintf(stderr, "\t--jobs n\tIn batch mode, compare up to n samples at once (default: a quarter of -t, at least 1); the rest of -t is the shared (de)compression pool\n");
+    fprintf(stderr, "\tmanifest.tsv\tOne sample per line: input1 <tab> input2 <tab> key=file ... where key is a, b, A, B, C or D (outputs, as above) or ref1, ref2\n");
     fprintf(stderr, "\n");
     exit(1);
 }
 
+enum longoptions
+{
+    longopt_ref1 = 256,
+    longopt_ref2,
+    longopt_refcache,
+    longopt_checkpoint,
+    longopt_checkpointinterval,
+    longopt_resume,
+    longopt_prefetch,
+    longopt_prefetchchunk,
+    longopt_single,
+    longopt_prefix1,
+    longopt_prefix2,
+    longopt_contigs1,
+    longopt_contigs2,
+    longopt_jobs,
+    longopt_maxgroupmem,
+    longopt_profile,
+    longopt_allscores,
+    longopt_affinity,
+    longopt_maxmemory,
+    longopt_splitrg,
+    longopt_estimate,
+    longopt_tolerance,
+    longopt_outputfmtfor,
+    longopt_input1list,
+    longopt_input2list,
+    longopt_nopreflight,
+    longopt_shards,
+    longopt_stats
+};
+
+static const struct option longopts[] =
+{
+    {"ref1", required_argument, NULL, longopt_ref1},
+    {"ref2", required_argument, NULL, longopt_ref2},
+    {"ref-cache", required_argument, NULL, longopt_refcache},
+    {"output-fmt", required_argument, NULL, 'O'},
+    {"checkpoint", required_argument, NULL, longopt_checkpoint},
+    {"checkpoint-interval", required_argument, NULL, longopt_checkpointinterval},
+    {"resume", no_argument, NULL, longopt_resume},
+    {"prefetch", required_argument, NULL, longopt_prefetch},
+    {"prefetch-chunk", required_argument, NULL, longopt_prefetchchunk},
+    {"single", no_argument, NULL, longopt_single},
+    {"prefix1", required_argument, NULL, longopt_prefix1},
+    {"prefix2", required_argument, NULL, longopt_prefix2},
+    {"contigs1", required_argument, NULL, longopt_contigs1},
+    {"contigs2", required_argument, NULL, longopt_contigs2},
+    {"jobs", required_argument, NULL, longopt_jobs},
+    {"max-group-mem", required_argument, NULL, longopt_maxgroupmem},
+    {"profile", required_argument, NULL, longopt_profile},
+    {"all-scores", no_argument, NULL, longopt_allscores},
+    {"affinity", no_argument, NULL, longopt_affinity},
+    {"max-memory", required_argument, NULL, longopt_maxmemory},
+    {"split-rg", no_argument, NULL, longopt_splitrg},
+    {"estimate", required_argument, NULL, longopt_estimate},
+    {"tolerance", required_argument, NULL, longopt_tolerance},
+    {"output-fmt-for", required_argument, NULL, longopt_outputfmtfor},
+    {"input1-list", required_argument, NULL, longopt_input1list},
+    {"input2-list", required_argument, NULL, longopt_input2list},
+    {"no-preflight", no_argument, NULL, longopt_nopreflight},
+    {"shards", required_argument, NULL, longopt_shards},
+    {"stats", no_argument, NULL, longopt_stats},
+    {NULL, 0, NULL, 0}
+};
+
 static void disclaimer(std::string pname, std::string pyear, std::string aname)
 {
   std::cout << std::endl;
@@ -71,204 +174,186 @@ static void disclaimer(std::string pname, std::string pyear, std::string aname)
   std::cout << std::endl;
 }
 
-static bool aux_is_int(uint8_t* rec)
+// A file of files: one input path per line, blank lines and # comments ignored.
+static void read_input_list(const char* fname, std::vector<std::string>& names)
 {
-    switch(*rec)
-    {
-    case 'c':
-    case 'C':
-    case 's':
-    case 'S':
-    case 'i':
-    case 'I':
-        return true;
-    default:
-        return false;
+    FILE* f = fopen(fname, "r");
+    if(!f)
+    {
+        fprintf(stderr, "Failed to open input list %s\n", fname);
+        exit(1);
+    }
+    char buf[4096];
+    while(fgets(buf, sizeof(buf), f))
+    {
+        char* name = strtok(buf, "\r\n");
+        if(name && name[0] != '#')
+        {
+            names.push_back(std::string(name));
+        }
     }
+    fclose(f);
 }
 
-static uint32_t get_alignment_score(bam1_t* rec, bool is_input_a)
+// With --split-rg each output is a set of per-read-group files rather than one file,
+// and with --shards a set of per-shard files.
+static RecordSink* begin_output(bool split_rg, int shards, const char* fname, const OutputFormat& format, bam_hdr_t* header, int inputNumber, htsThreadPool* pool, RefCache* ref)
 {
-    switch(scoringmethod)
+    if(split_rg)
     {
-    case scoringmethod_nmatches:
+        return ReadGroupSplitter::begin_or_die(fname, format, header, inputNumber, pool, ref);
+    }
+    if(shards > 1)
     {
-        bool seen_equal_or_diff = false;
-        int32_t cigar_total = 0;
-        const uint32_t* cigar = bam_get_cigar(rec);
-        int32_t indel_edit_distance = 0;
-
-        for(int i = 0; i < rec->core.n_cigar; ++i)
-        {
-            // CIGAR scoring: score points for matching bases, and negatives for deletions
-            // since otherwise 10M10D10M would score the same as 20M. Insertions, clipping etc
-            // don't need to score a penalty since they skip bases in the query.
-            // CREF_SKIP (N / intron-skip operator) is acceptable: 10M1000N10M is as good as 20M.
-            // Insertions are counted to correct the NM tag below only.
-
-            int32_t n = bam_cigar_oplen(cigar[i]);
-            switch(bam_cigar_op(cigar[i]))
-            {
-            case BAM_CEQUAL:
-                seen_equal_or_diff = true;
-            // fall through
-            case BAM_CMATCH:
-                cigar_total += n;
-                break;
-
-            case BAM_CDEL:
-                indel_edit_distance += n;
-                cigar_total -= n;
-                break;
-
-            case BAM_CDIFF:
-                seen_equal_or_diff = true;
-                break;
-
-            case BAM_CINS:
-                indel_edit_distance += n;
-                break;
-
-            default:
-                break;
-            }
-        }
+        return ShardedSink::begin_or_die(fname, shards, format, header, inputNumber, pool, ref);
+    }
+    return HTSFileWrapper::begin_or_die(fname, format, header, inputNumber, pool, ref);
+}
 
-        // The BAM_CMATCH operator (unlike BAM_CEQUAL or BAM_CDIFF) could mean a match or a mismatch
-        // with same length (e.g. a SNP). If the file doesn't seem to use the advanced operators try to
-        // spot mismatches from metadata tags.
-        if(!seen_equal_or_diff)
-        {
-            uint8_t* nm_rec = bam_aux_get(rec, "NM");
-            if(nm_rec && aux_is_int(nm_rec))
-            {
-                int32_t nm = bam_aux2i(nm_rec);
-                if(nm < indel_edit_distance)
-                {
-                    if(!warned_nm_anomaly)
-                    {
-                        fprintf(stderr, "Warning: anomaly in record %s: NM is %d but there are at least %d indel bases in the CIGAR string\n", bam_get_qname(rec), nm, indel_edit_distance);
-                        fprintf(stderr, "There may be more records with this problem, but the warning will not be repeated\n");
-                        warned_nm_anomaly = true;
-                    }
-                }
-                else
-                {
-                    cigar_total -= (bam_aux2i(nm_rec) - indel_edit_distance);
-                    seen_equal_or_diff = true;
-                }
-            }
-        }
+static void close_output(bool split_rg, int shards, RecordSink* out)
+{
+    if(split_rg)
+    {
+        ReadGroupSplitter::close((ReadGroupSplitter*)out);
+    }
+    else if(shards > 1)
+    {
+        ShardedSink::close((ShardedSink*)out);
+    }
+    else
+    {
+        HTSFileWrapper::close((HTSFileWrapper*)out);
+    }
+}
 
-        if(!seen_equal_or_diff)
-        {
-            uint8_t* md_rec = bam_aux_get(rec, "MD");
-            if(md_rec)
-            {
-                char* mdstr = bam_aux2Z(md_rec);
-                if(mdstr)
-                {
-                    seen_equal_or_diff = true;
-                    bool in_deletion = false;
-                    for(; *mdstr; ++mdstr)
-                    {
-                        // Skip deletions, which are already penalised.
-                        // Syntax seems to be: numbers mean base strings that match the reference; ^ followed by letters means
-                        // a deletion; letters without the preceding ^ indicate a mismatch.
-                        char c = *mdstr;
-                        if(c == '^')
-                        {
-                            in_deletion = true;
-                        }
-                        else if(isdigit(c))
-                        {
-                            in_deletion = false;
-                        }
-                        else if(!in_deletion)
-                        {
-                            // Mismatch
-                            cigar_total--;
-                        }
-                    }
-                }
-            }
-        }
+static const struct option indexopts[] =
+{
+    {"every", required_argument, NULL, 'e'},
+    {0, 0, 0, 0}
+};
 
-        if((!seen_equal_or_diff) && !warned_nm_md_tags)
+// bamcmp index [-t nthreads] [-n | -N] [--every n] input.bam...
+static int build_index(int argc, char** argv)
+{
+    int nthreads = 1;
+    uint64_t every = 2048;
+    bool mixed_ordering = true;
+    int c;
+    while((c = getopt_long(argc, argv, "t:nN", indexopts, NULL)) != -1)
+    {
+        switch(c)
         {
-            fprintf(stderr, "Warning: input file does not use the =/X CIGAR operators, or include NM or MD tags, so I have no way to spot length-preserving reference mismatches.\n");
-            fprintf(stderr, "At least record %s exhibited this problem; there may be others but the warning will not be repeated. I will assume M CIGAR operators indicate a match.\n", bam_get_qname(rec));
-            warned_nm_md_tags = true;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            mixed_ordering = true;
+            break;
+        case 'N':
+            mixed_ordering = false;
+            break;
+        case 'e':
+            every = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage();
         }
-        return std::max(cigar_total, 0);
     }
-    // End the CIGAR string scoring method. Thankfully the others are much simpler to implement:
+    if(optind >= argc || nthreads < 1 || !every)
+    {
+        usage();
+    }
 
-    case scoringmethod_astag:
+    htsThreadPool pool = {NULL, 0};
+    if(nthreads > 1)
     {
-        uint8_t* score_rec = bam_aux_get(rec, "AS");
-        if(!score_rec)
+        pool.pool = hts_tpool_init(nthreads);
+        if(!pool.pool)
         {
-            fprintf(stderr, "Fatal: At least record %s doesn't have an AS tag as required.\n", bam_get_qname(rec));
+            fprintf(stderr, "Failed to create a pool of %d threads\n", nthreads);
             exit(1);
         }
-        return bam_aux2i(score_rec);
     }
+    for(int i = optind; i < argc; ++i)
+    {
+        QnameIndex::build(argv[i], mixed_ordering, every, &pool);
+    }
+    if(pool.pool)
+    {
+        hts_tpool_destroy(pool.pool);
+    }
+    return 0;
+}
 
-    case scoringmethod_mapq:
-        return rec->core.qual;
+static const struct option benchopts[] =
+{
+    {"records", required_argument, NULL, 'r'},
+    {"ref", required_argument, NULL, 'f'},
+    {0, 0, 0, 0}
+};
 
-    case scoringmethod_balwayswins:
-        // Mapped B records beat any A record, beats an unmapped B record.
-        if(is_input_a)
-        {
-            return 1;
-        }
-        else if(!(rec->core.flag & BAM_FUNMAP))
+// bamcmp bench-compress [-t nthreads] [--records n] [--ref ref.fa] input [fmt ...]
+static int bench_compress(int argc, char** argv)
+{
+    int nthreads = 1;
+    uint64_t records = 500000;
+    char* ref = NULL;
+    int c;
+    while((c = getopt_long(argc, argv, "t:", benchopts, NULL)) != -1)
+    {
+        switch(c)
         {
-            return 2;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'r':
+            records = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            ref = optarg;
+            break;
+        default:
+            usage();
         }
-        else
+    }
+    if(optind >= argc || nthreads < 1 || !records)
+    {
+        usage();
+    }
+
+    htsThreadPool pool = {NULL, 0};
+    if(nthreads > 1)
+    {
+        pool.pool = hts_tpool_init(nthreads);
+        if(!pool.pool)
         {
-            return 0;
+            fprintf(stderr, "Failed to create a pool of %d threads\n", nthreads);
+            exit(1);
         }
     }
-    return -1;
-}
-
-static bool uniqueValue(const std::vector<HTSFileWrapper*>& in)
-{
-
-    bool outValid = false;
-    HTSFileWrapper* out = 0;
-
-    for(std::vector<HTSFileWrapper*>::const_iterator it = in.begin(), itend = in.end(); it != itend; ++it)
     {
-        if(!outValid)
+        CompressionBench bench(argv[optind], records, ref, &pool);
+        if(optind + 1 == argc)
         {
-            out = *it;
-            outValid = true;
+            bench.addDefaultSettings();
         }
-        else if(out != *it)
+        for(int i = optind + 1; i < argc; ++i)
         {
-            return false;
+            OutputFormat format;
+            if(!format.parse(argv[i]))
+            {
+                fprintf(stderr, "Can't parse output format %s\n", argv[i]);
+                usage();
+            }
+            bench.addSetting(format);
         }
+        bench.run();
     }
-    return outValid;
-}
-
-static void clearMateInfo(BamRecVector& v)
-{
-
-    for(int i = 0, ilim = v.size(); i != ilim; ++i)
+    if(pool.pool)
     {
-        uint32_t maten = (uint32_t)flag2mate(v.get(i));
-        bam_aux_append(v.get(i), "om", 'i', sizeof(uint32_t), (uint8_t*)&maten);
-
-        v.get(i)->core.flag &= ~(BAM_FPROPER_PAIR | BAM_FMREVERSE | BAM_FPAIRED | BAM_FMUNMAP | BAM_FREAD1 | BAM_FREAD2);
-        v.get(i)->core.mtid = -1;
-        v.get(i)->core.mpos = -1;
+        hts_tpool_destroy(pool.pool);
     }
+    return 0;
 }
 
 int main(int argc, char** argv)
@@ -276,22 +361,73 @@ int main(int argc, char** argv)
 
     disclaimer("bamcmp","2016","Christopher Smowton");
 
-    char *in1_name = NULL, *in2_name = NULL, *firstbetter_name = NULL, *secondbetter_name = NULL,
+    if(argc > 1 && strcmp(argv[1], "index") == 0)
+    {
+        return build_index(argc - 1, argv + 1);
+    }
+    if(argc > 1 && strcmp(argv[1], "bench-compress") == 0)
+    {
+        return bench_compress(argc - 1, argv + 1);
+    }
+
+    // "bamcmp batch ..." takes the common options plus a manifest in place of -1 / -2 and the outputs.
+    bool batch = (argc > 1 && strcmp(argv[1], "batch") == 0);
+    if(batch)
+    {
+        --argc;
+        ++argv;
+    }
+
+    std::vector<std::string> in1_names, in2_names;
+    char *firstbetter_name = NULL, *secondbetter_name = NULL,
           *firstworse_name = NULL, *secondworse_name = NULL, *first_name = NULL, *second_name = NULL;
 
+    char *ref1_name = NULL, *ref2_name = NULL, *checkpoint_name = NULL;
+    uint64_t checkpoint_interval = 10000000;
+    bool resume = false;
+    int prefetch_depth = 0;
+    uint64_t prefetch_chunk = 8 << 20;
+    bool single = false;
+    std::vector<std::string> prefixes1, prefixes2;
+    char *contigs1_name = NULL, *contigs2_name = NULL;
+
     int nthreads = 1;
+    int jobs = 0;
+    uint64_t max_group_mem = 512 << 20;
+    uint64_t max_memory = 0;
+    char* profile_name = NULL;
+    bool all_scores = false;
+    bool affinity = false;
+    bool split_rg = false;
+    int shards = 1;
+    bool stats = false;
+    double estimate_fraction = 0;
+    double tolerance = 0;
+    bool mixed_ordering = true;
+    bool ordering_given = false;
+    bool preflight = true;
+    scoringmethods scoringmethod = scoringmethod_nmatches;
     std::string scoring_method_string = "match";
+    std::string output_format_string = "bam";
+    std::vector<std::string> category_formats;
+    std::string ref_cache_pattern = RefCache::defaultCachePattern();
 
     int c;
-    while ((c = getopt(argc, argv, "a:b:1:2:t:A:B:C:D:nNs:")) >= 0)
+    while ((c = getopt_long(argc, argv, "a:b:1:2:t:A:B:C:D:nNs:O:", longopts, NULL)) >= 0)
     {
         switch (c)
         {
         case '1':
-            in1_name = optarg;
+            in1_names.push_back(optarg);
             break;
         case '2':
-            in2_name = optarg;
+            in2_names.push_back(optarg);
+            break;
+        case longopt_input1list:
+            read_input_list(optarg, in1_names);
+            break;
+        case longopt_input2list:
+            read_input_list(optarg, in2_names);
             break;
         case 'a':
             first_name = optarg;
@@ -316,29 +452,218 @@ int main(int argc, char** argv)
             break;
         case 'n':
             mixed_ordering = true;
+            ordering_given = true;
             break;
         case 'N':
             mixed_ordering = false;
+            ordering_given = true;
             break;
         case 's':
             scoring_method_string = std::string(optarg);
             break;
+        case 'O':
+            output_format_string = std::string(optarg);
+            break;
+        case longopt_ref1:
+            ref1_name = optarg;
+            break;
+        case longopt_ref2:
+            ref2_name = optarg;
+            break;
+        case longopt_refcache:
+            ref_cache_pattern = std::string(optarg);
+            break;
+        case longopt_checkpoint:
+            checkpoint_name = optarg;
+            break;
+        case longopt_checkpointinterval:
+            checkpoint_interval = strtoull(optarg, NULL, 10);
+            break;
+        case longopt_resume:
+            resume = true;
+            break;
+        case longopt_prefetch:
+            prefetch_depth = atoi(optarg);
+            break;
+        case longopt_single:
+            single = true;
+            break;
+        case longopt_prefix1:
+            prefixes1.push_back(std::string(optarg));
+            break;
+        case longopt_prefix2:
+            prefixes2.push_back(std::string(optarg));
+            break;
+        case longopt_contigs1:
+            contigs1_name = optarg;
+            break;
+        case longopt_contigs2:
+            contigs2_name = optarg;
+            break;
+        case longopt_jobs:
+            jobs = atoi(optarg);
+            if(jobs < 1)
+            {
+                usage();
+            }
+            break;
+        case longopt_maxgroupmem:
+            // 0 is allowed here, meaning no limit.
+            max_group_mem = parse_size(optarg);
+            if(!max_group_mem && strcmp(optarg, "0") != 0)
+            {
+                usage();
+            }
+            break;
+        case longopt_maxmemory:
+            max_memory = parse_size(optarg);
+            if(!max_memory)
+            {
+                usage();
+            }
+            break;
+        case longopt_outputfmtfor:
+            category_formats.push_back(optarg);
+            break;
+        case longopt_estimate:
+            estimate_fraction = atof(optarg);
+            if(!(estimate_fraction > 0 && estimate_fraction <= 1))
+            {
+                usage();
+            }
+            break;
+        case longopt_tolerance:
+            tolerance = atof(optarg);
+            if(!(tolerance > 0 && tolerance < 1))
+            {
+                usage();
+            }
+            break;
+        case longopt_nopreflight:
+            preflight = false;
+            break;
+        case longopt_splitrg:
+            split_rg = true;
+            break;
+        case longopt_shards:
+            shards = atoi(optarg);
+            if(shards < 1 || shards > 4096)
+            {
+                usage();
+            }
+            break;
+        case longopt_stats:
+            stats = true;
+            break;
+        case longopt_affinity:
+            affinity = true;
+            break;
+        case longopt_allscores:
+            all_scores = true;
+            break;
+        case longopt_profile:
+#ifdef BAMCMP_NO_PROFILE
+            fprintf(stderr, "This bamcmp was built without --profile support\n");
+            exit(1);
+#endif
+            profile_name = optarg;
+            break;
+        case longopt_prefetchchunk:
+            prefetch_chunk = parse_size(optarg);
+            if(!prefetch_chunk)
+            {
+                usage();
+            }
+            break;
         default:
             usage();
         }
     }
 
-    if(in1_name == NULL)
+    const char* in1_name = in1_names.empty() ? NULL : in1_names[0].c_str();
+    const char* in2_name = in2_names.empty() ? NULL : in2_names[0].c_str();
+    if(batch != (optind == argc - 1) || (!batch && jobs))
+    {
+        usage();
+    }
+    if(batch && (in1_name || in2_name || first_name || second_name || firstbetter_name || secondbetter_name || firstworse_name || secondworse_name))
     {
+        fprintf(stderr, "In batch mode, inputs and outputs are given in the manifest\n");
         usage();
     }
-    if(in2_name == NULL)
+    if(batch && (single || checkpoint_name || prefetch_depth || affinity || split_rg || shards > 1))
     {
+        fprintf(stderr, "--single, --checkpoint, --prefetch, --affinity, --split-rg and --shards can't be used in batch mode\n");
         usage();
     }
-    if(!(first_name != NULL || second_name != NULL || firstbetter_name != NULL || secondbetter_name != NULL))
+    if(affinity && nthreads < 2)
     {
-        fprintf(stderr, "bamcmp is useless without at least one of -1, -2, -A or -B\n");
+        fprintf(stderr, "--affinity splits -t between an input and an output pool, so needs -t 2 or more\n");
+        usage();
+    }
+    if(split_rg && shards > 1)
+    {
+        fprintf(stderr, "--split-rg and --shards can't be used together\n");
+        usage();
+    }
+    if(checkpoint_name && (in1_names.size() > 1 || in2_names.size() > 1))
+    {
+        // A checkpoint records one offset per input.
+        fprintf(stderr, "--checkpoint can't be used with several files per input\n");
+        usage();
+    }
+    if(split_rg && checkpoint_name)
+    {
+        // Read group files are opened as their first records turn up, so a checkpoint can't cover them.
+        fprintf(stderr, "--split-rg can't be used with --checkpoint\n");
+        usage();
+    }
+
+    if(!batch)
+    {
+        if(in1_name == NULL)
+        {
+            usage();
+        }
+        if(single ? (in2_name != NULL) : (in2_name == NULL))
+        {
+            usage();
+        }
+        bool any_output = first_name || second_name || firstbetter_name || secondbetter_name || firstworse_name || secondworse_name;
+        if(estimate_fraction > 0 && any_output)
+        {
+            fprintf(stderr, "--estimate only reports category fractions; it doesn't write outputs\n");
+            usage();
+        }
+        if(estimate_fraction == 0 && !(first_name != NULL || second_name != NULL || firstbetter_name != NULL || secondbetter_name != NULL))
+        {
+            fprintf(stderr, "bamcmp is useless without at least one of -1, -2, -A or -B\n");
+            usage();
+        }
+    }
+    if(estimate_fraction > 0 && (batch || checkpoint_name))
+    {
+        fprintf(stderr, "--estimate can't be used with --checkpoint or in batch mode\n");
+        usage();
+    }
+    if(tolerance > 0 && estimate_fraction == 0)
+    {
+        fprintf(stderr, "--tolerance only applies to --estimate\n");
+        usage();
+    }
+
+    if(resume && !checkpoint_name)
+    {
+        fprintf(stderr, "--resume needs the --checkpoint file to resume from\n");
+        usage();
+    }
+    if(checkpoint_name && checkpoint_interval == 0)
+    {
+        usage();
+    }
+    if(checkpoint_name && single)
+    {
+        fprintf(stderr, "--checkpoint can't be used with --single\n");
         usage();
     }
 
@@ -363,253 +688,420 @@ int main(int argc, char** argv)
         usage();
     }
 
+    // -O sets every output's format; --output-fmt-for then overrides it for one category.
+    OutputFormat formats[BamCmpEngine::n_categories];
+    if(!formats[0].parse(output_format_string))
+    {
+        fprintf(stderr, "Can't parse output format %s\n", output_format_string.c_str());
+        usage();
+    }
+    for(int cat = 1; cat < BamCmpEngine::n_categories; ++cat)
+    {
+        formats[cat] = formats[0];
+    }
+    for(std::vector<std::string>::const_iterator it = category_formats.begin(), itend = category_formats.end(); it != itend; ++it)
+    {
+        size_t eq = it->find('=');
+        int cat = eq == std::string::npos ? -1 : BamCmpEngine::categoryOfKey(it->substr(0, eq));
+        if(cat < 0 || !formats[cat].parse(it->substr(eq + 1)))
+        {
+            fprintf(stderr, "Can't parse --output-fmt-for %s\n", it->c_str());
+            usage();
+        }
+    }
+    for(int cat = 0; cat < BamCmpEngine::n_categories; ++cat)
+    {
+        if(stats)
+        {
+            formats[cat].setStats(true);
+        }
+        // The counts would miss whatever the interrupted run already wrote.
+        if(resume && formats[cat].isStats())
+        {
+            fprintf(stderr, "Output statistics can't be used with --resume\n");
+            usage();
+        }
+    }
+
+    MemoryBudget::setLimit(max_memory);
+
+    // htslib consults REF_CACHE whenever a CRAM file needs a sequence by M5 tag, which
+    // is where each RefCache puts its FASTA's sequences.
+    if(batch || ref1_name || ref2_name)
+    {
+        setenv("REF_CACHE", ref_cache_pattern.c_str(), 1);
+    }
+
+    if(batch)
+    {
+        BatchRunner runner(argv[optind], scoringmethod, mixed_ordering, formats, ref1_name, ref2_name, ref_cache_pattern);
+        runner.setMaxGroupMemory(max_group_mem);
+        runner.setAllScores(all_scores);
+        if(!jobs)
+        {
+            jobs = std::max(1, nthreads / 4);
+        }
+        jobs = std::min(jobs, (int)runner.size());
+        // The join threads count against -t; whatever is left is shared by every sample's files.
+        int poolthreads = nthreads - jobs;
+        htsThreadPool pool = {NULL, 0};
+        if(poolthreads > 0)
+        {
+            pool.pool = hts_tpool_init(poolthreads);
+            if(!pool.pool)
+            {
+                fprintf(stderr, "Failed to create a pool of %d threads\n", poolthreads);
+                exit(1);
+            }
+        }
+        fprintf(stderr, "Batch: %lu samples, %d at a time, %d (de)compression threads\n", (unsigned long)runner.size(), jobs, poolthreads);
+        if(profile_name)
+        {
+            Profiler::start(profile_name);
+        }
+        runner.run(jobs, &pool);
+        Profiler::finish();
+        if(max_memory)
+        {
+            MemoryBudget::report();
+        }
+        if(pool.pool)
+        {
+            hts_tpool_destroy(pool.pool);
+        }
+        return 0;
+    }
+
+    // Catch mis-sorted inputs and missing tags in seconds, before any output exists.
+    if(preflight)
+    {
+        Preflight check(std::max(nthreads, 2));
+        for(size_t i = 0; i != in1_names.size(); ++i)
+        {
+            check.addFile(1, in1_names[i].c_str());
+        }
+        for(size_t i = 0; i != in2_names.size(); ++i)
+        {
+            check.addFile(2, in2_names[i].c_str());
+        }
+        check.run();
+        mixed_ordering = check.chooseOrdering(ordering_given, mixed_ordering);
+        bool matches = scoringmethod == scoringmethod_nmatches || all_scores;
+        check.checkTags(1, scoringmethod == scoringmethod_astag, matches && !ref1_name);
+        check.checkTags(2, scoringmethod == scoringmethod_astag, matches && !ref2_name);
+    }
+
+    // One pool serves decompression, compression and CRAM slice encoding for every file,
+    // unless --affinity gives the outputs a pool of their own on other CPUs.
+    htsThreadPool pool = {NULL, 0}, separate_out_pool = {NULL, 0};
+    htsThreadPool* out_pool = &pool;
+    if(affinity)
+    {
+        ThreadLayout layout(nthreads);
+        layout.createPools(&pool, &separate_out_pool);
+        layout.report();
+        out_pool = &separate_out_pool;
+    }
+    else if(nthreads > 1)
+    {
+        pool.pool = hts_tpool_init(nthreads);
+        if(!pool.pool)
+        {
+            fprintf(stderr, "Failed to create a pool of %d threads\n", nthreads);
+            exit(1);
+        }
+    }
+
+    RefCache *ref1 = NULL, *ref2 = NULL;
+    if(ref1_name)
+    {
+        ref1 = new RefCache(ref1_name, ref_cache_pattern);
+    }
+    if(ref2_name)
+    {
+        ref2 = new RefCache(ref2_name, ref_cache_pattern);
+    }
+
     htsFile *in1hf = NULL, *in2hf = NULL;
-    HTSFileWrapper *firstbetter_out = NULL, *secondbetter_out = NULL, *firstworse_out = NULL, *secondworse_out = NULL, *first_out = NULL, *second_out = NULL;
-    in1hf = hts_begin_or_die(in1_name, "r", 0, nthreads);
-    in2hf = hts_begin_or_die(in2_name, "r", 0, nthreads);
+    RecordSink *firstbetter_out = NULL, *secondbetter_out = NULL, *firstworse_out = NULL, *secondworse_out = NULL, *first_out = NULL, *second_out = NULL;
+    // Several files for one input are merged as they are read, each keeping its own file and header.
+    MergedReader *merged1 = NULL, *merged2 = NULL;
+    bam_hdr_t* header1;
+    bam_hdr_t* header2;
+    if(in1_names.size() > 1)
+    {
+        merged1 = new MergedReader(in1_names, &pool, ref1, mixed_ordering);
+        header1 = merged1->getHeader();
+    }
+    else
+    {
+        in1hf = RefCache::openInput(in1_name, &pool, ref1, &header1);
+    }
 
-    bam_hdr_t* header1 = sam_hdr_read(in1hf);
-    bam_hdr_t* header2 = sam_hdr_read(in2hf);
+    // In single-input mode both "inputs" share input 1's header and reference, so outputs
+    // never need the combined A_/B_ header.
+    int second_input = 2;
+    RefCache* second_ref = ref2;
+    if(single)
+    {
+        header2 = header1;
+        second_input = 1;
+        second_ref = ref1;
+    }
+    else if(in2_names.size() > 1)
+    {
+        merged2 = new MergedReader(in2_names, &pool, ref2, mixed_ordering);
+        header2 = merged2->getHeader();
+    }
+    else
+    {
+        in2hf = RefCache::openInput(in2_name, &pool, ref2, &header2);
+    }
 
     // Permit the outputs using like headers to share a file if they gave the same name.
 
     if(firstbetter_name)
     {
-        firstbetter_out = HTSFileWrapper::begin_or_die(firstbetter_name, "wb0", header1, 1, nthreads);
+        firstbetter_out = begin_output(split_rg, shards, firstbetter_name, formats[BamCmpEngine::first_better], header1, 1, out_pool, ref1);
     }
     if(secondbetter_name)
     {
-        secondbetter_out = HTSFileWrapper::begin_or_die(secondbetter_name, "wb0", header2, 2, nthreads);
+        secondbetter_out = begin_output(split_rg, shards, secondbetter_name, formats[BamCmpEngine::second_better], header2, second_input, out_pool, second_ref);
     }
     if(firstworse_name)
     {
-        firstworse_out = HTSFileWrapper::begin_or_die(firstworse_name, "wb0", header1, 1, nthreads);
+        firstworse_out = begin_output(split_rg, shards, firstworse_name, formats[BamCmpEngine::first_worse], header1, 1, out_pool, ref1);
     }
     if(secondworse_name)
     {
-        secondworse_out = HTSFileWrapper::begin_or_die(secondworse_name, "wb0", header2, 2, nthreads);
+        secondworse_out = begin_output(split_rg, shards, secondworse_name, formats[BamCmpEngine::second_worse], header2, second_input, out_pool, second_ref);
     }
     if(first_name)
     {
-        first_out = HTSFileWrapper::begin_or_die(first_name, "wb0", header1, 1, nthreads);
+        first_out = begin_output(split_rg, shards, first_name, formats[BamCmpEngine::first_only], header1, 1, out_pool, ref1);
     }
     if(second_name)
     {
-        second_out = HTSFileWrapper::begin_or_die(second_name, "wb0", header2, 2, nthreads);
+        second_out = begin_output(split_rg, shards, second_name, formats[BamCmpEngine::second_only], header2, second_input, out_pool, second_ref);
     }
 
-    SamReader in1(in1hf, header1, in1_name);
-    SamReader in2(in2hf, header2, in2_name);
-
-    BamRecVector seqs1, seqs2;
-    std::vector<HTSFileWrapper*> seqs1Files, seqs2Files;
-
-    while((!in1.is_eof()) && (!in2.is_eof()))
+    SamReader* reader1 = NULL;
+    SamReader* reader2 = NULL;
+    RecordSource* source1 = merged1;
+    RecordSource* source2 = merged2;
+    if(!merged1)
+    {
+        reader1 = new SamReader(in1hf, header1, in1_name, mixed_ordering, &pool);
+        source1 = reader1;
+    }
+    if(!single && !merged2)
     {
-        std::string qname1 = std::string(bam_get_qname(in1.getRec()));
-        std::string qname2 = std::string(bam_get_qname(in2.getRec()));
+        reader2 = new SamReader(in2hf, header2, in2_name, mixed_ordering, &pool);
+        source2 = reader2;
+    }
+    GenomeSplitter* splitter = NULL;
+    if(single)
+    {
+        splitter = new GenomeSplitter(source1, GenomeSplitter::assignGenomes(header1, prefixes1, prefixes2, contigs1_name, contigs2_name));
+    }
 
-        if(qname1 == qname2)
+    InputPrefetcher *prefetch1 = NULL, *prefetch2 = NULL;
+    if(prefetch_depth > 0)
+    {
+        if(merged1)
         {
-            seqs1.clear();
-            seqs2.clear();
-            seqs1Files.clear();
-            seqs2Files.clear();
-
-            std::string qn;
-            while((!in1.is_eof()) && (qn = bam_get_qname(in1.getRec())) == qname1)
-            {
-                seqs1.copy_add(in1.getRec());
-                in1.next();
-            }
-
-            seqs1.sort();
-            seqs1Files.resize(seqs1.size(), 0);
-
-            while((!in2.is_eof()) && (qn = bam_get_qname(in2.getRec())) == qname2)
-            {
-                seqs2.copy_add(in2.getRec());
-                in2.next();
-            }
-
-            seqs2.sort();
-            seqs2Files.resize(seqs2.size(), 0);
-
-            unsigned int idx1 = 0, idx2 = 0;
-            while(idx1 < seqs1.size() && idx2 < seqs2.size())
-            {
-                if(bamrec_eq(seqs1.get(idx1), seqs2.get(idx2)))
-                {
-                    uint32_t score1 = 0;
-                    uint32_t score2 = 0;
-
-                    int group_start_idx1 = idx1, group_start_idx2 = idx2;
-
-                    score1 = get_alignment_score(seqs1.get(idx1), true);
-                    score2 = get_alignment_score(seqs2.get(idx2), false);
-
-                    // Either input may have multiple candidate matches. Compare the best match found in each group
-                    // and then emit the whole group as firstbetter or secondbetter.
-
-                    while(idx1 + 1 < seqs1.size() && bamrec_eq(seqs1.get(group_start_idx1), seqs1.get(idx1 + 1)))
-                    {
-                        ++idx1;
-                        score1 = std::max(score1, get_alignment_score(seqs1.get(idx1), true));
-                    }
-
-                    while(idx2 + 1 < seqs2.size() && bamrec_eq(seqs1.get(group_start_idx1), seqs2.get(idx2 + 1)))
-                    {
-                        ++idx2;
-                        score2 = std::max(score2, get_alignment_score(seqs2.get(idx2), false));
-                    }
-
-                    for(uint32_t i = group_start_idx1; i <= idx1; ++i)
-                    {
-                        bam_aux_append(seqs1.get(i), "as", 'i', sizeof(uint32_t), (uint8_t*)&score1);
-                        bam_aux_append(seqs1.get(i), "bs", 'i', sizeof(uint32_t), (uint8_t*)&score2);
-                    }
-
-                    for(uint32_t i = group_start_idx2; i <= idx2; ++i)
-                    {
-                        bam_aux_append(seqs2.get(i), "as", 'i', sizeof(uint32_t), (uint8_t*)&score1);
-                        bam_aux_append(seqs2.get(i), "bs", 'i', sizeof(uint32_t), (uint8_t*)&score2);
-                    }
-
-                    HTSFileWrapper *firstRecordsFile, *secondRecordsFile;
-
-                    if(score1 > score2)
-                    {
-                        firstRecordsFile = firstbetter_out;
-                        secondRecordsFile = secondworse_out;
-                    }
-                    else
-                    {
-                        firstRecordsFile = firstworse_out;
-                        secondRecordsFile = secondbetter_out;
-                    }
-
-                    for(uint32_t i = group_start_idx1; i <= idx1; ++i)
-                    {
-                        seqs1Files[i] = firstRecordsFile;
-                    }
-
-                    for(uint32_t i = group_start_idx2; i <= idx2; ++i)
-                    {
-                        seqs2Files[i] = secondRecordsFile;
-                    }
-                    ++idx1;
-                    ++idx2;
-                }
-                else if(bamrec_lt(seqs1.get(idx1), seqs2.get(idx2)))
-                {
-                    seqs1Files[idx1] = first_out;
-                    ++idx1;
-                }
-                else
-                {
-                    seqs2Files[idx2] = second_out;
-                    ++idx2;
-                }
-            }
-
-            for(; idx1 < seqs1.size(); ++idx1)
-            {
-                seqs1Files[idx1] = first_out;
-            }
-
-            for(; idx2 < seqs2.size(); ++idx2)
-            {
-                seqs2Files[idx2] = second_out;
-            }
-
-            // Figure out whether we're splitting the mates up in either case.
-            // If they are split up, clear mate information to make the file consistent.
-            if(!uniqueValue(seqs1Files))
-            {
-                clearMateInfo(seqs1);
-            }
+            merged1->setPrefetch(prefetch_depth, prefetch_chunk);
+        }
+        else
+        {
+            prefetch1 = new InputPrefetcher(in1_name, prefetch_depth, prefetch_chunk);
+            reader1->setPrefetcher(prefetch1);
+            fprintf(stderr, "Read-ahead: %d x %llu bytes for %s (%s)\n", prefetch_depth, (unsigned long long)prefetch_chunk, in1_name, prefetch1->backendName());
+        }
+        if(merged2)
+        {
+            merged2->setPrefetch(prefetch_depth, prefetch_chunk);
+        }
+        else if(reader2)
+        {
+            prefetch2 = new InputPrefetcher(in2_name, prefetch_depth, prefetch_chunk);
+            reader2->setPrefetcher(prefetch2);
+            fprintf(stderr, "Read-ahead: %d x %llu bytes for %s (%s)\n", prefetch_depth, (unsigned long long)prefetch_chunk, in2_name, prefetch2->backendName());
+        }
+    }
 
-            if(!uniqueValue(seqs2Files))
-            {
-                clearMateInfo(seqs2);
-            }
+    // Where an input's unmatched records go nowhere, a qname index beside it lets the join
+    // seek past them instead of decoding them.
+    QnameIndex *index1 = NULL, *index2 = NULL;
+    if(reader1 && !single && !first_name && estimate_fraction == 0 && reader1->is_seekable())
+    {
+        index1 = QnameIndex::load(in1_name, mixed_ordering);
+    }
+    if(reader2 && !second_name && estimate_fraction == 0 && reader2->is_seekable())
+    {
+        index2 = QnameIndex::load(in2_name, mixed_ordering);
+    }
+    if(index1)
+    {
+        reader1->setIndex(index1);
+        fprintf(stderr, "Using qname index %s.qni (%lu entries)\n", in1_name, (unsigned long)index1->size());
+    }
+    if(index2)
+    {
+        reader2->setIndex(index2);
+        fprintf(stderr, "Using qname index %s.qni (%lu entries)\n", in2_name, (unsigned long)index2->size());
+    }
 
-            for(int i = 0, ilim = seqs1.size(); i != ilim; ++i)
-            {
-                if(seqs1Files[i])
-                {
-                    seqs1Files[i]->write1(1, seqs1.get(i));
-                }
-            }
-            for(int i = 0, ilim = seqs2.size(); i != ilim; ++i)
-            {
-                if(seqs2Files[i])
-                {
-                    seqs2Files[i]->write1(2, seqs2.get(i));
-                }
-            }
+    Checkpoint* checkpoint = NULL;
+    if(checkpoint_name)
+    {
+        if(!(reader1->is_seekable() && reader2->is_seekable()))
+        {
+            fprintf(stderr, "--checkpoint needs both inputs to be BAM\n");
+            exit(1);
         }
-        else if(qname_cmp(qname1.c_str(), qname2.c_str()) < 0)
+        const std::vector<std::pair<std::string, HTSFileWrapper*> >& outs = HTSFileWrapper::getOpenOutputs();
+        for(std::vector<std::pair<std::string, HTSFileWrapper*> >::const_iterator it = outs.begin(), itend = outs.end(); it != itend; ++it)
         {
-            if(first_out)
+            if(!it->second->canCheckpoint())
             {
-                first_out->write1(1, in1.getRec());
+                fprintf(stderr, "--checkpoint can't be used with CRAM output %s\n", it->first.c_str());
+                exit(1);
             }
-            in1.next();
         }
-        else
+        checkpoint = new Checkpoint(checkpoint_name, checkpoint_interval, reader1, reader2, mixed_ordering);
+        if(resume)
         {
-            if(second_out)
-            {
-                second_out->write1(2, in2.getRec());
-            }
-            in2.next();
+            checkpoint->resume();
         }
     }
 
-    // One or other file has reached EOF. Write the remainder as first- or second-only records.
-    if(first_out)
+    BamCmpEngine engine(scoringmethod, mixed_ordering);
+    engine.setSink(BamCmpEngine::first_only, first_out);
+    engine.setSink(BamCmpEngine::second_only, second_out);
+    engine.setSink(BamCmpEngine::first_better, firstbetter_out);
+    engine.setSink(BamCmpEngine::second_better, secondbetter_out);
+    engine.setSink(BamCmpEngine::first_worse, firstworse_out);
+    engine.setSink(BamCmpEngine::second_worse, secondworse_out);
+    engine.setCheckpoint(checkpoint);
+    engine.setMaxGroupMemory(max_group_mem);
+    engine.setAllScores(all_scores);
+    // Matching-bases scores can fall back on the references for inputs without MD or NM.
+    if(scoringmethod == scoringmethod_nmatches || all_scores)
     {
-        while(!in1.is_eof())
+        const FastaMap* fasta1 = ref1 ? ref1->sequences() : NULL;
+        const FastaMap* fasta2 = second_ref ? second_ref->sequences() : NULL;
+        if(fasta1)
         {
-            first_out->write1(1, in1.getRec());
-            in1.next();
+            engine.setReference(1, fasta1, header1);
         }
-    }
-
-    if(second_out)
-    {
-        while(!in2.is_eof())
+        if(fasta2)
         {
-            second_out->write1(2, in2.getRec());
-            in2.next();
+            engine.setReference(2, fasta2, header2);
         }
     }
+    Estimator* estimator = NULL;
+    if(estimate_fraction > 0)
+    {
+        estimator = new Estimator(estimate_fraction, tolerance);
+        engine.setEstimator(estimator);
+    }
+    // Don't decode what no output or score will look at. In single mode one reader feeds both sides.
+    int fields1 = single ? (engine.requiredFields(1) | engine.requiredFields(2)) : engine.requiredFields(1);
+    if(merged1)
+    {
+        merged1->setRequiredFields(fields1);
+    }
+    else
+    {
+        reader1->setRequiredFields(fields1);
+    }
+    if(merged2)
+    {
+        merged2->setRequiredFields(engine.requiredFields(2));
+    }
+    else if(reader2)
+    {
+        reader2->setRequiredFields(engine.requiredFields(2));
+    }
+    if(profile_name)
+    {
+        Profiler::start(profile_name);
+    }
+    if(splitter)
+    {
+        engine.runSplit(*splitter);
+    }
+    else
+    {
+        engine.run(*source1, *source2);
+    }
+    if(estimator)
+    {
+        estimator->report();
+        delete estimator;
+    }
 
-    hts_close(in1hf);
-    hts_close(in2hf);
+    delete prefetch1;
+    delete prefetch2;
+    delete splitter;
+    delete reader1;
+    delete reader2;
+    delete index1;
+    delete index2;
+    if(in1hf)
+    {
+        hts_close(in1hf);
+    }
+    if(in2hf)
+    {
+        hts_close(in2hf);
+    }
     if(first_out)
     {
-        HTSFileWrapper::close(first_out);
+        close_output(split_rg, shards, first_out);
     }
     if(second_out)
     {
-        HTSFileWrapper::close(second_out);
+        close_output(split_rg, shards, second_out);
     }
     if(firstbetter_out)
     {
-        HTSFileWrapper::close(firstbetter_out);
+        close_output(split_rg, shards, firstbetter_out);
     }
     if(secondbetter_out)
     {
-        HTSFileWrapper::close(secondbetter_out);
+        close_output(split_rg, shards, secondbetter_out);
     }
     if(firstworse_out)
     {
-        HTSFileWrapper::close(firstworse_out);
+        close_output(split_rg, shards, firstworse_out);
     }
     if(secondworse_out)
     {
-        HTSFileWrapper::close(secondworse_out);
+        close_output(split_rg, shards, secondworse_out);
+    }
+    // Merged inputs own the headers the outputs were written with.
+    delete merged1;
+    delete merged2;
+    if(checkpoint)
+    {
+        checkpoint->remove();
+        delete checkpoint;
+    }
+    Profiler::finish();
+    if(max_memory)
+    {
+        MemoryBudget::report();
+    }
+    if(pool.pool)
+    {
+        hts_tpool_destroy(pool.pool);
+    }
+    if(separate_out_pool.pool)
+    {
+        hts_tpool_destroy(separate_out_pool.pool);
     }
+    delete ref1;
+    delete ref2;
 }
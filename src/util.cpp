@@ -22,12 +22,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <string.h>
 #include <string>
+#include <htslib/hts_endian.h>
+#include <htslib/thread_pool.h>
 
-bool mixed_ordering = true;
-
-htsFile* hts_begin_or_die(const char* filename, const char* mode, bam_hdr_t* header, int nthreads)
+htsFile* hts_begin_or_die(const char* filename, const char* mode, bam_hdr_t* header, htsThreadPool* pool, const char* fai)
 {
     htsFile* hf = hts_open(filename, mode);
     if(hf == NULL)
@@ -35,18 +36,96 @@ htsFile* hts_begin_or_die(const char* filename, const char* mode, bam_hdr_t* hea
         fprintf(stderr, "Failed to open %s\n", filename);
         exit(1);
     }
+    if(pool && pool->pool)
+    {
+        hts_set_thread_pool(hf, pool);
+    }
+    // Needed before the header is written, since CRAM output derives M5 tags from it.
+    if(fai && hts_set_fai_filename(hf, fai))
+    {
+        fprintf(stderr, "Failed to use reference %s for %s\n", fai, filename);
+        exit(1);
+    }
     // header should be 0 if we're opening to read
     if(header != NULL && sam_hdr_write(hf, header))
     {
         fprintf(stderr, "Failed to write header for %s\n", filename);
         exit(1);
     }
-    if(nthreads != 1)
+
+    return hf;
+}
+
+// Roughly what htslib holds in buffers for an open file, for --max-memory's accounting:
+// a BGZF block (64K in, up to 64K out) for the file itself plus two per pool thread
+// queued or being (de)compressed, or for CRAM about 8MB per container in flight.
+uint64_t hts_buffer_bytes(htsFile* hf, htsThreadPool* pool)
+{
+    int nthreads = (pool && pool->pool) ? hts_tpool_size(pool->pool) : 0;
+    const htsFormat* fmt = hts_get_format(hf);
+    if(fmt->format == cram)
     {
-        hts_set_threads(hf, nthreads);
+        return (uint64_t)(8 << 20) * (1 + nthreads);
     }
+    if(fmt->compression == bgzf)
+    {
+        return (uint64_t)(128 << 10) * (1 + 2 * nthreads);
+    }
+    return 64 << 10;
+}
 
-    return hf;
+// What a parsed header occupies: its text plus the target name and length tables.
+uint64_t header_bytes(const bam_hdr_t* header)
+{
+    uint64_t bytes = sizeof(bam_hdr_t) + header->l_text + (uint64_t)header->n_targets * (sizeof(char*) + sizeof(uint32_t));
+    for(int32_t i = 0; i < header->n_targets; ++i)
+    {
+        bytes += strlen(header->target_name[i]) + 1;
+    }
+    return bytes;
+}
+
+// Parse a byte count with an optional K, M or G suffix; 0 if it doesn't parse.
+uint64_t parse_size(const char* str)
+{
+    char* end;
+    double n = strtod(str, &end);
+    if(end == str || n < 0)
+    {
+        return 0;
+    }
+    switch(toupper(*end))
+    {
+    case 'G':
+        n *= 1024;
+        // fall through
+    case 'M':
+        n *= 1024;
+        // fall through
+    case 'K':
+        n *= 1024;
+        ++end;
+        break;
+    default:
+        break;
+    }
+    if(*end)
+    {
+        return 0;
+    }
+    return (uint64_t)n;
+}
+
+// out.bam -> out.<infix>.bam, or out.<infix> if the name has no extension.
+std::string insert_before_extension(const std::string& fname, const std::string& infix)
+{
+    size_t slash = fname.rfind('/');
+    size_t dot = fname.rfind('.');
+    if(dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    {
+        return fname + "." + infix;
+    }
+    return fname.substr(0, dot) + "." + infix + fname.substr(dot);
 }
 
 // Borrowed from Samtools source, since samtools sort -n uses this ordering:
@@ -97,7 +176,8 @@ int strnum_cmp(const char *_a, const char *_b)
     return *pa? 1 : *pb? -1 : 0;
 }
 
-int qname_cmp(const char* qa, const char* qb)
+// mixed_ordering selects samtools sort -n ordering; otherwise Picard / htsjdk lexical ordering.
+int qname_cmp(const char* qa, const char* qb, bool mixed_ordering)
 {
     if(mixed_ordering)
     {
@@ -109,17 +189,91 @@ int qname_cmp(const char* qa, const char* qb)
     }
 }
 
-int flag2mate(const bam1_t* rec)
+static int aux_type_size(uint8_t type)
 {
-    if(rec->core.flag & BAM_FREAD1)
+    switch(type)
     {
+    case 'A':
+    case 'c':
+    case 'C':
         return 1;
+    case 's':
+    case 'S':
+        return 2;
+    case 'i':
+    case 'I':
+    case 'f':
+        return 4;
+    case 'd':
+        return 8;
+    default:
+        return -1;
     }
-    else if(rec->core.flag & BAM_FREAD2)
+}
+
+// Find NM, MD and AS in one walk over the aux block, rather than one bam_aux_get each.
+void scan_aux(const bam1_t* rec, AuxTags& tags)
+{
+    tags.nm = tags.md = tags.as = NULL;
+    const uint8_t* p = bam_get_aux(rec);
+    const uint8_t* end = rec->data + rec->l_data;
+    int wanted = 3;
+    while(wanted && end - p >= 3)
     {
-        return 2;
+        const uint8_t* value = p + 2;
+        if(p[0] == 'N' && p[1] == 'M' && !tags.nm)
+        {
+            tags.nm = value;
+            --wanted;
+        }
+        else if(p[0] == 'M' && p[1] == 'D' && !tags.md)
+        {
+            tags.md = value;
+            --wanted;
+        }
+        else if(p[0] == 'A' && p[1] == 'S' && !tags.as)
+        {
+            tags.as = value;
+            --wanted;
+        }
+
+        p = aux_next(p, end);
+        if(!p)
+        {
+            // Corrupt aux data; stop with whatever was found before it.
+            break;
+        }
+    }
+}
+
+// The aux field after the one at p, or NULL if the one at p is malformed.
+const uint8_t* aux_next(const uint8_t* p, const uint8_t* end)
+{
+    const uint8_t* value = p + 2;
+    int size = aux_type_size(*value);
+    if(size > 0)
+    {
+        p = value + 1 + size;
+    }
+    else if(*value == 'Z' || *value == 'H')
+    {
+        const uint8_t* nul = (const uint8_t*)memchr(value + 1, '\0', end - (value + 1));
+        if(!nul)
+        {
+            return NULL;
+        }
+        p = nul + 1;
+    }
+    else if(*value == 'B' && end - value >= 6 && aux_type_size(value[1]) > 0)
+    {
+        uint32_t n = le_to_u32(value + 2);
+        p = value + 6 + (uint64_t)n * aux_type_size(value[1]);
+    }
+    else
+    {
+        return NULL;
     }
-    return 0;
+    return p <= end ? p : NULL;
 }
 
 bool bamrec_eq(const bam1_t* a, const bam1_t* b)
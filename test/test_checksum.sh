@@ -0,0 +1,44 @@
+#!/bin/sh
+# --stats checksums against samtools checksum, on every output bamcmp writes from the
+# SAM fixtures in test/data. Skipped when no samtools with a checksum command is on the
+# path.
+#
+#   make check
+
+bamcmp=${1:-build/bamcmp}
+data=$(dirname "$0")/data
+
+if ! samtools checksum --help >/dev/null 2>&1 && ! samtools help 2>&1 | grep -q checksum; then
+    echo "test_checksum: skipped (no samtools checksum)"
+    exit 0
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+"$bamcmp" -n -s as -1 "$data/checksum1.sam" -2 "$data/checksum2.sam" \
+    -a "$tmp/a.bam" -b "$tmp/b.bam" -A "$tmp/A.bam" -B "$tmp/B.bam" -C "$tmp/C.bam" -D "$tmp/D.bam" --stats || exit 1
+
+failed=0
+for out in a b A B C D; do
+    bam="$tmp/$out.bam"
+    # samtools checksum's "all all" row, one "column value" pair per line.
+    samtools checksum "$bam" | awk '/^# *Group/ { for(i = 2; i <= NF; ++i) col[i - 1] = $i; next } $1 == "all" && $2 == "all" { for(i = 3; i <= NF; ++i) print col[i], $i }' > "$tmp/expected"
+    for key in count flag seq qual name aux combined; do
+        want=$(awk -v k="$key" '$1 == k { print $2 }' "$tmp/expected")
+        got=$(sed -n "s/^ *\"$key\": \"\{0,1\}\([0-9a-f]*\)\"\{0,1\},\{0,1\}$/\1/p" "$bam.stats.json" | tail -n 1)
+        if [ "$key" != count ]; then
+            want=$(echo "$want" | tr 'A-F' 'a-f' | sed 's/^0*//')
+            got=$(echo "$got" | sed 's/^0*//')
+        fi
+        if [ -z "$want" ] || [ "$want" != "$got" ]; then
+            echo "FAIL: $out.bam $key: samtools checksum says '$want', --stats says '$got'" >&2
+            failed=1
+        fi
+    done
+done
+
+if [ $failed != 0 ]; then
+    exit 1
+fi
+echo "test_checksum: ok"
@@ -0,0 +1,130 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// FastaMap's mismatch counting against a plain per-base count, over a reference mixing
+// cases and IUPAC codes and reads at odd and even query offsets, so the SIMD kernel and
+// the scalar path have to agree on every base.
+//
+//   make check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <htslib/sam.h>
+
+#include "FastaMap.h"
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what)
+{
+    if(!ok)
+    {
+        fprintf(stderr, "FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+// What the BAM 4-bit code of a reference base is taken to be: A, C, G and T in either
+// case, anything else N.
+static uint8_t naiveCode(char c)
+{
+    switch(c)
+    {
+        case 'A': case 'a': return 1;
+        case 'C': case 'c': return 2;
+        case 'G': case 'g': return 4;
+        case 'T': case 't': return 8;
+        default: return 15;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char bases[] = "ACGTacgtNnRYSWKMBDHVryswkmbdhv";
+    const int64_t length = 5000;
+    const int64_t lineBases = 60;
+    srand(1);
+
+    std::string seq;
+    for(int64_t i = 0; i < length; ++i)
+    {
+        // Mostly ACGT, so matches are common enough to matter.
+        int pick = rand() % 4 ? rand() % 8 : rand() % (sizeof(bases) - 1);
+        seq += bases[pick];
+    }
+
+    char fasta[] = "/tmp/test_fastamapXXXXXX";
+    int fd = mkstemp(fasta);
+    expect(fd >= 0, "created a temporary FASTA");
+    FILE* f = fdopen(fd, "w");
+    fprintf(f, ">chr1\n");
+    long offset = ftell(f);
+    for(int64_t i = 0; i < length; i += lineBases)
+    {
+        fprintf(f, "%s\n", seq.substr(i, lineBases).c_str());
+    }
+    fclose(f);
+    std::string fai = std::string(fasta) + ".fai";
+    f = fopen(fai.c_str(), "w");
+    fprintf(f, "chr1\t%lld\t%ld\t%lld\t%lld\n", (long long)length, offset, (long long)lineBases, (long long)lineBases + 1);
+    fclose(f);
+
+    FastaMap map(fasta);
+    const FastaMap::Entry* e = map.find("chr1");
+    expect(e != NULL, "found chr1 in the index");
+
+    const int32_t maxLen = 300;
+    uint8_t packed[(maxLen + 1) / 2 + 1];
+    for(int trial = 0; e && trial < 20000; ++trial)
+    {
+        int32_t qpos = rand() % 2;
+        int32_t len = rand() % (maxLen - qpos) + 1;
+        int64_t pos = rand() % (length - len + 1);
+        for(size_t i = 0; i < sizeof(packed); ++i)
+        {
+            // Every 4-bit code, = (0) and N (15) included.
+            packed[i] = (uint8_t)rand();
+        }
+        uint32_t expected = 0;
+        for(int32_t i = 0; i < len; ++i)
+        {
+            uint8_t q = bam_seqi(packed, qpos + i);
+            expected += (q != 0 && q != naiveCode(seq[pos + i]));
+        }
+        if(map.countMismatches(e, pos, packed, qpos, len) != expected)
+        {
+            fprintf(stderr, "pos %lld qpos %d len %d: got %u, expected %u\n", (long long)pos, qpos, len, map.countMismatches(e, pos, packed, qpos, len), expected);
+            expect(false, "mismatch count agrees with a per-base count");
+            break;
+        }
+    }
+
+    unlink(fai.c_str());
+    unlink(fasta);
+    if(failures)
+    {
+        return 1;
+    }
+    printf("test_fastamap: ok\n");
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// --single's splitting: every output record accounted for, and the split queues never
+// holding more than one qname group, even when one genome has no alignments at all.
+//
+//   make check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <htslib/sam.h>
+
+#include "BamCmpEngine.h"
+#include "GenomeSplitter.h"
+#include "MemoryBudget.h"
+#include "RecordSink.h"
+#include "RecordSource.h"
+
+class VectorSource : public RecordSource
+{
+    public:
+        VectorSource(const std::vector<bam1_t*>& _recs) : recs(_recs), pos(0) {}
+        bool is_eof() const { return pos == recs.size(); }
+        void next() { ++pos; }
+        bam1_t* getRec() { return recs[pos]; }
+    private:
+        const std::vector<bam1_t*>& recs;
+        size_t pos;
+};
+
+static void countRecord(int headerNum, bam1_t* rec, void* data)
+{
+    ++*(uint64_t*)data;
+}
+
+// A 50-base read aligned as 50M on tid, with MAPQ 60 and NM 0.
+static bam1_t* makeRecord(const char* qname, uint16_t flag, int32_t tid)
+{
+    const int len = 50;
+    bam1_t* rec = bam_init1();
+    int l_qname = strlen(qname) + 1;
+    rec->core.tid = tid;
+    rec->core.pos = 1000;
+    rec->core.qual = 60;
+    rec->core.flag = flag;
+    rec->core.l_qname = l_qname;
+    rec->core.n_cigar = 1;
+    rec->core.l_qseq = len;
+    rec->core.mtid = tid;
+    rec->core.mpos = 1200;
+    rec->l_data = l_qname + 4 + (len + 1) / 2 + len;
+    rec->m_data = rec->l_data;
+    rec->data = (uint8_t*)calloc(rec->m_data, 1);
+    memcpy(rec->data, qname, l_qname);
+    uint32_t cigar = bam_cigar_gen(len, BAM_CMATCH);
+    memcpy(rec->data + l_qname, &cigar, 4);
+    memset(bam_get_qual(rec), 30, len);
+    int32_t nm = 0;
+    bam_aux_append(rec, "NM", 'i', sizeof(nm), (uint8_t*)&nm);
+    bam_aux_append(rec, "AS", 'i', sizeof(nm), (uint8_t*)&nm);
+    return rec;
+}
+
+struct Counts
+{
+    uint64_t out[BamCmpEngine::n_categories];
+};
+
+// Split recs with tid 0 in genome 1 and tid 1 in genome 2, and count each category's output.
+static Counts runSplit(const std::vector<bam1_t*>& recs)
+{
+    Counts counts;
+    memset(&counts, 0, sizeof(counts));
+    std::vector<CallbackSink*> sinks;
+    BamCmpEngine engine(scoringmethod_mapq, true);
+    for(int cat = 0; cat < BamCmpEngine::n_categories; ++cat)
+    {
+        sinks.push_back(new CallbackSink(countRecord, &counts.out[cat]));
+        engine.setSink((BamCmpEngine::category)cat, sinks.back());
+    }
+    std::vector<int> genomes;
+    genomes.push_back(1);
+    genomes.push_back(2);
+    VectorSource source(recs);
+    GenomeSplitter splitter(&source, genomes);
+    engine.runSplit(splitter);
+    for(size_t i = 0; i < sinks.size(); ++i)
+    {
+        delete sinks[i];
+    }
+    return counts;
+}
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what)
+{
+    if(!ok)
+    {
+        fprintf(stderr, "FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const size_t pairs = 20000;
+    char qname[32];
+
+    // Genome 2 has no alignments at all: everything is genome-1-only, and the queues
+    // never get past one pair.
+    std::vector<bam1_t*> recs;
+    for(size_t i = 0; i < pairs; ++i)
+    {
+        snprintf(qname, sizeof(qname), "read%010lu", (unsigned long)i);
+        recs.push_back(makeRecord(qname, BAM_FPAIRED | BAM_FREAD1, 0));
+        recs.push_back(makeRecord(qname, BAM_FPAIRED | BAM_FREAD2, 0));
+    }
+    // Room for a pair with one mate in both genomes, allowing for htslib rounding up allocations.
+    uint64_t pairBytes = 4 * (sizeof(bam1_t) + 2 * recs[0]->l_data);
+    Counts counts = runSplit(recs);
+    expect(counts.out[BamCmpEngine::first_only] == 2 * pairs, "genome-2-free input: every record is genome-1-only");
+    expect(counts.out[BamCmpEngine::second_only] == 0, "genome-2-free input: nothing is genome-2-only");
+    expect(MemoryBudget::getPeak(MemoryBudget::component_splitter) <= pairBytes, "genome-2-free input: splitter held more than one qname group");
+
+    // Alternate pairs between the genomes, with every fourth pair's second mate unmapped.
+    // Unmapped records belong to both genomes, so those mates are compared.
+    for(size_t i = 0; i < recs.size(); ++i)
+    {
+        bam_destroy1(recs[i]);
+    }
+    recs.clear();
+    uint64_t unmapped = 0;
+    for(size_t i = 0; i < pairs; ++i)
+    {
+        snprintf(qname, sizeof(qname), "read%010lu", (unsigned long)i);
+        bool mate2Unmapped = i % 4 == 3;
+        unmapped += mate2Unmapped;
+        recs.push_back(makeRecord(qname, BAM_FPAIRED | BAM_FREAD1, i % 2));
+        recs.push_back(makeRecord(qname, BAM_FPAIRED | BAM_FREAD2 | (mate2Unmapped ? BAM_FUNMAP : 0), i % 2));
+    }
+    counts = runSplit(recs);
+    uint64_t oneSided = counts.out[BamCmpEngine::first_only] + counts.out[BamCmpEngine::second_only];
+    uint64_t compared = counts.out[BamCmpEngine::first_better] + counts.out[BamCmpEngine::second_better] +
+                        counts.out[BamCmpEngine::first_worse] + counts.out[BamCmpEngine::second_worse];
+    expect(oneSided == 2 * pairs - unmapped, "mixed input: mapped mates are one-sided");
+    expect(compared == 2 * unmapped, "mixed input: unmapped mates are compared in both genomes");
+    expect(MemoryBudget::getPeak(MemoryBudget::component_splitter) <= pairBytes, "mixed input: splitter held more than one qname group");
+
+    for(size_t i = 0; i < recs.size(); ++i)
+    {
+        bam_destroy1(recs[i]);
+    }
+    if(failures)
+    {
+        return 1;
+    }
+    printf("test_genome_splitter: ok\n");
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+bamcmp, A program separates human and non-human DNA or RNA from contaminated
+short reads produced by NGS
+
+Copyright (C) 2016  Christopher Smowton
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Pre-flight sampling on small multi-block name-sorted BAMs, where the 16 sample
+// windows are closer together than the data each would read: sorted files must pass
+// under both orderings, and an unsorted one must still be caught.
+//
+//   make check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <htslib/bgzf.h>
+#include <htslib/sam.h>
+
+#include "Preflight.h"
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what)
+{
+    if(!ok)
+    {
+        fprintf(stderr, "FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+// A 50-base read aligned as 50M, with NM and AS.
+static bam1_t* makeRecord(const char* qname)
+{
+    const int len = 50;
+    bam1_t* rec = bam_init1();
+    int l_qname = strlen(qname) + 1;
+    rec->core.tid = 0;
+    rec->core.pos = 1000;
+    rec->core.qual = 60;
+    rec->core.l_qname = l_qname;
+    rec->core.n_cigar = 1;
+    rec->core.l_qseq = len;
+    rec->core.mtid = -1;
+    rec->core.mpos = -1;
+    rec->l_data = l_qname + 4 + (len + 1) / 2 + len;
+    rec->m_data = rec->l_data;
+    rec->data = (uint8_t*)calloc(rec->m_data, 1);
+    memcpy(rec->data, qname, l_qname);
+    uint32_t cigar = bam_cigar_gen(len, BAM_CMATCH);
+    memcpy(rec->data + l_qname, &cigar, 4);
+    memset(bam_get_qual(rec), 30, len);
+    int32_t zero = 0;
+    bam_aux_append(rec, "NM", 'i', sizeof(zero), (uint8_t*)&zero);
+    bam_aux_append(rec, "AS", 'i', sizeof(zero), (uint8_t*)&zero);
+    return rec;
+}
+
+// Write nrecs records named in order (or in reverse) at the given compression level,
+// ending a BGZF block every blockRecs records if that's non-zero.
+static void writeBam(const char* fname, const char* mode, int nrecs, int blockRecs, bool reverse)
+{
+    static const char text[] = "@HD\tVN:1.6\tSO:queryname\n@SQ\tSN:chr1\tLN:100000\n";
+    htsFile* hf = hts_open(fname, mode);
+    bam_hdr_t* header = sam_hdr_parse(strlen(text), text);
+    if(!hf || !header || sam_hdr_write(hf, header) < 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", fname);
+        exit(1);
+    }
+    for(int i = 0; i < nrecs; ++i)
+    {
+        char qname[32];
+        snprintf(qname, sizeof(qname), "read%06d", reverse ? nrecs - 1 - i : i);
+        bam1_t* rec = makeRecord(qname);
+        if(sam_write1(hf, header, rec) < 0)
+        {
+            fprintf(stderr, "Failed to write %s\n", fname);
+            exit(1);
+        }
+        bam_destroy1(rec);
+        if(blockRecs && (i + 1) % blockRecs == 0)
+        {
+            bgzf_flush(hts_get_bgzfp(hf));
+        }
+    }
+    bam_hdr_destroy(header);
+    hts_close(hf);
+}
+
+// Does pre-flight accept fname with the given ordering? Pre-flight exits on failure, so
+// it runs in a child.
+static bool passes(const char* fname, bool mixed_ordering)
+{
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        Preflight check(2);
+        check.addFile(1, fname);
+        check.run();
+        check.chooseOrdering(true, mixed_ordering);
+        check.checkTags(1, true, true);
+        _exit(0);
+    }
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char** argv)
+{
+    char fname[] = "/tmp/test_preflightXXXXXX";
+    int fd = mkstemp(fname);
+    expect(fd >= 0, "created a temporary BAM");
+    close(fd);
+
+    // Uncompressed, about 600KB in full 64KB blocks: several samples start in one block.
+    writeBam(fname, "wb0", 4000, 0, false);
+    expect(passes(fname, true), "level 0 BAM passes in samtools -n order");
+    expect(passes(fname, false), "level 0 BAM passes in Picard order");
+
+    // Compressed, so a handful of blocks in all.
+    writeBam(fname, "wb", 4000, 0, false);
+    expect(passes(fname, true), "compressed BAM passes in samtools -n order");
+    expect(passes(fname, false), "compressed BAM passes in Picard order");
+
+    // Many tiny blocks, most sample windows holding several.
+    writeBam(fname, "wb0", 600, 7, false);
+    expect(passes(fname, true), "small-block BAM passes in samtools -n order");
+    expect(passes(fname, false), "small-block BAM passes in Picard order");
+
+    writeBam(fname, "wb0", 4000, 0, true);
+    expect(!passes(fname, true), "reverse-sorted BAM fails in samtools -n order");
+    expect(!passes(fname, false), "reverse-sorted BAM fails in Picard order");
+
+    unlink(fname);
+    if(failures)
+    {
+        return 1;
+    }
+    printf("test_preflight: ok\n");
+    return 0;
+}